@@ -28,6 +28,7 @@
 #include "../inc/tm4c123gh6pm.h"
 #include "ADC.h"
 #include "os.h"
+#include "jitter.h"
 
 /*
 #define NVIC_EN0_INT17          0x00020000  // Interrupt 17 enable
@@ -73,6 +74,7 @@ void EndCritical(long sr);    // restore I bit to previous value
 void (*ADC0SS0Task)(unsigned long);
 void (*ADC0SS1Task)(unsigned long);
 void (*ADC0SS2Task)(unsigned long);
+static JitterProbeType ADC0SS2Probe;  // sample to sample jitter of ADC_Collect
 void (*ADC0SS3Task)(unsigned long);
 
 // Values read out
@@ -324,6 +326,7 @@ int ADC_Collect(uint32_t channelNum, uint32_t freq, void (*task)(unsigned long))
   
   uint32_t period = TIME_1MS * 1000 / freq;
   ADC0SS2Task = task;
+  Jitter_Add(&ADC0SS2Probe, "ADC0 SS2", period);
   
   ADC_InitTimer2A(period);
   ADC_InitGPIO(channelNum);
@@ -335,16 +338,21 @@ int ADC_Collect(uint32_t channelNum, uint32_t freq, void (*task)(unsigned long))
 
 void ADC0Seq2_Handler(void){
   ADC0_ISC_R = 0x04; // acknowledge ADC sequence 2 completion
+  unsigned long isrStart = OS_IsrStart(16);
+  Jitter_Mark(&ADC0SS2Probe);
   unsigned long ADC0SS2Value = ADC0_SSFIFO2_R & 0xFFF;
 
   if(ADC0SS2Task != NULL)
       ADC0SS2Task(ADC0SS2Value);
+  OS_IsrEnd(16, isrStart);
 }
 
 void ADC0Seq3_Handler(void){
   ADC0_ISC_R = 0x08; // acknowledge ADC sequence 3 completion
+  unsigned long isrStart = OS_IsrStart(17);
   unsigned long ADC0SS3Value = ADC0_SSFIFO3_R & 0xFFF;
   ADC0SS3Task(ADC0SS3Value);
+  OS_IsrEnd(17, isrStart);
 }
 
 // *** ADC_In ***
@@ -113,4 +113,80 @@ unsigned short NAME ## Fifo_Size (void){\
 // SIZE can be any size
 // creates RxFifo_Init() RxFifo_Get() and RxFifo_Put()
 
+// macro to create a lock-free single producer, single consumer FIFO
+// One side (typically an ISR) only ever calls Put/Reserve/Commit and the
+// other only Get/Peek/Release, so no critical sections are needed: the
+// producer alone writes PutI, the consumer alone writes GetI. The barrier
+// orders the data accesses against the index update that publishes them,
+// so the other side never sees an index ahead of the data it covers.
+// Reserve hands the producer the largest contiguous free span so it can
+// write in place, then Commit(n) publishes n elements; Peek and Release do
+// the same for the consumer.
+#ifdef __ARMCC_VERSION
+#define FIFO_BARRIER() __dmb(0xF)
+#else
+#define FIFO_BARRIER() __sync_synchronize()
+#endif
+#define AddSPSCFifo(NAME,SIZE,TYPE,SUCCESS,FAIL) \
+uint32_t volatile NAME ## PutI;    \
+uint32_t volatile NAME ## GetI;    \
+TYPE static NAME ## Fifo [SIZE];        \
+void NAME ## Fifo_Init(void){           \
+  NAME ## PutI = NAME ## GetI = 0;      \
+}                                       \
+int NAME ## Fifo_Put (TYPE data){       \
+  uint32_t putI = NAME ## PutI;         \
+  if((putI - NAME ## GetI) & ~(SIZE-1)){\
+    return(FAIL);                       \
+  }                                     \
+  NAME ## Fifo[putI & (SIZE-1)] = data; \
+  FIFO_BARRIER();                       \
+  NAME ## PutI = putI + 1;              \
+  return(SUCCESS);                      \
+}                                       \
+int NAME ## Fifo_Get (TYPE *datapt){    \
+  uint32_t getI = NAME ## GetI;         \
+  if(NAME ## PutI == getI){             \
+    return(FAIL);                       \
+  }                                     \
+  FIFO_BARRIER();                       \
+  *datapt = NAME ## Fifo[getI & (SIZE-1)]; \
+  FIFO_BARRIER();                       \
+  NAME ## GetI = getI + 1;              \
+  return(SUCCESS);                      \
+}                                       \
+uint32_t NAME ## Fifo_Reserve (TYPE **span){ \
+  uint32_t putI = NAME ## PutI;         \
+  uint32_t room = SIZE - (putI - NAME ## GetI); \
+  uint32_t toEnd = SIZE - (putI & (SIZE-1)); \
+  FIFO_BARRIER();                       \
+  *span = &NAME ## Fifo[putI & (SIZE-1)]; \
+  return room < toEnd ? room : toEnd;   \
+}                                       \
+void NAME ## Fifo_Commit (uint32_t n){  \
+  FIFO_BARRIER();                       \
+  NAME ## PutI = NAME ## PutI + n;      \
+}                                       \
+uint32_t NAME ## Fifo_Peek (TYPE **span){ \
+  uint32_t getI = NAME ## GetI;         \
+  uint32_t count = NAME ## PutI - getI; \
+  uint32_t toEnd = SIZE - (getI & (SIZE-1)); \
+  FIFO_BARRIER();                       \
+  *span = &NAME ## Fifo[getI & (SIZE-1)]; \
+  return count < toEnd ? count : toEnd; \
+}                                       \
+void NAME ## Fifo_Release (uint32_t n){ \
+  FIFO_BARRIER();                       \
+  NAME ## GetI = NAME ## GetI + n;      \
+}                                       \
+uint32_t NAME ## Fifo_Size (void){      \
+ return NAME ## PutI - NAME ## GetI;    \
+}
+// e.g.,
+// AddSPSCFifo(Adc,256,uint16_t, 1,0)
+// SIZE must be a power of two
+// creates AdcFifo_Init() AdcFifo_Put() AdcFifo_Get() AdcFifo_Size()
+// and the zero copy AdcFifo_Reserve()/Commit() and AdcFifo_Peek()/Release()
+// Init must run before either side starts
+
 #endif //  __FIFO_H__
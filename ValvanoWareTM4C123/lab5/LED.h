@@ -1,9 +1,11 @@
 //LED.h
 
+#ifndef SIM
 #define PF1       (*((volatile unsigned long *)0x40025008))
 #define PF2       (*((volatile unsigned long *)0x40025010))
 #define PF3       (*((volatile unsigned long *)0x40025020))
 #define LEDS      (*((volatile unsigned long *)0x40025038))
+#endif
 #define RED       0x02
 #define BLUE      0x04
 #define GREEN     0x08
@@ -36,6 +36,8 @@
 #include "ff.h"
 #include "diskio.h"
 #include "heap.h"
+#include "FIFO.h"
+#include "bench.h"
 
 #define PE0  (*((volatile unsigned long *)0x40024004))
 #define PE1  (*((volatile unsigned long *)0x40024008))
@@ -92,6 +94,7 @@ void SW2Push(void){
 }
 
 void IdleTask(void){
+  OS_SetIdle();
   while(1){;}
 }
 
@@ -105,6 +108,7 @@ void LaunchProc(void){
 //uint32_t dummy_data[1];
 
 void idle_proc(void) {
+	OS_SetIdle();
 	while(1)
 		OS_Suspend();
 }
@@ -121,7 +125,7 @@ int main(void){
   
   //OS_AddPeriodicThread(&disk_timerproc,80000,0);
   OS_AddProcess(&idle_proc, 0, 0, 128, 7);
-	OS_AddProcess(&Interpreter, 0, 0, 128, 7);
+	OS_AddProcess(&Interpreter, 0, 0, 1024, 7);
   //OS_AddThread(&LaunchProc,128,1);
   
 //  ELFEnv_t env;
@@ -144,6 +148,309 @@ int main(void){
   */
 }
 
+//*******************Mutex latency test****************
+// MutexLow holds TestMutex for a short critical section, MutexMedium
+// hogs the CPU in bursts and MutexHigh measures how long it waits for
+// the mutex. With priority inheritance the wait is bounded by MutexLow's
+// critical section, no matter how long MutexMedium runs.
+MutexType TestMutex;
+unsigned long MaxMutexWait;   // in 12.5ns units
+
+void MutexLow(void){
+  while(1){
+    OS_MutexLock(&TestMutex);
+    for(volatile int i = 0; i < 1000; i++){;}    // critical section
+    OS_MutexUnlock(&TestMutex);
+    OS_Suspend();
+  }
+}
+
+void MutexMedium(void){
+  while(1){
+    OS_Sleep(2);
+    for(volatile int i = 0; i < 100000; i++){;}  // about 10 ms of work
+  }
+}
+
+void MutexHigh(void){
+  unsigned long start, wait;
+  for(int n = 0; n < 1000; n++){
+    OS_Sleep(3);
+    start = OS_Time();
+    OS_MutexLock(&TestMutex);
+    wait = OS_TimeDifference(start, OS_Time());
+    OS_MutexUnlock(&TestMutex);
+    if(wait > MaxMutexWait)
+      MaxMutexWait = wait;
+  }
+  ST7735_Message(0,0,"Max wait us =",MaxMutexWait/80);
+  OS_Kill();
+}
+
+int TestmainMutex(void){
+  OS_Init();
+  ST7735_InitR(INITR_REDTAB);
+  OS_InitMutex(&TestMutex);
+  MaxMutexWait = 0;
+  OS_AddThread(&MutexLow,256,3);
+  OS_AddThread(&MutexMedium,256,2);
+  OS_AddThread(&MutexHigh,256,1);
+  OS_AddThread(&IdleTask,128,7);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
+
+//*******************Periodic scheduler test*********
+// Three periodic tasks at 1, 2 and 10 kHz share TIMER3
+// PE0, PE1 and PE2 toggle on each run, for the logic analyzer
+// JitterReport shows the worst jitter of each task and the periodic CPU
+// load on the LCD every second
+void Periodic1k(void){
+  PE0 ^= 0x01;
+}
+void Periodic2k(void){
+  PE1 ^= 0x02;
+}
+void Periodic10k(void){
+  PE2 ^= 0x04;
+}
+void JitterReport(void){
+  periodicInfoType info;
+  int n;
+  while(1){
+    OS_Sleep(1000);
+    for(n = 0; OS_PeriodicInfo(n, &info); n++){
+      ST7735_Message(0,n,"Jitter 0.1us=",info.maxJitter);
+    }
+    ST7735_Message(1,0,"Util %=",OS_Utilization()*100/65536);
+  }
+}
+
+int TestmainPeriodic(void){
+  unsigned long util;
+  OS_Init();
+  PortE_Init();
+  ST7735_InitR(INITR_REDTAB);
+  OS_AddPeriodicThreadWCET(&Periodic1k,TIME_1MS,80,1);
+  OS_AddPeriodicThreadWCET(&Periodic2k,TIME_500US,80,2);
+  OS_AddPeriodicThreadWCET(&Periodic10k,TIME_1MS/10,80,0);
+  // the three above claim 1.3%; a 1 kHz task claiming 80% more puts
+  // the set over the 4 task RM bound (75.7%), 100% over the EDF bound,
+  // so it must be refused and leave the utilization as it was
+  util = OS_Utilization();
+#if ADMISSION == SCHED_EDF
+  if(OS_AddPeriodicThreadWCET(&Periodic1k,TIME_1MS,TIME_1MS,3) ||
+#else
+  if(OS_AddPeriodicThreadWCET(&Periodic1k,TIME_1MS,TIME_1MS*8/10,3) ||
+#endif
+     OS_Utilization() != util){
+    ST7735_Message(1,0,"Overload admitted",OS_Utilization());
+  }
+  OS_AddThread(&JitterReport,256,2);
+  OS_AddThread(&IdleTask,128,7);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
+
+//*******************FIFO test*********
+// Two independent streams: a 10 kHz periodic producer feeds RawFifo one
+// sample at a time, Filter takes samples in batches of 16 and passes the
+// averages down AvgFifo, and Display shows them. Lost counts the samples
+// the producer could not save; Timeouts counts 100 ms gaps at Display.
+OSFifoType *RawFifo;
+OSFifoType *AvgFifo;
+unsigned long Lost, Timeouts;
+
+void FifoProducer(void){
+  static unsigned long sample;
+  if(!OS_FifoPut(RawFifo, &sample, 0)){
+    Lost++;
+  }
+  sample++;
+}
+
+void FifoFilter(void){
+  unsigned long buf[16], sum, n, i;
+  while(1){
+    n = OS_FifoGetBatch(RawFifo, buf, 16, OS_WAIT_FOREVER);
+    for(sum = 0, i = 0; i < n; i++)
+      sum += buf[i];
+    sum /= n;
+    OS_FifoPut(AvgFifo, &sum, OS_WAIT_FOREVER);
+  }
+}
+
+void FifoDisplay(void){
+  unsigned long avg;
+  while(1){
+    if(OS_FifoGet(AvgFifo, &avg, 100)){
+      ST7735_Message(0,0,"Average =",avg);
+      ST7735_Message(0,1,"Lost =",Lost);
+    } else {
+      Timeouts++;
+      ST7735_Message(0,2,"Timeouts =",Timeouts);
+    }
+  }
+}
+
+int TestmainFifo(void){
+  OS_Init();
+  Heap_Init();
+  ST7735_InitR(INITR_REDTAB);
+  RawFifo = OS_FifoCreate(256, sizeof(unsigned long));
+  AvgFifo = OS_FifoCreate(8, sizeof(unsigned long));
+  Lost = Timeouts = 0;
+  OS_AddPeriodicThread(&FifoProducer,TIME_1MS/10,1);
+  OS_AddThread(&FifoFilter,256,1);
+  OS_AddThread(&FifoDisplay,256,2);
+  OS_AddThread(&IdleTask,128,7);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
+
+//*******************Lock-free FIFO test*********
+// A 20 kHz periodic producer streams sequence numbers through SampleFifo
+// without masking interrupts; SpscConsumer reads them in place with
+// Peek/Release and counts any number out of order in SpscErrors.
+// Before that, SpscBench times 1000 put/get pairs on the lock-free FIFO
+// and on the OS_Fifo path, in bus cycles per pair.
+AddSPSCFifo(Sample, 256, unsigned long, 1, 0)
+AddSPSCFifo(Bench, 64, unsigned long, 1, 0)
+unsigned long SpscCount, SpscErrors, SpscFull;
+
+void SpscProducer(void){
+  static unsigned long seq;
+  if(SampleFifo_Put(seq)){
+    seq++;
+  } else {
+    SpscFull++;
+  }
+}
+
+void SpscBench(void){
+  unsigned long start, data, i;
+  start = OS_Time();
+  for(i = 0; i < 1000; i++){
+    BenchFifo_Put(i);
+    BenchFifo_Get(&data);
+  }
+  ST7735_Message(0,0,"SPSC cyc/pair =",OS_TimeDifference(start, OS_Time())/1000);
+  start = OS_Time();
+  for(i = 0; i < 1000; i++){
+    OS_Fifo_Put(i);
+    data = OS_Fifo_Get();
+  }
+  ST7735_Message(0,1,"OS cyc/pair =",OS_TimeDifference(start, OS_Time())/1000);
+}
+
+void SpscConsumer(void){
+  unsigned long *span, n, i;
+  SpscBench();
+  while(1){
+    n = SampleFifo_Peek(&span);
+    if(n == 0){
+      ST7735_Message(1,0,"Samples =",SpscCount);
+      ST7735_Message(1,1,"Errors =",SpscErrors);
+      OS_Sleep(10);
+      continue;
+    }
+    for(i = 0; i < n; i++){
+      if(span[i] != SpscCount + i)
+        SpscErrors++;
+    }
+    SpscCount += n;
+    SampleFifo_Release(n);
+  }
+}
+
+int TestmainSPSC(void){
+  OS_Init();
+  Heap_Init();
+  ST7735_InitR(INITR_REDTAB);
+  OS_Fifo_Init(64);
+  BenchFifo_Init();
+  SampleFifo_Init();
+  SpscCount = SpscErrors = SpscFull = 0;
+  OS_AddPeriodicThread(&SpscProducer,TIME_1MS/20,0);
+  OS_AddThread(&SpscConsumer,256,1);
+  OS_AddThread(&IdleTask,128,7);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
+
+//*******************Message queue test*********
+// FrameMaker fills 64 bin frames straight into borrowed queue slots, the
+// way Consumer hands its FFT spectrum to Display, and FrameShow draws them
+// and hands the slots back. With four slots the producer only waits when
+// the display falls four frames behind.
+typedef struct frame {
+  unsigned long seq;
+  unsigned short bins[64];
+} frameType;
+OSQueueType *FrameQueue;
+unsigned long FramesDropped;
+
+void FrameMaker(void){
+  frameType *f;
+  unsigned long seq = 0;
+  int i;
+  while(1){
+    f = OS_QueueAlloc(FrameQueue, 0);
+    if(f == 0){
+      FramesDropped++;
+    } else {
+      f->seq = seq;
+      for(i = 0; i < 64; i++)
+        f->bins[i] = (seq + i) & 0xFFF;
+      OS_QueuePost(FrameQueue, f);
+    }
+    seq++;
+    OS_Sleep(10);
+  }
+}
+
+void FrameShow(void){
+  frameType *f;
+  while(1){
+    f = OS_QueuePend(FrameQueue, OS_WAIT_FOREVER);
+    ST7735_Message(0,0,"Frame =",f->seq);
+    ST7735_Message(0,1,"Bin 0 =",f->bins[0]);
+    ST7735_Message(0,2,"Dropped =",FramesDropped);
+    OS_QueueFree(FrameQueue, f);
+  }
+}
+
+int TestmainQueue(void){
+  OS_Init();
+  Heap_Init();
+  ST7735_InitR(INITR_REDTAB);
+  FrameQueue = OS_QueueCreate(4, sizeof(frameType));
+  FramesDropped = 0;
+  OS_AddThread(&FrameMaker,256,1);
+  OS_AddThread(&FrameShow,256,2);
+  OS_AddThread(&IdleTask,128,7);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
+
+//*******************Kernel benchmarks*********
+// BenchMain runs every benchmark in bench.c once and prints BENCH lines
+// on the UART, then goes quiet. The host build, host/simbench.c, prints
+// the same lines for the simulated kernel.
+void BenchMain(void){
+  Bench_Run(1000);
+  OS_Kill();
+}
+
+int TestmainBench(void){
+  OS_Init();
+  Heap_Init();
+  OS_AddThread(&BenchMain,512,BENCH_PRI);
+  OS_AddThread(&IdleTask,128,7);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
+
 int notmain(void){
   OS_Init();
   PortE_Init();
@@ -7,20 +7,33 @@
 //debug flag; set to 0 to undefine some useful (but slow) debug info
 #define DEBUG 0
 
-#if DEBUG
-enum tEvent {
-    tStart, pStart, pStop
+//tickless flag; set to 0 to take the 1 ms TIMER4 tick and the SysTick
+//time slice even when there is nothing for them to do
+#define TICKLESS 1
+
+//admission test run by OS_AddPeriodicThread; SCHED_RM checks the periodic
+//tasks against the rate monotonic utilization bound, SCHED_EDF against 100%
+#define SCHED_NONE 0
+#define SCHED_RM   1
+#define SCHED_EDF  2
+#define ADMISSION  SCHED_RM
+
+//trace flag; set to 0 to compile out the kernel event trace
+#define TRACE 1
+
+#include "heap.h"
+
+// kernel trace events, see OS_Trace
+enum traceEvent {
+  TRACE_SWITCH,         // id is the thread switched in
+  TRACE_BLOCK,          // id blocked on a semaphore
+  TRACE_UNBLOCK,        // id made ready by a signal or a timeout
+  TRACE_ISR_ENTER,      // arg is the interrupt number
+  TRACE_ISR_EXIT,
+  TRACE_PERIODIC_START, // arg is the periodic task index
+  TRACE_PERIODIC_STOP
 };
 
-struct tinfo {
-    int tid;
-    enum tEvent e;
-    long t;
-};
-
-void addTInfo(enum tEvent e);
-#endif
-
 // edit these depending on your clock        
 #define TIME_1MS    80000
 #define TIME_2MS    (2*TIME_1MS)  
@@ -28,10 +41,12 @@ void addTInfo(enum tEvent e);
 #define TIME_250US  (TIME_1MS/5) 
 
 // LED Stuff
+#ifndef SIM
 #define PF1       (*((volatile unsigned long *)0x40025008))
 #define PF2       (*((volatile unsigned long *)0x40025010))
 #define PF3       (*((volatile unsigned long *)0x40025020))
 #define LEDS      (*((volatile unsigned long *)0x40025038))
+#endif
 #define RED       0x02
 #define BLUE      0x04
 #define GREEN     0x08
@@ -43,25 +58,96 @@ typedef struct pcb {
 	int32_t num_threads;
 } pcbType;
 
+struct mutex;
+
 typedef struct tcb{
   int32_t *sp;       // pointer to stack (valid for threads not running
-  struct tcb *next;  // linked-list pointer
+  struct tcb *next;  // ready list pointer, circular per priority
   struct tcb *prev;  // doubly-linked
   uint32_t id;
-  int32_t sleep;
+  int32_t sleep;     // ms after the previous sleeper in the sleep list
   uint32_t active;
   int32_t pri;
   int32_t blocked;
   struct tcb *bNext;
 	pcbType *pcb;
+  struct tcb *sNext; // sleep list pointer
+  int32_t asleep;    // 1 while on the sleep list
+  int32_t *stack;    // lowest word of the stack, 0 once reclaimed
+  uint32_t stackWords;
+  int32_t basePri;   // priority given to OS_AddThread, pri may be inherited
+  struct mutex *waitMutex; // mutex this thread is blocked on
+  struct mutex *mutexes;   // mutexes this thread owns
+  struct Sema4 *waitSema;  // semaphore this thread is blocked on
+  int32_t timedOut;        // 1 if the last timed wait ran out
+  uint64_t cycles;         // time run since OS_CpuReset, ISRs excluded
+  uint32_t switches;       // times switched in since OS_CpuReset
+  int32_t idle;            // 1 once the thread calls OS_SetIdle
+  heap_cache_t heapCache;  // small blocks freed by this thread, see heap.h
 } tcbType;
 
+// stack usage of one thread, filled in by OS_StackInfo
+typedef struct stackInfo {
+  uint32_t id;
+  int32_t pri;
+  uint32_t words;    // stack size in words
+  uint32_t peak;     // most words ever used (high-water mark)
+  int32_t overflow;  // 1 if the canary at the bottom was overwritten
+} stackInfoType;
+
+// context switch counters, filled in by OS_SwitchStats
+typedef struct switchStats {
+  unsigned long requested;  // PendSV requests made by the kernel
+  unsigned long passes;     // scheduler runs, from PendSV or SysTick
+  unsigned long taken;      // scheduler runs that changed RunPt
+} switchStatsType;
+
+// CPU time of one thread, filled in by OS_CpuInfo
+typedef struct cpuInfo {
+  uint32_t id;
+  int32_t pri;
+  uint64_t cycles;    // 12.5ns units since OS_CpuReset
+  uint32_t switches;  // times switched in since OS_CpuReset
+  int32_t idle;       // 1 for the thread that called OS_SetIdle
+} cpuInfoType;
+
+// CPU time of one interrupt source, filled in by OS_IsrInfo
+typedef struct isrInfo {
+  uint32_t irq;       // interrupt number
+  uint64_t cycles;    // 12.5ns units since OS_CpuReset, nested ISRs included
+  uint32_t count;     // handler runs since OS_CpuReset
+} isrInfoType;
+
+typedef struct periodicInfo {
+  void (*task)(void);
+  unsigned long period;     // 12.5ns units
+  unsigned long pri;
+  unsigned long runs;
+  unsigned long overruns;   // releases dropped after falling a whole period behind
+  unsigned long maxJitter;  // 0.1us units
+  unsigned long wcet;       // declared worst case execution time, 12.5ns units
+  unsigned long maxExec;    // longest run measured, 12.5ns units
+} periodicInfoType;
+
 // feel free to change the type of semaphore, there are lots of good solutions
 typedef struct Sema4{
   long Value;   // >0 means free, otherwise means busy
-  tcbType *next;
+  tcbType *next;  // blocked threads, highest priority first
+  tcbType *tail;  // last blocked thread
 } Sema4Type;
 
+// mutex with owner tracking and priority inheritance
+typedef struct mutex{
+  tcbType *owner;     // 0 means free
+  long count;         // lock depth of the owner
+  tcbType *next;      // blocked threads, highest priority first
+  struct mutex *held; // next mutex owned by the same thread
+} MutexType;
+
+#define MUTEX_OK        0
+#define MUTEX_RECURSIVE 1  // caller already owned the mutex
+#define MUTEX_NOT_OWNER 2  // caller does not own the mutex
+
 // ******** OS_Init ************
 // initialize operating system, disable interrupts until OS_Launch
 // initialize OS controlled I/O: systick, 50 MHz PLL
@@ -105,6 +191,31 @@ void OS_bWait(Sema4Type *semaPt);
 // output: none
 void OS_bSignal(Sema4Type *semaPt); 
 
+// ******** OS_InitMutex ************
+// initialize a mutex to unlocked
+// input:  pointer to a mutex
+// output: none
+void OS_InitMutex(MutexType *mutexPt);
+
+// ******** OS_MutexLock ************
+// lock a mutex, block if another thread owns it
+// while blocked, the owner runs at this thread's priority if that is
+//   higher, so a medium priority thread can not prolong the wait
+// input:  pointer to a mutex
+// output: MUTEX_OK, or MUTEX_RECURSIVE if the caller already owned it
+//   (the lock depth is incremented and must be unlocked as many times)
+// can only be called from a foreground thread
+int OS_MutexLock(MutexType *mutexPt);
+
+// ******** OS_MutexUnlock ************
+// unlock a mutex, hand it to the highest priority waiter and drop
+//   any priority the caller inherited through it
+// input:  pointer to a mutex
+// output: MUTEX_OK, or MUTEX_NOT_OWNER if the caller does not own it
+// OS_Kill does the same for every mutex the dying thread still owns,
+//   whatever its lock depth
+int OS_MutexUnlock(MutexType *mutexPt);
+
 //******** OS_AddThread ***************
 // add three foregound threads to the scheduler
 // Inputs: three pointers to a void/void foreground tasks
@@ -121,9 +232,8 @@ int OS_AddThreads(void(*task0)(void),
 //         number of bytes allocated for its stack
 //         priority, 0 is highest, 5 is the lowest
 // Outputs: 1 if successful, 0 if this thread can not be added
-// stack size must be divisable by 8 (aligned to double word boundary)
-// In Lab 2, you can ignore both the stackSize and priority fields
-// In Lab 3, you can ignore the stackSize fields
+// stack size is rounded up to a double word boundary and to at least
+//   STACK_MIN_WORDS, the stack is reclaimed by OS_Kill
 int OS_AddThread(void(*task)(void), 
    unsigned long stackSize, unsigned long priority);
 
@@ -150,9 +260,38 @@ unsigned long OS_Id(void);
 // In lab 3, this command will be called 0 1 or 2 times
 // In lab 3, there will be up to four background threads, and this priority field 
 //           determines the relative priority of these four threads
+// Up to MAXPERIODIC tasks share TIMER3; when two are released at the same
+// time the one with the lower priority number runs first
+// The task declares no WCET, so it is admitted if the tasks already running
+// pass the ADMISSION test, and is charged its measured run time from then on
 int OS_AddPeriodicThread(void(*task)(void), 
    unsigned long period, unsigned long priority);
 
+//******** OS_AddPeriodicThreadWCET ***************
+// add a background periodic task with a declared worst case execution time
+// the task is rejected if the periodic task set would fail the ADMISSION
+// test; each task is charged the larger of its declared and measured WCET
+// Inputs: pointer to a void/void background function
+//         period and wcet given in system time units (12.5ns)
+//         priority 0 is the highest, 7 is the lowest
+// Outputs: 1 if successful, 0 if this thread can not be added
+int OS_AddPeriodicThreadWCET(void(*task)(void), unsigned long period,
+   unsigned long wcet, unsigned long priority);
+
+//******** OS_Utilization ***************
+// CPU share claimed by the periodic tasks, using the larger of the declared
+// and measured WCET of each
+// Inputs:  none
+// Outputs: utilization, 65536 is 100%
+unsigned long OS_Utilization(void);
+
+//******** OS_PeriodicInfo ***************
+// copy out scheduling and jitter data for one periodic task
+// Inputs:  n index of the task, 0 is the first one added
+//          info where to put the data
+// Outputs: 1 if the task exists, 0 otherwise
+int OS_PeriodicInfo(int n, periodicInfoType *info);
+
 //******** OS_AddSW1Task *************** 
 // add a background task to run whenever the SW1 (PF4) button is pushed
 // Inputs: pointer to a void/void background function
@@ -206,15 +345,68 @@ void OS_Kill(void);
 // output: none
 void OS_Suspend(void);
 
+// timeout for calls that can block, wait as long as it takes
+#define OS_WAIT_FOREVER 0xFFFFFFFF
+
+typedef struct osFifo OSFifoType;
+
+// ******** OS_FifoCreate ************
+// Allocate an empty FIFO from the heap, any number can exist at once
+// Inputs:  size number of elements, rounded up to a power of 2
+//          elemSize bytes per element
+// Outputs: the FIFO, 0 if the heap is full
+// Heap_Init must have been called first
+OSFifoType *OS_FifoCreate(unsigned long size, unsigned long elemSize);
+
+// ******** OS_FifoDestroy ************
+// Return a FIFO to the heap
+// Inputs:  the FIFO
+// Outputs: 1 if freed, 0 if threads are still waiting on it
+int OS_FifoDestroy(OSFifoType *f);
+
+// ******** OS_FifoPut ************
+// Enter one element into a FIFO
+// Inputs:  the FIFO, pointer to the element
+//          ms longest time to wait for room, 0 to return right away,
+//          OS_WAIT_FOREVER to wait as long as it takes
+// Outputs: 1 if the element was saved, 0 if the FIFO stayed full
+// Interrupt handlers must pass ms = 0
+int OS_FifoPut(OSFifoType *f, const void *elem, unsigned long ms);
+
+// ******** OS_FifoGet ************
+// Remove one element from a FIFO
+// Inputs:  the FIFO, where to put the element
+//          ms longest time to wait for data, as for OS_FifoPut
+// Outputs: 1 if an element was removed, 0 if the FIFO stayed empty
+int OS_FifoGet(OSFifoType *f, void *elem, unsigned long ms);
+
+// ******** OS_FifoPutBatch ************
+// Enter up to n elements in one critical section
+// Waits (up to ms) only while there is no room at all
+// Inputs:  the FIFO, array of n elements, ms as for OS_FifoPut
+// Outputs: number of elements saved
+unsigned long OS_FifoPutBatch(OSFifoType *f, const void *src, unsigned long n, unsigned long ms);
+
+// ******** OS_FifoGetBatch ************
+// Remove up to n elements in one critical section
+// Waits (up to ms) only while the FIFO is empty
+// Inputs:  the FIFO, room for n elements, ms as for OS_FifoPut
+// Outputs: number of elements removed
+unsigned long OS_FifoGetBatch(OSFifoType *f, void *dst, unsigned long n, unsigned long ms);
+
+// ******** OS_FifoSize ************
+// Number of elements in a FIFO
+// Inputs:  the FIFO
+// Outputs: elements that OS_FifoGet can take without waiting
+long OS_FifoSize(OSFifoType *f);
+
 // ******** OS_Fifo_Init ************
 // Initialize the Fifo to be empty
 // Inputs: size
 // Outputs: none 
-// In Lab 2, you can ignore the size field
-// In Lab 3, you should implement the user-defined fifo size
-// In Lab 3, you can put whatever restrictions you want on size
-//    e.g., 4 to 64 elements
-//    e.g., must be a power of 2,4,8,16,32,64,128
+// The Fifo is an OS_FifoCreate(size, 4) FIFO, size is rounded up to a
+// power of 2; calling it again frees the old one, unless threads are
+// waiting on it, in which case the old Fifo is kept as it is
 void OS_Fifo_Init(unsigned long size);
 
 // ******** OS_Fifo_Put ************
@@ -243,10 +435,70 @@ unsigned long OS_Fifo_Get(void);
 //          zero or less than zero if a call to OS_Fifo_Get will spin or block
 long OS_Fifo_Size(void);
 
+typedef struct osQueue OSQueueType;
+
+// ******** OS_QueueCreate ************
+// Allocate a message queue from the heap, any number can exist at once
+// Inputs:  depth number of message slots
+//          msgSize bytes per message, rounded up to a whole word
+// Outputs: the queue, 0 if the heap is full
+// Heap_Init must have been called first
+OSQueueType *OS_QueueCreate(unsigned long depth, unsigned long msgSize);
+
+// ******** OS_QueueDestroy ************
+// Return a queue and its slots to the heap
+// Inputs:  the queue
+// Outputs: 1 if freed, 0 if threads are still waiting on it
+int OS_QueueDestroy(OSQueueType *q);
+
+// ******** OS_QueueAlloc ************
+// Borrow an empty message slot to fill in place
+// Inputs:  the queue, ms longest time to wait for a slot (0 or OS_WAIT_FOREVER ok)
+// Outputs: the slot, 0 if none came free in time
+void *OS_QueueAlloc(OSQueueType *q, unsigned long ms);
+
+// ******** OS_QueuePost ************
+// Send a slot from OS_QueueAlloc, never blocks
+// Inputs:  the queue, the filled slot
+// Outputs: none
+void OS_QueuePost(OSQueueType *q, void *msg);
+
+// ******** OS_QueuePend ************
+// Take the oldest message, to be read in place
+// Inputs:  the queue, ms longest time to wait for a message
+// Outputs: the message slot, 0 if nothing arrived in time
+// The slot must go back with OS_QueueFree once it has been read
+void *OS_QueuePend(OSQueueType *q, unsigned long ms);
+
+// ******** OS_QueueFree ************
+// Return a slot from OS_QueuePend, never blocks
+// Inputs:  the queue, the slot
+// Outputs: none
+void OS_QueueFree(OSQueueType *q, void *msg);
+
+// ******** OS_QueueSend ************
+// Copy a message into the queue
+// Inputs:  the queue, msgSize bytes of message, ms as for OS_QueueAlloc
+// Outputs: 1 if sent, 0 if the queue stayed full
+int OS_QueueSend(OSQueueType *q, const void *msg, unsigned long ms);
+
+// ******** OS_QueueRecv ************
+// Copy the oldest message out of the queue
+// Inputs:  the queue, room for msgSize bytes, ms as for OS_QueuePend
+// Outputs: 1 if a message was received, 0 if the queue stayed empty
+int OS_QueueRecv(OSQueueType *q, void *msg, unsigned long ms);
+
+// ******** OS_QueueSize ************
+// Number of messages waiting
+// Inputs:  the queue
+// Outputs: messages OS_QueuePend can take without waiting
+long OS_QueueSize(OSQueueType *q);
+
 // ******** OS_MailBox_Init ************
 // Initialize communication channel
 // Inputs:  none
 // Outputs: none
+// The MailBox is a one slot OSQueueType, Heap_Init must have been called
 void OS_MailBox_Init(void);
 
 // ******** OS_MailBox_Send ************
@@ -265,6 +517,34 @@ void OS_MailBox_Send(unsigned long data);
 // It will spin/block if the MailBox is empty 
 unsigned long OS_MailBox_Recv(void);
 
+// ******** OS_Trace ************
+// Record one event in the kernel trace ring, the oldest event is
+// overwritten when the ring is full
+// Inputs:  event, arg as described in enum traceEvent
+// Outputs: none
+// Callable from interrupt handlers; the time stamp is the DWT cycle count
+#if TRACE
+void OS_Trace(unsigned long event, unsigned long arg);
+#else
+#define OS_Trace(event, arg)
+#endif
+
+// ******** OS_TraceDump ************
+// Send the trace ring over UART0 in binary, oldest event first
+// Inputs:  none
+// Outputs: none
+// Format, all little endian: "TRCE", event count (4 bytes), cycles per
+// second (4 bytes), then 8 bytes per event: cycle count (4), thread id (2),
+// event (1), arg (1). Tracing stops while the dump is sent.
+// host/trace2json.c turns a dump into Chrome trace JSON
+void OS_TraceDump(void);
+
+// ******** OS_TraceClear ************
+// Empty the trace ring
+// Inputs:  none
+// Outputs: none
+void OS_TraceClear(void);
+
 // ******** OS_Time ************
 // return the system time 
 // Inputs:  none
@@ -272,8 +552,34 @@ unsigned long OS_MailBox_Recv(void);
 // The time resolution should be less than or equal to 1us, and the precision 32 bits
 // It is ok to change the resolution and precision of this function as long as 
 //   this function and OS_TimeDifference have the same resolution and precision 
+// This is the low 32 bits of OS_Time64, so it wraps every 53.7 s
 unsigned long OS_Time(void);
 
+// ******** OS_Time64 ************
+// return the system time without wrap
+// Inputs:  none
+// Outputs: 12.5ns units since OS_Init, never decreases
+// Takes no critical section, safe from threads and interrupt handlers
+uint64_t OS_Time64(void);
+
+// ******** OS_TimeToUs ************
+// convert a time or time difference to microseconds
+// Inputs:  12.5ns units
+// Outputs: us, rounded down
+uint64_t OS_TimeToUs(uint64_t time);
+
+// ******** OS_TimeToNs ************
+// convert a time or time difference to nanoseconds
+// Inputs:  12.5ns units
+// Outputs: ns, rounded down
+uint64_t OS_TimeToNs(uint64_t time);
+
+// ******** OS_UsToTime ************
+// convert microseconds to 12.5ns units
+// Inputs:  us
+// Outputs: 12.5ns units
+uint64_t OS_UsToTime(uint64_t us);
+
 // ******** OS_TimeDifference ************
 // Calculates difference between two times
 // Inputs:  two times measured with OS_Time
@@ -283,6 +589,19 @@ unsigned long OS_Time(void);
 //   this function and OS_Time have the same resolution and precision 
 unsigned long OS_TimeDifference(unsigned long start, unsigned long stop);
 
+// ******** OS_TimeDelta ************
+// signed difference between two OS_Time values, right across a wrap as
+// long as they are within 26.8 s of each other
+// Inputs:  two times measured with OS_Time
+// Outputs: stop - start in 12.5ns units, negative if stop is earlier
+long OS_TimeDelta(unsigned long start, unsigned long stop);
+
+// ******** OS_TimeDifference64 ************
+// Calculates difference between two OS_Time64 times
+// Inputs:  two times measured with OS_Time64
+// Outputs: time difference in 12.5ns units
+uint64_t OS_TimeDifference64(uint64_t start, uint64_t stop);
+
 // ******** OS_ClearMsTime ************
 // sets the system time to zero (from Lab 1)
 // Inputs:  none
@@ -298,12 +617,125 @@ void OS_ClearMsTime(void);
 // It is ok to make the resolution to match the first call to OS_AddPeriodicThread
 unsigned long OS_MsTime(void);
 
+// ******** OS_AddProcess ************
+// start a process, one thread at entry with R9 pointing at data
+// Inputs:  entry, text and data from the loader, stack bytes, priority
+// Outputs: 0 if started, -1 if no PCB or thread was free
+// text and data go back to the heap when the last thread is killed
 int OS_AddProcess(void(*entry)(void), uint32_t *text, uint32_t *data, uint32_t stackSize, uint32_t priority);
 
+// ******** OS_TicksAvoided ************
+// number of 1 ms TIMER4 ticks skipped by tickless mode
+// Inputs:  none
+// Outputs: ticks avoided since OS_Init
+unsigned long OS_TicksAvoided(void);
+
+// ******** OS_SwitchStats ************
+// read the context switch counters
+// OS_Signal, OS_bSignal, OS_AddThread and sleep wake ups only request
+//   a switch when the thread made ready outranks the running one
+// Inputs:  where to put the counters
+// Outputs: none
+void OS_SwitchStats(switchStatsType *stats);
+
+// ******** OS_StackInfo ************
+// scan a thread's stack for its high-water mark
+// every stack is painted with STACK_CANARY when the thread is created
+// Inputs:  TCB slot 0 to OS_MaxThreads()-1, where to put the result
+// Outputs: 1 if the slot holds a live thread, 0 otherwise
+int OS_StackInfo(int slot, stackInfoType *info);
+
+// ******** OS_CpuInfo ************
+// CPU time used by one thread since OS_CpuReset
+// threads are charged at every context switch, minus time spent in ISRs
+// that go through OS_IsrStart/OS_IsrEnd
+// Inputs:  TCB slot 0 to OS_MaxThreads()-1, where to put the result
+// Outputs: 1 if the slot holds a live thread, 0 otherwise
+int OS_CpuInfo(int slot, cpuInfoType *info);
+
+// ******** OS_SetIdle ************
+// mark the running thread as the idle thread, so its CPU time counts
+// as idle time rather than as work done at its priority
+// Inputs:  none
+// Outputs: none
+void OS_SetIdle(void);
+
+// ******** OS_IsrInfo ************
+// CPU time used by one interrupt source since OS_CpuReset
+// Inputs:  n 0 to however many sources have run, where to put the result
+// Outputs: 1 if there is an n-th source, 0 otherwise
+int OS_IsrInfo(int n, isrInfoType *info);
+
+// ******** OS_CpuWindow ************
+// length of the accounting window
+// Inputs:  none
+// Outputs: 12.5ns units since OS_CpuReset
+uint64_t OS_CpuWindow(void);
+
+// ******** OS_CpuReset ************
+// zero every thread and ISR counter and start a new accounting window
+// Inputs:  none
+// Outputs: none
+void OS_CpuReset(void);
+
+// ******** OS_IsrStart ************
+// call first thing in an interrupt handler to account its CPU time
+// also logs TRACE_ISR_ENTER
+// Inputs:  interrupt number
+// Outputs: start time, to be passed to OS_IsrEnd
+unsigned long OS_IsrStart(unsigned long irq);
+
+// ******** OS_IsrEnd ************
+// call last thing in an interrupt handler that called OS_IsrStart
+// also logs TRACE_ISR_EXIT
+// Inputs:  interrupt number, value returned by OS_IsrStart
+// Outputs: none
+void OS_IsrEnd(unsigned long irq, unsigned long start);
+
+// ******** OS_MaxThreads ************
+// number of TCB slots
+int OS_MaxThreads(void);
+
+// ******** OS_SetStackFaultHook ************
+// set a function the scheduler calls with the thread ID when a thread
+//   being switched out has overflowed its stack; the system halts
+//   with the red LED on after the hook returns
+// Inputs:  hook, 0 to just halt
+// Outputs: none
+void OS_SetStackFaultHook(void(*hook)(unsigned long id));
+
+// ******** OS_MaxTimeIntsDisabled ************
+// DEBUG builds time every critical section with the DWT cycle counter
+// Outputs: longest time interrupts were off, in 12.5ns units
 int OS_MaxTimeIntsDisabled(void);
+// Outputs: total time interrupts were off, in 12.5ns units
 int OS_TimeIntsDisabled(void);
+// Outputs: percent of the time since OS_CritReset with interrupts off
 int OS_PercentIntsDisabled(void);
 
+// one call site of StartCritical or OS_DisableInterrupts
+#define CRIT_BUCKETS 16
+typedef struct critSite {
+  unsigned long site;      // return address in the caller, look it up in the map file
+  unsigned long count;     // critical sections started there
+  unsigned long max;       // longest, 12.5ns units
+  uint64_t total;          // all of them together, 12.5ns units
+  unsigned long histogram[CRIT_BUCKETS]; // [k] counts sections of 2^(k-1) to 2^k-1 cycles
+} critSiteType;
+
+// ******** OS_CritSite ************
+// DEBUG builds: report one critical section call site, worst first
+// Inputs:  rank 0 for the site with the longest section, 1 for the next...
+//          where to put the result
+// Outputs: 1 if there is a site of that rank, 0 otherwise
+int OS_CritSite(int rank, critSiteType *info);
+
+// ******** OS_CritReset ************
+// DEBUG builds: forget all critical section timing
+// Inputs:  none
+// Outputs: none
+void OS_CritReset(void);
+
 //******** OS_Launch ***************
 // start the scheduler, enable interrupts
 // Inputs: number of 20ns clock cycles for each time slice
@@ -311,8 +743,6 @@ int OS_PercentIntsDisabled(void);
 // Outputs: none (does not return)
 void OS_Launch(uint32_t theTimeSlice);
 
-void Jitter(void);
-
 void OS_DisableInterrupts(void);
 void OS_EnableInterrupts(void);
 long StartCritical(void);
@@ -0,0 +1,587 @@
+// bench.c
+// Runs on LM4F120/TM4C123, and on Linux under host/sim.c
+// Kernel benchmarks, see bench.h.
+// Every benchmark starts its own threads around the caller's priority,
+// waits for them on Done and prints one line. Per operation times are
+// stamped with OS_Time and kept as min/avg/max; throughput figures come
+// from one OS_Time64 interval around the whole run.
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bench.h"
+#include "heap.h"
+#include "OS.h"
+#include "pool.h"
+
+#define BENCH_STACK  256     // bytes per benchmark thread
+#define BENCH_SLEEPS 50      // OS_Sleep runs, 1 to 10 ms each
+#define BENCH_FIFO   64      // FIFO depth, elements
+#define BENCH_BLOCKS 8       // blocks in the benchmark pool
+#define BENCH_TICKS  200     // TIMER4 ticks timed at each sleeper count
+#define TIMER4_IRQ   70
+#define BENCH_PROCS  50      // processes run one at a time, more than there are PCBs
+
+typedef struct benchStat {
+  unsigned long n;
+  long min, max;
+  int64_t sum;
+} benchStatType;
+
+static unsigned long N;
+static int Failed;
+static Sema4Type Done;       // signalled by each benchmark thread as it ends
+static Sema4Type Ping, Pong;
+static benchStatType Stat;
+static unsigned long Stamp;  // OS_Time handed from one thread to the next
+static int Stamped;
+static unsigned long Stamper; // id of the thread that took Stamp
+static OSFifoType *Fifo;
+static OSQueueType *Box;
+static unsigned long Moved;
+static uint32_t Sum;
+static unsigned long HeapErrors;
+static Sema4Type Hold;       // filler threads wait here until they are released
+static Sema4Type Gate;
+static MutexType Lock;
+static int Through, LowOrder, MidOrder;  // order the inherit threads passed Gate
+
+// thread counts for the scaling runs, points above OS_MaxThreads are skipped
+static const unsigned long Sweep[] = {20, 64, 256};
+#define SWEEP_POINTS (sizeof(Sweep)/sizeof(Sweep[0]))
+
+static void statClear(benchStatType *s){
+  s->n = 0;
+  s->min = 0x7FFFFFFF;
+  s->max = -0x7FFFFFFF;
+  s->sum = 0;
+}
+
+static void statAdd(benchStatType *s, long x){
+  s->n++;
+  s->sum += x;
+  if(x < s->min) s->min = x;
+  if(x > s->max) s->max = x;
+}
+
+static void statPrint(const char *name, benchStatType *s){
+  if(s->n == 0){
+    printf("BENCH %s n=0\r\n", name);
+    return;
+  }
+  printf("BENCH %s n=%lu avg=%ld min=%ld max=%ld\r\n",
+         name, s->n, (long)(s->sum/(int64_t)s->n), s->min, s->max);
+}
+
+// one figure for n operations that took cycles in all
+static void ratePrint(const char *name, unsigned long n, uint64_t cycles){
+  if(cycles == 0) cycles = 1;
+  printf("BENCH %s n=%lu avg=%lu rate=%lu\r\n", name, n,
+         (unsigned long)(cycles/n), (unsigned long)((uint64_t)n*TIME_1MS*1000/cycles));
+}
+
+static void check(const char *name, int ok){
+  if(!ok){
+    printf("BENCH %s FAILED\r\n", name);
+    Failed++;
+  }
+}
+
+static int spawn(void(*task)(void), unsigned long pri){
+  if(OS_AddThread(task, BENCH_STACK, pri))
+    return 1;
+  check("spawn", 0);
+  return 0;
+}
+
+// start a pair below the caller and wait until both are done
+static void run2(void(*a)(void), void(*b)(void)){
+  int started = spawn(a, BENCH_PRI+1) + spawn(b, BENCH_PRI+1);
+  while(started--)
+    OS_Wait(&Done);
+}
+
+// two threads at one priority passing the CPU with OS_Suspend, each
+// measures the switch that brought it back. The stamp is taken with
+// interrupts off and the switch is only taken when they come back on,
+// so a time slice can not land between the two. A slice that lands just
+// after a switch hands the CPU back to the thread that stamped, which
+// knows its own stamp and skips it.
+static void Yielder(void){
+  unsigned long i, now, me = OS_Id();
+  long sr;
+  for(i = 0; i < N; i++){
+    sr = StartCritical();
+    now = OS_Time();
+    if(Stamped && Stamper != me)
+      statAdd(&Stat, OS_TimeDifference(Stamp, now));
+    Stamper = me;
+    Stamped = 1;
+    OS_Suspend();
+    Stamp = OS_Time();
+    EndCritical(sr);             // the switch happens here
+  }
+  Stamped = 0;
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// OS_Signal to OS_Wait and back, timed by the thread that starts it
+static void Pinger(void){
+  unsigned long i, start;
+  for(i = 0; i < N; i++){
+    start = OS_Time();
+    OS_Signal(&Ping);
+    OS_Wait(&Pong);
+    statAdd(&Stat, OS_TimeDifference(start, OS_Time()));
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+static void Ponger(void){
+  unsigned long i;
+  for(i = 0; i < N; i++){
+    OS_Wait(&Ping);
+    OS_Signal(&Pong);
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// a message carries its send time to a higher priority receiver
+static void BoxReader(void){
+  unsigned long i, sent;
+  for(i = 0; i < N; i++){
+    OS_QueueRecv(Box, &sent, OS_WAIT_FOREVER);
+    statAdd(&Stat, OS_TimeDifference(sent, OS_Time()));
+    Moved++;
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+static void Producer(void){
+  uint32_t i;
+  for(i = 0; i < N; i++)
+    OS_FifoPut(Fifo, &i, OS_WAIT_FOREVER);
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+static void Consumer(void){
+  uint32_t data;
+  unsigned long i;
+  for(i = 0; i < N; i++){
+    OS_FifoGet(Fifo, &data, OS_WAIT_FOREVER);
+    Sum += data;
+    Moved++;
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+static void BatchProducer(void){
+  uint32_t buf[16];
+  unsigned long i = 0, k, n;
+  while(i < N){
+    n = N - i < 16 ? N - i : 16;
+    for(k = 0; k < n; k++)
+      buf[k] = i + k;
+    i += OS_FifoPutBatch(Fifo, buf, n, OS_WAIT_FOREVER);
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+static void BatchConsumer(void){
+  uint32_t buf[16];
+  unsigned long k, n;
+  while(Moved < N){
+    n = OS_FifoGetBatch(Fifo, buf, 16, OS_WAIT_FOREVER);
+    for(k = 0; k < n; k++)
+      Sum += buf[k];
+    Moved += n;
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// two of these share the heap through time slices, each block is
+// stamped with its owner and checked before it goes back
+static void HeapWorker(void){
+  uint8_t *p;
+  unsigned long i, k, size;
+  uint8_t me = (uint8_t)OS_Id();
+  for(i = 0; i < N; i++){
+    size = 8 + (i*37)%200;
+    p = Heap_Malloc(size);
+    if(p == 0)
+      continue;
+    for(k = 0; k < size; k++)
+      p[k] = me;
+    for(k = 0; k < size; k++)
+      if(p[k] != me)
+        HeapErrors++;
+    if(Heap_Free(p) != HEAP_OK)
+      HeapErrors++;
+    Moved++;
+  }
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// blocks on Hold as soon as it is added and dies when released
+static void Filler(void){
+  OS_Wait(&Hold);
+  OS_Kill();
+}
+
+// waits on Fifo for a minute, on the sleep list all that time, and
+// dies when it gets an element or the wait runs out
+static void Sleeper(void){
+  unsigned long data;
+  OS_FifoGet(Fifo, &data, 60000 + OS_Id()%1000);
+  OS_Kill();
+}
+
+// threads alive now, the caller included
+static unsigned long liveThreads(void){
+  stackInfoType info;
+  unsigned long n = 0;
+  int i;
+  for(i = 0; i < OS_MaxThreads(); i++)
+    n += OS_StackInfo(i, &info);
+  return n;
+}
+
+// add blocked fillers until total threads are alive, returns how many
+static unsigned long fill(unsigned long total){
+  unsigned long n = 0, live = liveThreads();
+  while(live + n < total && spawn(Filler, BENCH_PRI-1))
+    n++;
+  return n;
+}
+
+static void release(unsigned long n){
+  while(n--)
+    OS_Signal(&Hold);
+}
+
+// waits on Gate holding Lock, so InheritHigh's priority reaches it
+// while it is on the semaphore's wait list
+static void InheritLow(void){
+  OS_MutexLock(&Lock);
+  OS_Wait(&Gate);
+  LowOrder = ++Through;
+  OS_MutexUnlock(&Lock);
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+static void InheritMid(void){
+  OS_Wait(&Gate);
+  MidOrder = ++Through;
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// dies holding Lock, with InheritHigh waiting on it
+static void KillHolder(void){
+  OS_MutexLock(&Lock);
+  OS_Wait(&Gate);
+  OS_Kill();
+}
+
+static void InheritHigh(void){
+  OS_MutexLock(&Lock);
+  OS_MutexUnlock(&Lock);
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// the only thread of a process, killing it ends the process
+static void Proc(void){
+  OS_Signal(&Done);
+  OS_Kill();
+}
+
+// preempts the caller as soon as it is added and dies at once
+static void ShortLived(void){
+  Stamp = OS_Time();
+  OS_Kill();
+}
+
+static void benchSwitch(void){
+  statClear(&Stat);
+  Stamped = 0;
+  run2(Yielder, Yielder);
+  statPrint("switch", &Stat);
+}
+
+// the switch benchmark again with 20, 64 and 256 threads alive, all but
+// the two yielders blocked; with one ready list per priority the cost
+// must not grow with the number of threads
+static void benchThreads(void){
+  char name[16];
+  unsigned long k, filled;
+  for(k = 0; k < SWEEP_POINTS; k++){
+    sprintf(name, "switch_t%lu", Sweep[k]);
+    statClear(&Stat);
+    if(Sweep[k] <= (unsigned long)OS_MaxThreads()){
+      filled = fill(Sweep[k] - 2);    // the yielders make up the rest
+      Stamped = 0;
+      run2(Yielder, Yielder);
+      release(filled);
+    }
+    statPrint(name, &Stat);
+  }
+}
+
+// TIMER4 handler time so far, in cycles, and how many times it ran
+static uint64_t tickCycles(unsigned long *count){
+  isrInfoType info;
+  int n;
+  for(n = 0; OS_IsrInfo(n, &info); n++){
+    if(info.irq == TIMER4_IRQ){
+      *count = info.count;
+      return info.cycles;
+    }
+  }
+  *count = 0;
+  return 0;
+}
+
+// the cost of one TIMER4 tick with 20, 64 and 256 threads alive, the
+// added ones on the sleep list in timed waits that outlast the run; the
+// caller sleeps 1 ms at a time so there is a tick every ms. The delta
+// list only looks at its head, so the cost must not grow with sleepers
+static void benchTick(void){
+  char name[16];
+  unsigned long k, i, live, sleepers, count0, count1;
+  uint64_t cycles0, cycles1;
+  uint32_t data = 0;
+  Fifo = OS_FifoCreate(4, sizeof(uint32_t));
+  check("fifo_create", Fifo != 0);
+  if(Fifo == 0)
+    return;
+  for(k = 0; k < SWEEP_POINTS; k++){
+    sprintf(name, "tick_t%lu", Sweep[k]);
+    if(Sweep[k] > (unsigned long)OS_MaxThreads()){
+      printf("BENCH %s n=0\r\n", name);
+      continue;
+    }
+    live = liveThreads();
+    for(sleepers = 0; live + sleepers < Sweep[k] && spawn(Sleeper, BENCH_PRI-1); )
+      sleepers++;
+    cycles0 = tickCycles(&count0);
+    for(i = 0; i < BENCH_TICKS; i++)
+      OS_Sleep(1);
+    cycles1 = tickCycles(&count1);
+    while(sleepers--)
+      OS_FifoPut(Fifo, &data, OS_WAIT_FOREVER);   // each one wakes a sleeper
+    if(count1 == count0)
+      count1++;
+    printf("BENCH %s n=%lu avg=%lu\r\n", name, count1 - count0,
+           (unsigned long)((cycles1 - cycles0)/(count1 - count0)));
+  }
+  OS_FifoDestroy(Fifo);
+}
+
+static void benchSema(void){
+  statClear(&Stat);
+  OS_InitSemaphore(&Ping, -1);
+  OS_InitSemaphore(&Pong, -1);
+  run2(Pinger, Ponger);
+  statPrint("sema_roundtrip", &Stat);
+}
+
+static void benchMailbox(void){
+  unsigned long i, now;
+  statClear(&Stat);
+  Moved = 0;
+  Box = OS_QueueCreate(1, sizeof(unsigned long));
+  check("mailbox_create", Box != 0);
+  if(Box == 0)
+    return;
+  if(spawn(BoxReader, BENCH_PRI-1)){
+    for(i = 0; i < N; i++){
+      now = OS_Time();
+      OS_QueueSend(Box, &now, OS_WAIT_FOREVER);
+    }
+    OS_Wait(&Done);
+  }
+  OS_QueueDestroy(Box);
+  statPrint("mailbox_latency", &Stat);
+  check("mailbox_latency", Moved == N);
+}
+
+static void benchFifo(const char *name, void(*put)(void), void(*get)(void)){
+  uint32_t expect = 0;
+  unsigned long i;
+  uint64_t start;
+  for(i = 0; i < N; i++)
+    expect += i;
+  Moved = 0;
+  Sum = 0;
+  Fifo = OS_FifoCreate(BENCH_FIFO, sizeof(uint32_t));
+  check("fifo_create", Fifo != 0);
+  if(Fifo == 0)
+    return;
+  start = OS_Time64();
+  run2(put, get);
+  ratePrint(name, N, OS_TimeDifference64(start, OS_Time64()));
+  OS_FifoDestroy(Fifo);
+  check(name, Moved == N && Sum == expect);
+}
+
+static void benchCreateKill(void){
+  benchStatType kill;
+  unsigned long i, start, end;
+  statClear(&Stat);
+  statClear(&kill);
+  for(i = 0; i < N; i++){
+    start = OS_Time();
+    if(!spawn(ShortLived, BENCH_PRI-1))
+      break;
+    end = OS_Time();
+    statAdd(&Stat, OS_TimeDifference(start, Stamp));
+    statAdd(&kill, OS_TimeDifference(Stamp, end));
+  }
+  statPrint("thread_create", &Stat);
+  statPrint("thread_kill", &kill);
+}
+
+// a small Heap_Malloc and Heap_Free pair, mostly served by the thread cache
+static void benchHeap(void){
+  unsigned long i, start;
+  void *p;
+  uint64_t begin;
+  statClear(&Stat);
+  for(i = 0; i < N; i++){
+    start = OS_Time();
+    p = Heap_Malloc(32);
+    Heap_Free(p);
+    statAdd(&Stat, OS_TimeDifference(start, OS_Time()));
+    if(p == 0)
+      break;
+  }
+  statPrint("heap_pair", &Stat);
+  check("heap_pair", Stat.n == N);
+  Moved = 0;
+  HeapErrors = 0;
+  begin = OS_Time64();
+  run2(HeapWorker, HeapWorker);
+  ratePrint("heap_threads", Moved ? Moved : 1, OS_TimeDifference64(begin, OS_Time64()));
+  check("heap_threads", HeapErrors == 0 && Heap_Test() == HEAP_OK);
+}
+
+// a Pool_Alloc and Pool_Free pair on a lock free pool, to set beside heap_pair
+static void benchPool(void){
+  static uint32_t storage[POOL_WORDS(32, BENCH_BLOCKS)];
+  PoolType *pool = Pool_CreateLockFree(32, BENCH_BLOCKS, storage);
+  pool_stats_t stats;
+  unsigned long i, start;
+  void *p;
+  statClear(&Stat);
+  for(i = 0; i < N; i++){
+    start = OS_Time();
+    p = Pool_Alloc(pool);
+    Pool_Free(pool, p);
+    statAdd(&Stat, OS_TimeDifference(start, OS_Time()));
+  }
+  statPrint("pool_pair", &Stat);
+  for(i = 0; i <= BENCH_BLOCKS; i++)
+    Pool_Alloc(pool);           // the last one fails
+  stats = Pool_Stats(pool);
+  check("pool_pair", stats.used == BENCH_BLOCKS && stats.peak == BENCH_BLOCKS &&
+        stats.failures == 1 && Pool_Free(pool, storage) == POOL_ERROR_POINTER);
+}
+
+// a thread blocked on a semaphore that owns a mutex is boosted by a
+// higher priority thread locking that mutex, and must move ahead of a
+// waiter it now outranks
+static void benchInherit(void){
+  int started;
+  OS_InitSemaphore(&Gate, -1);
+  OS_InitMutex(&Lock);
+  Through = LowOrder = MidOrder = 0;
+  started = spawn(InheritMid, BENCH_PRI) + spawn(InheritLow, BENCH_PRI+1);
+  OS_Sleep(2);                      // both are waiting on Gate now
+  started += spawn(InheritHigh, BENCH_PRI-1);
+  OS_Signal(&Gate);
+  OS_Sleep(1);                      // whoever was first goes through alone
+  OS_Signal(&Gate);
+  while(started--)
+    OS_Wait(&Done);
+  check("inherit_sema", LowOrder == 1 && MidOrder == 2);
+}
+
+// a thread killed while it owns a mutex must hand it to its waiter
+static void benchKillHolder(void){
+  OS_InitSemaphore(&Gate, -1);
+  OS_InitMutex(&Lock);
+  if(!spawn(KillHolder, BENCH_PRI+1))
+    return;
+  OS_Sleep(1);                      // KillHolder owns Lock and waits on Gate
+  if(!spawn(InheritHigh, BENCH_PRI-1))
+    return;
+  OS_Signal(&Gate);
+  OS_Sleep(2);
+  check("kill_mutex", Lock.owner == 0 && Lock.next == 0);
+  if(Lock.owner == 0)
+    OS_Wait(&Done);                 // InheritHigh got through
+}
+
+// start and end more processes than there are PCBs, one at a time, so
+// every PCB has to come back once the last thread of its process is gone
+static void benchProcs(void){
+  uint32_t *text, *data;
+  int i, ok = 1;
+  for(i = 0; i < BENCH_PROCS && ok; i++){
+    text = Heap_Malloc(16);
+    data = Heap_Malloc(16);
+    ok = text && data && OS_AddProcess(&Proc, text, data, BENCH_STACK, BENCH_PRI-1) == 0;
+    if(ok)
+      OS_Wait(&Done);
+  }
+  check("proc_recycle", ok);
+}
+
+// how late OS_Sleep wakes up, negative if early
+static void benchSleep(void){
+  unsigned long i, ms;
+  uint64_t start;
+  statClear(&Stat);
+  for(i = 0; i < BENCH_SLEEPS; i++){
+    ms = 1 + i%10;
+    start = OS_Time64();
+    OS_Sleep(ms);
+    statAdd(&Stat, (long)(OS_TimeDifference64(start, OS_Time64()) - ms*TIME_1MS));
+  }
+  statPrint("sleep_error", &Stat);
+}
+
+int Bench_Run(unsigned long n){
+  N = n ? n : 1;
+  Failed = 0;
+  OS_InitSemaphore(&Done, -1);
+  OS_InitSemaphore(&Hold, -1);
+  printf("BENCH begin clock=%lu\r\n", (unsigned long)TIME_1MS*1000);
+  benchSwitch();
+  benchSema();
+  benchMailbox();
+  benchFifo("fifo_throughput", Producer, Consumer);
+  benchFifo("fifo_batch16", BatchProducer, BatchConsumer);
+  benchCreateKill();
+  benchHeap();
+  benchPool();
+  benchSleep();
+  benchInherit();
+  benchKillHolder();
+  benchProcs();
+  benchThreads();
+  benchTick();
+  printf("BENCH end failed=%d\r\n", Failed);
+  return Failed;
+}
@@ -0,0 +1,29 @@
+// bench.h
+// Runs on LM4F120/TM4C123, and on Linux under host/sim.c
+// Kernel benchmarks: semaphore round trip, mailbox latency, FIFO
+// throughput, thread create and kill, context switch, heap and pool
+// allocation and OS_Sleep accuracy, then the context switch and the
+// TIMER4 tick again with 20, 64 and 256 threads alive (switch_t<threads>
+// and tick_t<threads>, skipped above OS_MaxThreads). Results go out
+// through printf, one line each:
+//   BENCH <name> n=<count> avg=<cycles> [min=<cycles> max=<cycles>] [rate=<per s>]
+// between a "BENCH begin" and a "BENCH end failed=<count>" line. Cycles
+// are OS_Time units, 12.5 ns, one bus cycle at 80 MHz. Lines are meant
+// to be grepped out of a UART capture and compared from run to run.
+
+#ifndef __BENCH_H
+#define __BENCH_H  1
+
+// the caller runs at BENCH_PRI, benchmark threads run one above and one
+// below it, so nothing else may be ready between 0 and BENCH_PRI+1
+#define BENCH_PRI 1
+
+// ******** Bench_Run ************
+// Run every benchmark once and print the results
+// Inputs:  n iterations per benchmark, at least 1
+// Outputs: number of benchmarks that failed a sanity check
+// Must be called from a thread at priority BENCH_PRI, after Heap_Init.
+// Takes about n*20us plus a second for the OS_Sleep runs and ticks
+int Bench_Run(unsigned long n);
+
+#endif
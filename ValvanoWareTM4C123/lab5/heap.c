@@ -26,35 +26,121 @@
  */
 
 // Implementation Notes:
-// This is a Knuth Heap. Each block has a header and a trailer, which I shall
-// call the meta-sections.  The meta-sections are each a single int32_t that tells
-// how many int32_ts/words can be stored between the header and trailer.
-// If the block is used, the meta-sections record the room as a positive
-// number.  If the block is unused, the meta-sections record the room as a
-// negative number.
+// This is a two level segregated fit (TLSF) heap, so Heap_Malloc and
+// Heap_Free take the same few steps whatever the state of the heap.
+// Every block starts with a header holding the block just below it and
+// its payload size, with BLOCK_FREE set while it is unused; the block
+// above is found from the size. A zero sized used block at the top of
+// the heap stops the walk. Free blocks are also on one of FL_COUNT x
+// SL_COUNT doubly linked lists: the first level is the power of 2 below
+// the size, the second splits that range into SL_COUNT equal parts.
+// Sizes under SMALL_BLOCK all share first level 0, one list per ALIGN
+// bytes. A bit per non-empty list in FlBitmap and SlBitmap turns the
+// search for a big enough block into two count-leading-zero steps.
+// Heap_Malloc rounds the request up to the next list boundary so any
+// block on the list it picks will do, splits off what it does not need,
+// and Heap_Free merges the block with free neighbors before listing it.
+// Heap_Realloc works in place when it can: it splits the tail off a
+// block that shrinks and takes in a free block just above one that
+// grows. Only if neither fits does it copy.
+//
+// Under the kernel, Heap_SetThreadHooks gives the heap a lock and a way
+// to find the calling thread's heap_cache_t. Blocks of 16, 32, 64 and 128
+// bytes that a thread frees stay in its cache, still marked used plus
+// BLOCK_CACHED, and its next request of that class takes one back without
+// the lock. Only the owning thread ever touches a cache, and a used
+// block's header is never written by anyone else, so that path needs no
+// lock at all. Requests that fit a class are rounded up to it. Everything
+// else goes to the lists above under the lock, and a thread that finds
+// them empty gives its cache back first.
+//
+// The size word of a used block also carries, in its top 16 bits, the
+// tag of whoever allocated it, from the Heap_SetTagHook hook. Sizes stay
+// below 64K so the two never meet. Heap_Map hands these words out as
+// they are, which is why BLOCK_FREE and BLOCK_CACHED are the HEAP_ENTRY
+// flags of heap.h.
+#include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 #include "heap.h"
 
-#define HEAP_START (Heap)
-#define HEAP_END (HEAP_START + HEAP_SIZE_WORDS)
-
-//The actual heap is just a big array.
-static int32_t Heap[HEAP_SIZE_WORDS];
-
-static int32_t inHeapRange(int32_t* address);
-static int32_t blockUsed(int32_t* block);
-static int32_t blockUnused(int32_t* block);
-static int32_t blockRoom(int32_t* block);
-//static int32_t blockSize(int32_t* block);
-static int32_t* blockHeader(int32_t* blockEnd);
-static int32_t* blockTrailer(int32_t* blockStart);
-static int32_t* nextBlockHeader(int32_t* blockStart);
-static int32_t* previousBlockHeader(int32_t* blockStart);
-static int32_t markBlockUsed(int32_t* blockStart);
-static int32_t markBlockUnused(int32_t* blockStart);
-static int32_t splitAndMarkBlockUsed(int32_t* upperBlockStart, int32_t desiredRoom);
-static void mergeBlockWithBelow(int32_t* upperBlockStart);
-//static int32_t byteIndex(int32_t* ptr);
+#ifdef __ARMCC_VERSION
+#define CLZ(x) __clz(x)
+#else
+#define CLZ(x) __builtin_clz(x)
+#endif
+
+#define ALIGN_LOG2  3
+#define ALIGN       (1 << ALIGN_LOG2)     // payload alignment and size step, bytes
+#define SL_LOG2     3
+#define SL_COUNT    (1 << SL_LOG2)        // second level lists per first level
+#define FL_SHIFT    (SL_LOG2 + ALIGN_LOG2)
+#define SMALL_BLOCK (1 << FL_SHIFT)       // below this the lists are ALIGN apart
+#define FL_COUNT    10                    // blocks up to 2^(FL_COUNT+FL_SHIFT-1) bytes
+
+#if HEAP_SIZE_BYTES >= (1 << (FL_COUNT + FL_SHIFT - 1))
+#error "HEAP_SIZE_BYTES needs a bigger FL_COUNT"
+#endif
+
+#if HEAP_SIZE_BYTES > 0xFFFF
+#error "HEAP_SIZE_BYTES must leave the top half of the size word for the tag"
+#endif
+
+#define BLOCK_FREE   HEAP_ENTRY_FREE
+#define BLOCK_CACHED HEAP_ENTRY_CACHED    // used, but sitting in a thread cache
+#define BLOCK_FLAGS  (BLOCK_FREE | BLOCK_CACHED)
+#define BLOCK_SIZE   (0xFFFFu & ~BLOCK_FLAGS)
+#define BLOCK_TAG    16                   // shift of the owner tag
+
+#define CACHE_MIN    16                   // smallest class, bytes
+#define CACHE_MAX    (CACHE_MIN << (HEAP_CACHE_CLASSES - 1))
+
+typedef struct block {
+  struct block *prevPhys;   // block just below this one, 0 for the first
+  uint32_t size;            // tag << BLOCK_TAG | payload bytes | flags
+  struct block *nextFree;   // free blocks only, these two overlay the payload
+  struct block *prevFree;
+} blockType;
+
+#define BLOCK_HDR   ((offsetof(blockType, nextFree) + ALIGN - 1) & ~(ALIGN - 1))
+#define MIN_PAYLOAD ((sizeof(blockType) - BLOCK_HDR + ALIGN - 1) & ~(ALIGN - 1))
+
+//The actual heap is just a big array, 8 byte aligned.
+static uint64_t Heap[HEAP_SIZE_BYTES / sizeof(uint64_t)];
+#define HEAP_START ((uint8_t*)Heap)
+#define HEAP_END (HEAP_START + sizeof(Heap))
+#define HEAP_LAST ((blockType*)(HEAP_END - BLOCK_HDR - MIN_PAYLOAD)) // end marker
+
+static uint32_t FlBitmap;
+static uint32_t SlBitmap[FL_COUNT];
+static blockType* FreeLists[FL_COUNT][SL_COUNT];
+
+static heap_cache_t* (*CacheOf)(void) = 0;
+static long (*Lock)(void) = 0;
+static void (*Unlock)(long) = 0;
+static uint16_t (*TagOf)(void) = 0;
+
+static int32_t highBit(uint32_t x);
+static int32_t lowBit(uint32_t x);
+static uint32_t blockSize(blockType* block);
+static void* blockPayload(blockType* block);
+static blockType* payloadBlock(void* pointer);
+static blockType* nextPhys(blockType* block);
+static void mapping(uint32_t size, int32_t* fl, int32_t* sl);
+static void insertFree(blockType* block);
+static void removeFree(blockType* block);
+static blockType* findFree(uint32_t size);
+static void splitBlock(blockType* block, uint32_t size);
+static blockType* mergeBlocks(blockType* lower, blockType* upper);
+static blockType* checkUsed(void* pointer, int32_t* status);
+static blockType* takeFree(uint32_t size);
+static void freeBlock(blockType* block);
+static int32_t cacheClass(uint32_t size);
+static void flushCache(heap_cache_t* cache);
+static long lockHeap(void);
+static int32_t testHeap(void);
+static void unlockHeap(long sr);
+static void tagBlock(blockType* block);
 
 //******** Heap_Init *************** 
 // Initialize the Heap
@@ -63,10 +149,21 @@ static void mergeBlockWithBelow(int32_t* upperBlockStart);
 // notes: Initializes/resets the heap to a clean state where no memory
 //  is allocated.
 int32_t Heap_Init(void){
-  int32_t* blockStart = HEAP_START;
-  int32_t* blockEnd = (HEAP_START + HEAP_SIZE_WORDS - 1);
-  *blockStart = -(int32_t)(HEAP_SIZE_WORDS - 2);  
-  *blockEnd = -(int32_t)(HEAP_SIZE_WORDS - 2);
+  blockType* first = (blockType*)HEAP_START;
+  blockType* last = HEAP_LAST;
+  int32_t i;
+  long sr = lockHeap();
+  FlBitmap = 0;
+  for(i = 0; i < FL_COUNT; i++){
+    SlBitmap[i] = 0;
+    memset(FreeLists[i], 0, sizeof(FreeLists[i]));
+  }
+  first->prevPhys = 0;
+  first->size = (uint32_t)((uint8_t*)last - HEAP_START - BLOCK_HDR);
+  last->prevPhys = first;
+  last->size = 0;                 // used, stops the walk
+  insertFree(first);
+  unlockHeap(sr);
   return HEAP_OK;
 }
 
@@ -78,23 +175,46 @@ int32_t Heap_Init(void){
 // output: void* pointing to the allocated memory or will return NULL
 //   if there isn't sufficient space to satisfy allocation request
 void* Heap_Malloc(int32_t desiredBytes){
-  int32_t desiredWords = (desiredBytes + sizeof(int32_t) - 1) / sizeof(int32_t);
-  int32_t* blockStart = HEAP_START;  // implements first fit
-  if(desiredWords <= 0){
+  uint32_t size;
+  blockType* block;
+  heap_cache_t* cache;
+  void* pointer;
+  long sr;
+  if(desiredBytes <= 0 || desiredBytes > HEAP_SIZE_BYTES){
     return 0; //NULL
   }
-  while(inHeapRange(blockStart)){
-  // one pass through the heap
-  // choose first block that is big enough
-    if(blockUnused(blockStart) && desiredWords <= blockRoom(blockStart)){
-      if(splitAndMarkBlockUsed(blockStart, desiredWords)){
-        return 0; //NULL
-      }
-      return blockStart + 1;
+  size = ((uint32_t)desiredBytes + ALIGN - 1) & ~(ALIGN - 1);
+  if(size < MIN_PAYLOAD){
+    size = MIN_PAYLOAD;
+  }
+  cache = CacheOf ? CacheOf() : 0;
+  if(cache && size <= CACHE_MAX){
+    int32_t c = cacheClass(size);
+    size = CACHE_MIN << c;
+    pointer = cache->head[c];
+    if(pointer){
+      cache->head[c] = *(void**)pointer;
+      cache->bytes -= size;
+      payloadBlock(pointer)->size &= ~BLOCK_CACHED;
+      tagBlock(payloadBlock(pointer));
+      return pointer;
     }
-    blockStart = nextBlockHeader(blockStart);
   }
-  return 0; //NULL
+  sr = lockHeap();
+  if(sr == HEAP_LOCK_REFUSED){
+    return 0; //NULL
+  }
+  block = takeFree(size);
+  if(block == 0 && cache && cache->bytes){
+    flushCache(cache);            // what this thread holds back might do
+    block = takeFree(size);
+  }
+  unlockHeap(sr);
+  if(block == 0){
+    return 0; //NULL
+  }
+  tagBlock(block);
+  return blockPayload(block);
 }
 
 
@@ -106,22 +226,13 @@ void* Heap_Malloc(int32_t desiredBytes){
 //   if there isn't sufficient space to satisfy allocation request
 //notes: the allocated memory block will be zeroed out
 void* Heap_Calloc(int32_t desiredBytes){  
-  int32_t* blockPtr;
-  int32_t wordsToClear;
-  int32_t i;
-  
-  //malloc a block
-  blockPtr = Heap_Malloc(desiredBytes);
+  void* pointer = Heap_Malloc(desiredBytes);
   //did malloc fail?
-  if(blockPtr == 0){
+  if(pointer == 0){
     return 0; //NULL
   }
-  wordsToClear = *(blockPtr - 1); //get room from header
-  //clear out block
-  for(i = 0; i < wordsToClear; i++){
-    blockPtr[i] = 0;
-  }
-  return blockPtr;
+  memset(pointer, 0, blockSize(payloadBlock(pointer)));
+  return pointer;
 }
 
 
@@ -133,47 +244,60 @@ void* Heap_Calloc(int32_t desiredBytes){
 //    where the contents of the old block will be copied to
 // output: void* pointing to the new block or will return NULL
 //   if there is any reason the reallocation can't be completed
-// notes: the given block will be unallocated after its contents
-//   are copied to the new block
+// notes: the block is resized in place if it shrinks or the memory
+//   just above it is free, and the same pointer comes back; otherwise
+//   the given block will be unallocated after its contents are copied
+//   to the new block. On failure the given block is left as it was
 void* Heap_Realloc(void* oldBlock, int32_t desiredBytes){
-  int32_t* oldBlockPtr;
-  int32_t* oldBlockStart;
-  int32_t* newBlockPtr;
-  int32_t oldBlockRoom;
-  int32_t newBlockRoom;
-  int32_t wordsToCopy;
-  int32_t i;
-  
-  oldBlockPtr = (int32_t*) oldBlock;
-  // error if...
-  // 1) oldBlockPtr doesn't point in the heap
-  // 2) oldBlockPtr points to an unused block
-  oldBlockStart = oldBlockPtr - 1;
-  if(!inHeapRange(oldBlockStart) || blockUnused(oldBlockStart)){
+  blockType* block;
+  blockType* next;
+  void* newBlock;
+  uint32_t size;
+  uint32_t bytesToCopy;
+  int32_t status;
+  long sr;
+
+  block = checkUsed(oldBlock, &status);
+  if(block == 0 || desiredBytes <= 0 || desiredBytes > HEAP_SIZE_BYTES){
     return 0; // NULL
   }
-
-  newBlockPtr = Heap_Malloc(desiredBytes);
-  // did Malloc fail?
-  if(newBlockPtr == 0){
+  size = ((uint32_t)desiredBytes + ALIGN - 1) & ~(ALIGN - 1);
+  if(size < MIN_PAYLOAD){
+    size = MIN_PAYLOAD;
+  }
+  // shrink, or grow into a free block just above, without moving
+  sr = lockHeap();
+  if(sr == HEAP_LOCK_REFUSED){
     return 0; // NULL
   }
-  
-  oldBlockRoom = blockRoom(oldBlockStart);
-  newBlockRoom = blockRoom(newBlockPtr - 1);
-  if(oldBlockRoom < newBlockRoom){
-    wordsToCopy = oldBlockRoom;
+  next = nextPhys(block);
+  if(size > blockSize(block) && (next->size & BLOCK_FREE) &&
+     size <= blockSize(block) + BLOCK_HDR + blockSize(next)){
+    removeFree(next);
+    mergeBlocks(block, next);
   }
-  else{
-    wordsToCopy = newBlockRoom;
-  }  
-  for(i = 0; i < wordsToCopy; i++){
-    newBlockPtr[i] = oldBlockPtr[i];
+  if(size <= blockSize(block)){
+    splitBlock(block, size);
+    unlockHeap(sr);
+    tagBlock(block);
+    return oldBlock;
+  }
+  unlockHeap(sr);
+  // no room here, copy it somewhere else
+  newBlock = Heap_Malloc(desiredBytes);
+  // did Malloc fail?
+  if(newBlock == 0){
+    return 0; // NULL
+  }
+  bytesToCopy = blockSize(block);
+  if(bytesToCopy > blockSize(payloadBlock(newBlock))){
+    bytesToCopy = blockSize(payloadBlock(newBlock));
   }
-  if(Heap_Free(oldBlockPtr)){
+  memcpy(newBlock, oldBlock, bytesToCopy);
+  if(Heap_Free(oldBlock)){
     return 0; // NULL Free failed
   }
-  return newBlockPtr;
+  return newBlock;
 }
 
 
@@ -185,77 +309,224 @@ void* Heap_Realloc(void* oldBlock, int32_t desiredBytes){
 //  HEAP_ERROR_CORRUPTED_HEAP if heap has been corrupted or trying to
 //  unallocate memory that has already been unallocated;
 int32_t Heap_Free(void* pointer){
-  int32_t* blockStart;
-  int32_t* blockEnd;
-  int32_t* nextBlockStart;
-  
-  blockStart = ((int32_t*)pointer) - 1;
-
-  //-----Begin error checking-------
-  if(!inHeapRange(blockStart)){
-    return HEAP_ERROR_POINTER_OUT_OF_RANGE;
+  blockType* block;
+  heap_cache_t* cache;
+  uint32_t size;
+  int32_t status;
+  long sr;
+
+  block = checkUsed(pointer, &status);
+  if(block == 0){
+    return status;
   }
-  if(blockUnused(blockStart)){
-    return HEAP_ERROR_CORRUPTED_HEAP;
+  cache = CacheOf ? CacheOf() : 0;
+  size = blockSize(block);
+  if(cache && size >= CACHE_MIN && size <= CACHE_MAX && (size & (size - 1)) == 0 &&
+     cache->bytes + size <= HEAP_CACHE_BYTES){
+    int32_t c = cacheClass(size);
+    block->size |= BLOCK_CACHED;
+    tagBlock(block);
+    *(void**)pointer = cache->head[c];
+    cache->head[c] = pointer;
+    cache->bytes += size;
+    return HEAP_OK;
   }
-  blockEnd = blockTrailer(blockStart);
-  if(!inHeapRange(blockEnd) || blockUnused(blockEnd)){
-    return HEAP_ERROR_CORRUPTED_HEAP;
+  sr = lockHeap();
+  if(sr == HEAP_LOCK_REFUSED){
+    return HEAP_ERROR_NOT_ALLOWED;
   }
-  //-----End error checking-------
+  freeBlock(block);
+  unlockHeap(sr);
+  return HEAP_OK;
+}
 
-  if(markBlockUnused(blockStart)){
-    return HEAP_ERROR_CORRUPTED_HEAP;
+
+//******** Heap_SetThreadHooks ***************
+// Let the heap run under a preemptive kernel
+// input:
+//   cache: returns the calling thread's cache, or NULL if there is none
+//   lock: keeps other threads away, returns what unlock needs, or
+//     HEAP_LOCK_REFUSED to turn the caller away
+//   unlock: undoes lock
+// output: none
+void Heap_SetThreadHooks(heap_cache_t* (*cache)(void), long (*lock)(void), void (*unlock)(long)){
+  CacheOf = cache;
+  Lock = lock;
+  Unlock = unlock;
+}
+
+
+//******** Heap_CacheFlush ***************
+// Give every block in a thread cache back to the heap
+// input: pointer to the cache
+// output: none
+void Heap_CacheFlush(heap_cache_t* cache){
+  long sr = lockHeap();
+  if(sr == HEAP_LOCK_REFUSED){
+    return;
   }
+  flushCache(cache);
+  unlockHeap(sr);
+}
 
-  // time to possibly merge with block above
-  // first, make sure there IS a block above us
-  if(blockStart > HEAP_START){ 
-    int32_t* previousBlockStart = previousBlockHeader(blockStart);
-    // second, make sure we only merge with an unused block
-    if(blockUnused(previousBlockStart)){
-      mergeBlockWithBelow(previousBlockStart);
-      blockStart = previousBlockStart; // start of block has moved
-    }
+
+//******** Heap_SetTagHook *************** 
+// Say who owns the blocks allocated from now on
+// input: returns the tag of the caller, e.g. HEAP_TAG(pid, thread id)
+// output: none
+void Heap_SetTagHook(uint16_t (*tag)(void)){
+  TagOf = tag;
+}
+
+
+//******** Heap_SetTag *************** 
+// Hand a block over to another owner
+// input: pointer returned by Heap_Malloc, its new tag
+// output: HEAP_OK, or an error as for Heap_Free
+int32_t Heap_SetTag(void* pointer, uint16_t tag){
+  blockType* block;
+  int32_t status;
+  block = checkUsed(pointer, &status);
+  if(block){
+    block->size = (block->size & 0xFFFF) | (uint32_t)tag << BLOCK_TAG;
   }
+  return status;
+}
 
-  // possibly merge with block below
-  nextBlockStart = nextBlockHeader(blockStart);
-  if(inHeapRange(nextBlockStart) && blockUnused(nextBlockStart)){
-    mergeBlockWithBelow(blockStart);
+
+//******** Heap_Analyze *************** 
+// Describe how the heap is split up
+// input: where to put the results
+// output: HEAP_OK, or HEAP_ERROR_CORRUPTED_HEAP if the walk went wrong
+// notes: fragmentation is 1000 - 1000*largest free block/free bytes,
+//  so 0 while all the free space is in one block
+int32_t Heap_Analyze(heap_frag_t* frag){
+  blockType* block;
+  uint32_t size;
+  int32_t k;
+  long sr;
+  memset(frag, 0, sizeof(*frag));
+  frag->headerBytes = BLOCK_HDR;
+  sr = lockHeap();
+  for(block = (blockType*)HEAP_START; block < HEAP_LAST; block = nextPhys(block)){
+    size = blockSize(block);
+    if(block->size & BLOCK_FREE){
+      frag->freeBytes += size;
+      frag->freeBlocks++;
+      if((int32_t)size > frag->largestFree){
+        frag->largestFree = size;
+      }
+      k = highBit(size) - ALIGN_LOG2;
+      frag->histogram[k < HEAP_HIST_BUCKETS ? k : HEAP_HIST_BUCKETS - 1]++;
+    }
+    else{
+      frag->usedBytes += size;
+      frag->usedBlocks++;
+      if(block->size & BLOCK_CACHED){
+        frag->cachedBytes += size;
+        frag->cachedBlocks++;
+      }
+    }
+  }
+  unlockHeap(sr);
+  if(block != HEAP_LAST){
+    return HEAP_ERROR_CORRUPTED_HEAP;
+  }
+  if(frag->freeBytes){
+    frag->fragmentation = 1000 - (int32_t)((uint64_t)frag->largestFree*1000/frag->freeBytes);
   }
   return HEAP_OK;
 }
 
 
+//******** Heap_Map *************** 
+// Take a snapshot of every block, lowest address first
+// input: room for max entries, see HEAP_ENTRY_SIZE and friends
+// output: number of blocks in the heap, which may be more than max;
+//   -1 if the walk went wrong
+int32_t Heap_Map(uint32_t* map, int32_t max){
+  blockType* block;
+  int32_t count = 0;
+  long sr = lockHeap();
+  for(block = (blockType*)HEAP_START; block < HEAP_LAST; block = nextPhys(block)){
+    if(count < max){
+      map[count] = block->size;
+    }
+    count++;
+  }
+  unlockHeap(sr);
+  return block == HEAP_LAST ? count : -1;
+}
+
+
 //******** Heap_Test *************** 
 // Test the heap
 // input: none
 // output: validity of the heap - either HEAP_OK or HEAP_ERROR_HEAP_CORRUPTED
 int32_t Heap_Test(void){
-  int32_t lastBlockWasUnused = 0;
-  int32_t* blockStart = HEAP_START;
-  while(inHeapRange(blockStart)){
-    int32_t* blockEnd;
-    
-    //shouldn't have any blocks holding zero words
-    if(*blockStart == 0){
+  long sr = lockHeap();
+  int32_t status = testHeap();
+  unlockHeap(sr);
+  return status;
+}
+
+
+// testHeap
+// input: none
+// output: what Heap_Test returns, with the lock already held
+static int32_t testHeap(void){
+  blockType* block = (blockType*)HEAP_START;
+  blockType* prev = 0;
+  blockType* listed;
+  int32_t freeBlocks = 0;
+  int32_t fl, sl;
+  while(1){
+    //every block must sit inside the heap, aligned, and know its neighbor
+    if((uint8_t*)block < HEAP_START || block > HEAP_LAST ||
+       ((uint8_t*)block - HEAP_START) % ALIGN || block->prevPhys != prev){
       return HEAP_ERROR_CORRUPTED_HEAP;
     }
-    blockEnd = blockTrailer(blockStart);
-    //error if blockEnd is not in the heap or blockend disagrees with blockStart
-    if(!inHeapRange(blockEnd) || *blockStart != *blockEnd){
-      return HEAP_ERROR_CORRUPTED_HEAP;
+    if(blockSize(block) == 0){
+      break;                      // the end marker
     }
-    //error if we have two adjacent unused blocks
-    if(lastBlockWasUnused && blockUnused(blockStart)){
+    if((block->size & BLOCK_FLAGS) == BLOCK_FLAGS ||
+       ((block->size & BLOCK_FREE) && (block->size >> BLOCK_TAG))){
       return HEAP_ERROR_CORRUPTED_HEAP;
     }
-    lastBlockWasUnused = blockUnused(blockStart);
-    blockStart = blockEnd + 1;
+    if(block->size & BLOCK_FREE){
+      //error if we have two adjacent unused blocks
+      if(prev && (prev->size & BLOCK_FREE)){
+        return HEAP_ERROR_CORRUPTED_HEAP;
+      }
+      freeBlocks++;
+    }
+    prev = block;
+    block = nextPhys(block);
   }
   //traversing the heap should end exactly where the heap ends
-  if(blockStart != HEAP_END){
+  if(block != HEAP_LAST || (block->size & BLOCK_FREE)){
+    return HEAP_ERROR_CORRUPTED_HEAP;
+  }
+  //every free block is on the list its size maps to, and the bitmaps agree
+  for(fl = 0; fl < FL_COUNT; fl++){
+    for(sl = 0; sl < SL_COUNT; sl++){
+      int32_t bits = (FlBitmap >> fl & 1) && (SlBitmap[fl] >> sl & 1);
+      if(bits != (FreeLists[fl][sl] != 0)){
+        return HEAP_ERROR_CORRUPTED_HEAP;
+      }
+      for(listed = FreeLists[fl][sl]; listed; listed = listed->nextFree){
+        int32_t f, s;
+        if(!(listed->size & BLOCK_FREE) || --freeBlocks < 0){
+          return HEAP_ERROR_CORRUPTED_HEAP;
+        }
+        mapping(blockSize(listed), &f, &s);
+        if(f != fl || s != sl){
+          return HEAP_ERROR_CORRUPTED_HEAP;
+        }
+      }
+    }
+  }
+  if(freeBlocks != 0){
     return HEAP_ERROR_CORRUPTED_HEAP;
   }
   return HEAP_OK;
@@ -267,8 +538,9 @@ int32_t Heap_Test(void){
 // input: none
 // output: a heap_stats_t that describes the current usage of the heap
 heap_stats_t Heap_Stats(void){
-  int32_t* blockStart;
+  blockType* block;
   heap_stats_t stats;
+  long sr = lockHeap();
   
   stats.wordsAllocated = 0;
   stats.wordsAvailable = 0;
@@ -276,182 +548,300 @@ heap_stats_t Heap_Stats(void){
   stats.blocksUnused = 0;
 
   //just go through each block to get stats on heap usage
-  blockStart = HEAP_START;
-  while(inHeapRange(blockStart)){
-    if(blockUsed(blockStart)){
-      stats.wordsAllocated += blockRoom(blockStart);
-      stats.blocksUsed++;
+  for(block = (blockType*)HEAP_START; blockSize(block); block = nextPhys(block)){
+    if(block->size & BLOCK_FREE){
+      stats.wordsAvailable += blockSize(block) / sizeof(int32_t);
+      stats.blocksUnused++;
     }
     else{
-      stats.wordsAvailable += blockRoom(blockStart);
-      stats.blocksUnused++;
+      stats.wordsAllocated += blockSize(block) / sizeof(int32_t);
+      stats.blocksUsed++;
     }
-    blockStart = nextBlockHeader(blockStart);
   }
+  unlockHeap(sr);
   stats.wordsOverhead = HEAP_SIZE_WORDS - stats.wordsAllocated - stats.wordsAvailable;
   return stats;
 }
 
 
-// inHeapRange
-// input: a pointer
-// output: whether or not the pointer points inside the heap
-static int32_t inHeapRange(int32_t* address){
-  return address >= HEAP_START && address < HEAP_END;
+// highBit
+// input: a non-zero number
+// output: index of its highest set bit
+static int32_t highBit(uint32_t x){
+  return 31 - (int32_t)CLZ(x);
+}
+
+
+// lowBit
+// input: a non-zero number
+// output: index of its lowest set bit
+static int32_t lowBit(uint32_t x){
+  return highBit(x & (0 - x));
+}
+
+
+// blockSize
+// input: pointer to the header of a block
+// output: how many bytes of data the block can hold
+static uint32_t blockSize(blockType* block){
+  return block->size & BLOCK_SIZE;
 }
 
 
-// blockUsed
-// input: pointer to the header or trailer of a block
-// output: whether or not the block is marked as used/allocated
-static int32_t blockUsed(int32_t* block){
-  return *block > 0;
+// blockPayload
+// input: pointer to the header of a block
+// output: pointer to the data the block holds
+static void* blockPayload(blockType* block){
+  return (uint8_t*)block + BLOCK_HDR;
 }
 
 
-// blockUnused
-// input: pointer to the header or trailer of a block
-// output: whether or not the block is marked as unused/unallocated
-static int32_t blockUnused(int32_t* block){
-  return *block < 0;
+// payloadBlock
+// input: pointer to the data in a block
+// output: pointer to the header of the same block
+static blockType* payloadBlock(void* pointer){
+  return (blockType*)((uint8_t*)pointer - BLOCK_HDR);
 }
 
 
-// blockRoom
-// input: pointer to the header or trailer of a block
-// output: how many words of data the block can hold
-static int32_t blockRoom(int32_t* block){
-  if(*block > 0){
-    return *block;
+// nextPhys
+// input: pointer to the header of a block
+// output: pointer to the header of the block just above it
+// notes: given the end marker, will point outside the heap; be careful
+static blockType* nextPhys(blockType* block){
+  return (blockType*)((uint8_t*)blockPayload(block) + blockSize(block));
+}
+
+
+// mapping
+// input: a block size in bytes, and where to put its list indices
+// output: none
+// notes: the list holding blocks of exactly this size
+static void mapping(uint32_t size, int32_t* fl, int32_t* sl){
+  if(size < SMALL_BLOCK){
+    *fl = 0;
+    *sl = size >> ALIGN_LOG2;
+  }
+  else{
+    int32_t f = highBit(size);
+    *sl = (size >> (f - SL_LOG2)) ^ SL_COUNT;
+    *fl = f - (FL_SHIFT - 1);
   }
-  return -*block;
 }
 
 
-// // blockSize
-// // input: pointer to the header or trailer of a block
-// // output: the size of a block in words, including header and trailer
-// static int32_t blockSize(int32_t* block){
-//   if(*block > 0){
-//     return *block + 2;
-//   }
-//   return -*block + 2;
-// }
+// insertFree
+// input: pointer to the header of a free block
+// output: none
+// notes: puts the block at the head of the list for its size
+static void insertFree(blockType* block){
+  int32_t fl, sl;
+  mapping(blockSize(block), &fl, &sl);
+  block->prevFree = 0;
+  block->nextFree = FreeLists[fl][sl];
+  if(block->nextFree){
+    block->nextFree->prevFree = block;
+  }
+  FreeLists[fl][sl] = block;
+  FlBitmap |= 1u << fl;
+  SlBitmap[fl] |= 1u << sl;
+}
 
 
-// blockHeader
-// input: pointer to the trailer of a block
-// output: pointer to the header of the same block
-static int32_t* blockHeader(int32_t* blockEnd){
-  return blockEnd - blockRoom(blockEnd) - 1;
+// removeFree
+// input: pointer to the header of a free block
+// output: none
+// notes: takes the block off its list, clearing the bits if it empties
+static void removeFree(blockType* block){
+  int32_t fl, sl;
+  mapping(blockSize(block), &fl, &sl);
+  if(block->nextFree){
+    block->nextFree->prevFree = block->prevFree;
+  }
+  if(block->prevFree){
+    block->prevFree->nextFree = block->nextFree;
+  }
+  else{
+    FreeLists[fl][sl] = block->nextFree;
+    if(FreeLists[fl][sl] == 0){
+      SlBitmap[fl] &= ~(1u << sl);
+      if(SlBitmap[fl] == 0){
+        FlBitmap &= ~(1u << fl);
+      }
+    }
+  }
 }
 
 
-// blockTrailer
-// input: pointer to the header of a block
-// output: pointer to the trailer of the same block
-static int32_t* blockTrailer(int32_t* blockStart){
-  return blockStart + blockRoom(blockStart) + 1;
+// findFree
+// input: payload size in bytes, a multiple of ALIGN
+// output: a free block with at least that much room, still on its list,
+//   or NULL if there is none
+// notes: starts at the list above the one size maps to, unless size
+//   is the smallest size on its list, so the head of any list found fits
+static blockType* findFree(uint32_t size){
+  int32_t fl, sl;
+  uint32_t map;
+  if(size >= SMALL_BLOCK){
+    size += (1u << (highBit(size) - SL_LOG2)) - 1;
+  }
+  mapping(size, &fl, &sl);
+  if(fl >= FL_COUNT){
+    return 0; //NULL
+  }
+  map = SlBitmap[fl] & (~0u << sl);
+  if(map == 0){
+    map = fl + 1 < FL_COUNT ? FlBitmap & (~0u << (fl + 1)) : 0;
+    if(map == 0){
+      return 0; //NULL
+    }
+    fl = lowBit(map);
+    map = SlBitmap[fl];
+  }
+  return FreeLists[fl][lowBit(map)];
 }
 
 
-// nextBlockHeader
-// input: pointer to the header of a block
-// output: pointer the the header of the next block in the heap
-// notes: given the header of the last block in the heap, will point to HEAP_END,
-//   which is not a valid block; be careful
-static int32_t* nextBlockHeader(int32_t* blockStart){
-  return blockTrailer(blockStart) + 1;
+// splitBlock
+// input: pointer to the header of a used block, payload bytes to keep
+// output: none
+// notes: frees whatever the block has beyond size, merged with a free
+//  block above it, unless the leftover is too small to make another
+//  useful block; the caller holds the lock
+static void splitBlock(blockType* block, uint32_t size){
+  blockType* rest;
+  uint32_t room = blockSize(block);
+  if(room < size + BLOCK_HDR + MIN_PAYLOAD){
+    return;
+  }
+  rest = (blockType*)((uint8_t*)blockPayload(block) + size);
+  rest->prevPhys = block;
+  rest->size = room - size - BLOCK_HDR;
+  nextPhys(rest)->prevPhys = rest;
+  block->size = (block->size & ~BLOCK_SIZE) | size;
+  freeBlock(rest);
 }
 
 
-// previousBlockHeader
-// input: pointer to the header of a block
-// output: pointer the the header of the previous block in the heap
-// notes: given the header of the first block in the heap, this function
-//   will go crazy and return a proportionally crazy address!
-static int32_t* previousBlockHeader(int32_t* blockStart){
-  return blockHeader(blockStart - 1);
+// mergeBlocks
+// input: two neighboring blocks, neither on a free list
+// output: the lower one, now holding both
+static blockType* mergeBlocks(blockType* lower, blockType* upper){
+  lower->size += blockSize(upper) + BLOCK_HDR;
+  nextPhys(lower)->prevPhys = lower;
+  return lower;
 }
 
 
-// markBlockUsed
-// input: pointer to the header of a block
-// output: a heap flag - HEAP_OK if everything is ok or HEAP_ERROR_CORRUPTEDHEAP
-//   if there is something obviously wrong with the block
-//notes: marks the block as used/allocated
-static int32_t markBlockUsed(int32_t* blockStart){
-  int32_t* blockEnd = blockTrailer(blockStart);
-  if(blockUsed(blockStart) || *blockStart != *blockEnd){
-    return HEAP_ERROR_CORRUPTED_HEAP;
+// checkUsed
+// input: pointer returned by Heap_Malloc, and where to put an error code
+// output: the block holding it, or NULL with *status set if the pointer
+//  is outside the heap, misaligned, or its block is free or damaged
+static blockType* checkUsed(void* pointer, int32_t* status){
+  blockType* block;
+  blockType* next;
+  if((uint8_t*)pointer < HEAP_START + BLOCK_HDR || (uint8_t*)pointer > (uint8_t*)HEAP_LAST ||
+     ((uint8_t*)pointer - HEAP_START) % ALIGN){
+    *status = HEAP_ERROR_POINTER_OUT_OF_RANGE;
+    return 0; //NULL
   }
-  *blockStart = -*blockStart;
-  *blockEnd = -*blockEnd;
-  return HEAP_OK;
+  block = payloadBlock(pointer);
+  next = nextPhys(block);
+  if((block->size & BLOCK_FLAGS) || blockSize(block) == 0 ||
+     next > HEAP_LAST || next->prevPhys != block){
+    *status = HEAP_ERROR_CORRUPTED_HEAP;
+    return 0; //NULL
+  }
+  *status = HEAP_OK;
+  return block;
 }
 
 
-// markBlockUnused
-// input: pointer to the header of a block
-// output: a heap flag - HEAP_OK if everything is ok or HEAP_ERROR_CORRUPTEDHEAP
-//  if there is something obviously wrong with the block
-// notes: marks the block as unused/unallocated
-static int32_t markBlockUnused(int32_t* blockStart){
-  int32_t* blockEnd = blockTrailer(blockStart);
-  if(blockUnused(blockStart) || *blockStart != *blockEnd){
-    return HEAP_ERROR_CORRUPTED_HEAP;
+// takeFree
+// input: payload size in bytes, a multiple of ALIGN
+// output: a used block with at least that much room, or NULL
+// notes: the caller holds the lock
+static blockType* takeFree(uint32_t size){
+  blockType* block = findFree(size);
+  if(block == 0){
+    return 0; //NULL
   }
-  *blockStart = -*blockStart;
-  *blockEnd = -*blockEnd;
-  return HEAP_OK;
+  removeFree(block);
+  block->size &= ~BLOCK_FREE;
+  splitBlock(block, size);
+  return block;
 }
 
 
-// splitAndMarkBlockUsed
-// input: 
-//  uppterBlockStart: header of a block 
-//  desiredRoom: desired amount of words to be in the new upper block
+// freeBlock
+// input: pointer to the header of a used block
 // output: none
-// notes: splits the block given so that the new upper block holds desiredRoom
-//  words (or more).  Marks the upper block as used, lower block as unused.
-//  Will not split a block if the leftover room is insufficient to make another
-//  useful block.
-static int32_t splitAndMarkBlockUsed(int32_t* upperBlockStart, int32_t desiredRoom){
-  int32_t leftoverRoom = blockRoom(upperBlockStart) - desiredRoom - 2;
-  // only split block if leftovers could actually make another useful block
-  if(leftoverRoom > 0){
-    int32_t* upperBlockEnd = upperBlockStart + desiredRoom + 1;
-    int32_t* lowerBlockStart = upperBlockEnd + 1;
-    int32_t* lowerBlockEnd = blockTrailer(upperBlockStart);
-    *upperBlockStart = desiredRoom; // marked used
-    *upperBlockEnd = desiredRoom;
-    *lowerBlockStart = -leftoverRoom; // marked unused
-    *lowerBlockEnd = -leftoverRoom;
-  }
-  // can't split block - just mark it at used
-  else{
-    if(markBlockUsed(upperBlockStart)){
-      return 0; // NULL Free failed
-    }
+// notes: the caller holds the lock
+static void freeBlock(blockType* block){
+  blockType* neighbor;
+  block->size = blockSize(block) | BLOCK_FREE;
+  neighbor = block->prevPhys;
+  if(neighbor && (neighbor->size & BLOCK_FREE)){
+    removeFree(neighbor);
+    block = mergeBlocks(neighbor, block);
   }
-  return HEAP_OK;
+  neighbor = nextPhys(block);
+  if(neighbor->size & BLOCK_FREE){
+    removeFree(neighbor);
+    block = mergeBlocks(block, neighbor);
+  }
+  insertFree(block);
 }
 
 
-// mergeBlockWithBelow
-// input: pointer to the header of a block
+// cacheClass
+// input: payload size in bytes, at most CACHE_MAX
+// output: the smallest cache class that holds it
+static int32_t cacheClass(uint32_t size){
+  return highBit((size - 1) | (CACHE_MIN - 1)) - (highBit(CACHE_MIN) - 1);
+}
+
+
+// flushCache
+// input: pointer to a thread cache
 // output: none
-// notes: will merge the given block with the block below it.
-//  WARNING: Does not check that the block below actually exists.
-static void mergeBlockWithBelow(int32_t* upperBlockStart){
-  int32_t* upperBlockEnd = blockTrailer(upperBlockStart);
-  int32_t* lowerBlockStart = upperBlockEnd + 1;
-  int32_t* lowerBlockEnd = blockTrailer(lowerBlockStart);
+// notes: the caller holds the lock
+static void flushCache(heap_cache_t* cache){
+  int32_t c;
+  void* pointer;
+  for(c = 0; c < HEAP_CACHE_CLASSES; c++){
+    while((pointer = cache->head[c]) != 0){
+      cache->head[c] = *(void**)pointer;
+      freeBlock(payloadBlock(pointer));
+    }
+  }
+  cache->bytes = 0;
+}
 
-  int32_t room = lowerBlockEnd - upperBlockStart - 1;
-  *upperBlockStart = -room;
-  *lowerBlockEnd = -room;
-  return;
+
+// lockHeap
+// input: none
+// output: what unlockHeap needs to undo it
+static long lockHeap(void){
+  return Lock ? Lock() : 0;
 }
 
 
+// unlockHeap
+// input: what lockHeap returned
+// output: none
+static void unlockHeap(long sr){
+  if(Unlock && sr != HEAP_LOCK_REFUSED){
+    Unlock(sr);
+  }
+}
+
+
+// tagBlock
+// input: pointer to the header of a used block
+// output: none
+// notes: marks the block as belonging to whoever is running
+static void tagBlock(blockType* block){
+  uint32_t tag = TagOf ? TagOf() : HEAP_TAG_NONE;
+  block->size = (block->size & 0xFFFF) | tag << BLOCK_TAG;
+}
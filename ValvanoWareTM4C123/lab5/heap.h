@@ -36,6 +36,10 @@
 #define HEAP_OK 0
 #define HEAP_ERROR_CORRUPTED_HEAP 1
 #define HEAP_ERROR_POINTER_OUT_OF_RANGE 2
+#define HEAP_ERROR_NOT_ALLOWED 3  // the lock hook turned the caller away
+
+// what a lock hook returns for a caller that must stay off the heap
+#define HEAP_LOCK_REFUSED (-1L)
 
 // struct for holding statistics on the state of the heap
 typedef struct heap_stats {
@@ -46,6 +50,46 @@ typedef struct heap_stats {
   int32_t blocksUnused;
 } heap_stats_t;
 
+// small blocks a thread has freed and may take back without locking,
+// one list per class of 16, 32, 64 and 128 bytes; see Heap_SetThreadHooks
+#define HEAP_CACHE_CLASSES 4
+#define HEAP_CACHE_BYTES   256   // most a thread keeps back from the heap
+typedef struct heap_cache {
+  void* head[HEAP_CACHE_CLASSES];
+  int32_t bytes;                 // payload bytes on the lists
+} heap_cache_t;
+
+// who a block belongs to: process id in the high byte, 0 for threads
+// outside any process, and the low 8 bits of the thread id. Process ids
+// wrap around 1 to 254, leaving 0xFF to HEAP_TAG_NONE, so pid 255 tags as
+// 1 and a tag only names a process or thread among the last 254 or 256
+#define HEAP_TAG_PID(pid) ((pid) ? ((uint32_t)(pid) - 1) % 254 + 1 : 0)
+#define HEAP_TAG(pid, thread) ((uint16_t)(HEAP_TAG_PID(pid) << 8 | ((thread) & 0xFF)))
+#define HEAP_TAG_NONE 0xFFFF     // no tag hook, or allocated before the first thread
+
+// one block in a Heap_Map snapshot, the block's own size word:
+// bits 0-1 flags, bits 3-15 payload bytes, bits 16-23 thread, 24-31 pid
+#define HEAP_ENTRY_FREE        1u
+#define HEAP_ENTRY_CACHED      2u  // used, sitting in a thread cache
+#define HEAP_ENTRY_SIZE(e)     ((int32_t)((e) & 0xFFF8))
+#define HEAP_ENTRY_THREAD(e)   (((e) >> 16) & 0xFF)
+#define HEAP_ENTRY_PID(e)      (((e) >> 24) & 0xFF)
+
+// how the heap is split up, filled in by Heap_Analyze
+#define HEAP_HIST_BUCKETS 12     // bucket k: free blocks of 2^(k+3) to 2^(k+4)-1 bytes
+typedef struct heap_frag {
+  int32_t usedBytes;
+  int32_t usedBlocks;
+  int32_t cachedBytes;           // of the used ones, sitting in thread caches
+  int32_t cachedBlocks;
+  int32_t freeBytes;
+  int32_t freeBlocks;
+  int32_t largestFree;           // bytes in the biggest free block
+  int32_t fragmentation;         // 0 to 1000, see Heap_Analyze
+  int32_t headerBytes;           // overhead in front of every block
+  int32_t histogram[HEAP_HIST_BUCKETS];
+} heap_frag_t;
+
 //******** Heap_Init *************** 
 // Initialize the Heap
 // input: none
@@ -60,7 +104,8 @@ int32_t Heap_Init(void);
 // input: 
 //   desiredBytes: desired number of bytes to allocate
 // output: void* pointing to the allocated memory or will return NULL
-//   if there isn't sufficient space to satisfy allocation request
+//   if there isn't sufficient space to satisfy allocation request, or
+//   the lock hook refused the caller
 void* Heap_Malloc(int32_t desiredBytes);
 
 
@@ -82,8 +127,10 @@ void* Heap_Calloc(int32_t desiredBytes);
 //    where the contents of the old block will be copied to
 // output: void* pointing to the new block or will return NULL
 //   if there is any reason the reallocation can't be completed
-// notes: the given block will be unallocated after its contents
-//   are copied to the new block
+// notes: the block is resized in place if it shrinks or the memory
+//   just above it is free, and the same pointer comes back; otherwise
+//   the given block will be unallocated after its contents are copied
+//   to the new block. On failure the given block is left as it was
 void* Heap_Realloc(void* oldBlock, int32_t desiredBytes);
 
 
@@ -94,6 +141,7 @@ void* Heap_Realloc(void* oldBlock, int32_t desiredBytes);
 //  HEAP_ERROR_POINTER_OUT_OF_RANGE if pointer points outside the heap;
 //  HEAP_ERROR_CORRUPTED_HEAP if heap has been corrupted or trying to
 //  unallocate memory that has already been unallocated;
+//  HEAP_ERROR_NOT_ALLOWED if the lock hook refused the caller
 int32_t Heap_Free(void* pointer);
 
 
@@ -111,4 +159,68 @@ int32_t Heap_Test(void);
 heap_stats_t Heap_Stats(void);
 
 
+//******** Heap_SetThreadHooks *************** 
+// Let the heap run under a preemptive kernel
+// input: 
+//   cache: returns the calling thread's cache, or NULL anywhere there
+//     is none; it must return NULL for any caller lock refuses
+//   lock: keeps other threads off the heap, returns what unlock needs,
+//     or HEAP_LOCK_REFUSED for a caller that may not use the heap;
+//     it must not block, Heap_Free is called with interrupts disabled
+//   unlock: undoes lock
+// output: none
+// notes: without hooks there are no caches and no locking. A cache
+//  must only ever be used by one thread, and must be empty when
+//  Heap_Init runs. Cached blocks count as allocated in Heap_Stats.
+//  A refused caller gets NULL or HEAP_ERROR_NOT_ALLOWED from Malloc,
+//  Calloc, Realloc and Free, and nothing is changed; the read only
+//  calls still run, unlocked. The OS refuses ISRs, so with it the heap
+//  is for threads only
+void Heap_SetThreadHooks(heap_cache_t* (*cache)(void), long (*lock)(void), void (*unlock)(long));
+
+
+//******** Heap_CacheFlush *************** 
+// Give every block in a thread cache back to the heap
+// input: pointer to the cache
+// output: none
+// notes: call it for a thread that is going away
+void Heap_CacheFlush(heap_cache_t* cache);
+
+
+//******** Heap_SetTagHook *************** 
+// Say who owns the blocks allocated from now on
+// input: returns the tag of the caller, e.g. HEAP_TAG(pid, thread id)
+// output: none
+// notes: without a hook every block is tagged HEAP_TAG_NONE. Realloc
+//  retags the block for its caller, and so does taking a block into or
+//  out of a thread cache
+void Heap_SetTagHook(uint16_t (*tag)(void));
+
+
+//******** Heap_SetTag *************** 
+// Hand a block over to another owner
+// input: pointer returned by Heap_Malloc, its new tag
+// output: HEAP_OK, or an error as for Heap_Free
+int32_t Heap_SetTag(void* pointer, uint16_t tag);
+
+
+//******** Heap_Analyze *************** 
+// Describe how the heap is split up
+// input: where to put the results
+// output: HEAP_OK, or HEAP_ERROR_CORRUPTED_HEAP if the walk went wrong
+// notes: fragmentation is 1000 - 1000*largest free block/free bytes,
+//  so 0 while all the free space is in one block
+int32_t Heap_Analyze(heap_frag_t* frag);
+
+
+//******** Heap_Map *************** 
+// Take a snapshot of every block, lowest address first
+// input: room for max entries, see HEAP_ENTRY_SIZE and friends
+// output: number of blocks in the heap, which may be more than max;
+//   -1 if the walk went wrong
+// notes: each block starts headerBytes (see Heap_Analyze) after the
+//  end of the one before, the first at the start of the heap
+int32_t Heap_Map(uint32_t* map, int32_t max);
+
+
 #endif //#ifndef HEAP_H
@@ -0,0 +1,260 @@
+// heapbench.c
+// Runs on Linux, not the TM4C123
+// Replays an allocation trace against heap.c and reports how long
+// Heap_Malloc, Heap_Realloc and Heap_Free took and how fragmented the
+// heap got.
+// Build: cc -O2 -o heapbench host/heapbench.c heap.c      (from lab5)
+// Use:   heapbench [trace]
+// A trace is a text file of "a <slot> <bytes>", "r <slot> <bytes>" and
+// "f <slot>" lines, slots 0 to 255. Without one a fixed pseudo random
+// trace is used: a mix of small kernel objects, FIFOs and ELF sized
+// sections, some of which grow a little at a time like a log buffer,
+// which keeps the heap busy enough that some requests fail. Reallocs
+// that kept their pointer are counted as in place.
+// To compare with another allocator behind heap.h, e.g. the first fit
+// heap.c from git history, build the same file against that instead.
+// Fragmentation is 1 - largest block / free space, averaged over the
+// requests that failed and once more at the end.
+// Every block is filled and checked and Heap_Test runs every 1000
+// operations. At the end a lock hook that refuses every caller, as the
+// OS does for ISRs, must make Malloc, Realloc and Free fail and leave
+// the heap as it was. The exit status is 1 if anything came back damaged.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../heap.h"
+
+#define SLOTS 256
+#define OPS   200000
+
+typedef struct op {
+  char kind;          // 'a', 'r' or 'f'
+  uint8_t slot;
+  int32_t bytes;
+} opType;
+
+static opType *Ops;
+static int NumOps;
+static uint8_t *Live[SLOTS];
+static int32_t LiveBytes[SLOTS];
+static uint32_t *MallocNs, *ReallocNs, *FreeNs;
+static int NumMalloc, NumRealloc, NumFree;
+
+static uint32_t Seed = 12345;
+static uint32_t rnd(uint32_t n){
+  Seed = Seed*1664525 + 1013904223;
+  return (Seed >> 8) % n;
+}
+
+static void makeTrace(void){
+  int used[SLOTS] = {0};
+  int32_t bytes[SLOTS];
+  int slot;
+  Ops = malloc(OPS*sizeof(opType));
+  for(NumOps = 0; NumOps < OPS; NumOps++){
+    slot = rnd(64);
+    if(!used[slot]){
+      uint32_t r = rnd(100);
+      Ops[NumOps].kind = 'a';
+      bytes[slot] = r < 60 ? 4 + rnd(60) : r < 90 ? 64 + rnd(448) : 512 + rnd(1536);
+      used[slot] = 1;
+    } else if(slot < 16 && rnd(4) && bytes[slot] < 2048){
+      Ops[NumOps].kind = 'r';    // a buffer that grows, now and then shrinks
+      bytes[slot] += rnd(8) ? (int32_t)(8 + rnd(56)) : -(int32_t)rnd(bytes[slot]/2);
+    } else {
+      Ops[NumOps].kind = 'f';
+      used[slot] = 0;
+    }
+    Ops[NumOps].slot = slot;
+    Ops[NumOps].bytes = bytes[slot];
+  }
+}
+
+static int readTrace(const char *name){
+  FILE *in = fopen(name, "r");
+  char kind;
+  int slot, bytes, max = 1024;
+  if(in == 0)
+    return 0;
+  Ops = malloc(max*sizeof(opType));
+  NumOps = 0;
+  while(fscanf(in, " %c %d", &kind, &slot) == 2){
+    bytes = 0;
+    if((kind == 'a' || kind == 'r') && fscanf(in, "%d", &bytes) != 1)
+      break;
+    if(slot < 0 || slot >= SLOTS || (kind != 'a' && kind != 'r' && kind != 'f'))
+      continue;
+    if(NumOps == max)
+      Ops = realloc(Ops, (max *= 2)*sizeof(opType));
+    Ops[NumOps].kind = kind;
+    Ops[NumOps].slot = slot;
+    Ops[NumOps].bytes = bytes;
+    NumOps++;
+  }
+  fclose(in);
+  return 1;
+}
+
+static int Unlocks;
+static heap_cache_t *noCache(void){ return 0; }
+static long refuse(void){ return HEAP_LOCK_REFUSED; }
+static void unlock(long sr){ (void)sr; Unlocks++; }
+
+// a refused caller must not get or change anything, returns errors found
+static int refused(void){
+  heap_stats_t before = Heap_Stats(), after;
+  uint8_t *p = 0;
+  int slot, bad = 0;
+  for(slot = 0; slot < SLOTS && p == 0; slot++)
+    p = Live[slot];
+  Heap_SetThreadHooks(noCache, refuse, unlock);
+  bad += Heap_Malloc(16) != 0;
+  bad += Heap_Calloc(16) != 0;
+  if(p){
+    bad += Heap_Realloc(p, 4096) != 0;
+    bad += Heap_Free(p) != HEAP_ERROR_NOT_ALLOWED;
+  }
+  bad += Unlocks != 0;
+  Heap_SetThreadHooks(0, 0, 0);
+  after = Heap_Stats();
+  bad += memcmp(&before, &after, sizeof(before)) != 0;
+  if(bad)
+    printf("refused caller got through: %d errors\n", bad);
+  return bad;
+}
+
+static uint64_t nowNs(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+static int cmp(const void *a, const void *b){
+  uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void percentiles(const char *name, uint32_t *ns, int n){
+  if(n == 0){
+    printf("%-7s n=0\n", name);
+    return;
+  }
+  qsort(ns, n, sizeof(uint32_t), cmp);
+  printf("%-7s n=%d p50=%u p99=%u p99.9=%u max=%u ns\n", name, n,
+         ns[n/2], ns[n*99/100], ns[n*999/1000], ns[n-1]);
+}
+
+// biggest block Heap_Malloc will hand out right now
+static int32_t largestFree(void){
+  int32_t lo = 0, hi = HEAP_SIZE_BYTES, mid;
+  void *p;
+  while(lo < hi){
+    mid = (lo + hi + 1)/2;
+    if((p = Heap_Malloc(mid)) != 0){
+      Heap_Free(p);
+      lo = mid;
+    } else {
+      hi = mid - 1;
+    }
+  }
+  return lo;
+}
+
+int main(int argc, char **argv){
+  int i, k, bad = 0, failures = 0, inPlace = 0;
+  int64_t live = 0;
+  double utilAtFail = 0, fragAtFail = 0;
+  uint64_t t0;
+  heap_stats_t stats;
+  int32_t largest;
+  if(argc > 1){
+    if(!readTrace(argv[1])){
+      perror(argv[1]);
+      return 2;
+    }
+  } else {
+    makeTrace();
+  }
+  MallocNs = malloc(NumOps*sizeof(uint32_t));
+  ReallocNs = malloc(NumOps*sizeof(uint32_t));
+  FreeNs = malloc(NumOps*sizeof(uint32_t));
+  Heap_Init();
+  for(i = 0; i < NumOps; i++){
+    opType *op = &Ops[i];
+    if(op->kind == 'a'){
+      uint8_t *p;
+      if(Live[op->slot])
+        continue;                 // the trace reused a live slot
+      t0 = nowNs();
+      p = Heap_Malloc(op->bytes);
+      MallocNs[NumMalloc++] = nowNs() - t0;
+      if(p == 0){
+        failures++;
+        utilAtFail += (double)live/HEAP_SIZE_BYTES;
+        stats = Heap_Stats();
+        if(stats.wordsAvailable)
+          fragAtFail += 1.0 - (double)largestFree()/(stats.wordsAvailable*4);
+        continue;
+      }
+      memset(p, op->slot, op->bytes);
+      Live[op->slot] = p;
+      LiveBytes[op->slot] = op->bytes;
+      live += op->bytes;
+    } else if(op->kind == 'r' && Live[op->slot]){
+      uint8_t *p = Live[op->slot], *q;
+      int32_t keep = LiveBytes[op->slot] < op->bytes ? LiveBytes[op->slot] : op->bytes;
+      if(op->bytes <= 0)
+        continue;
+      t0 = nowNs();
+      q = Heap_Realloc(p, op->bytes);
+      ReallocNs[NumRealloc++] = nowNs() - t0;
+      if(q == 0){
+        failures++;                // the old block is still there
+        continue;
+      }
+      for(k = 0; k < keep; k++)
+        if(q[k] != op->slot)
+          bad++;
+      memset(q, op->slot, op->bytes);
+      inPlace += q == p;
+      Live[op->slot] = q;
+      live += op->bytes - LiveBytes[op->slot];
+      LiveBytes[op->slot] = op->bytes;
+    } else if(op->kind == 'f' && Live[op->slot]){
+      uint8_t *p = Live[op->slot];
+      for(k = 0; k < LiveBytes[op->slot]; k++)
+        if(p[k] != op->slot)
+          bad++;
+      t0 = nowNs();
+      if(Heap_Free(p) != HEAP_OK)
+        bad++;
+      FreeNs[NumFree++] = nowNs() - t0;
+      Live[op->slot] = 0;
+      live -= LiveBytes[op->slot];
+    }
+    if(i%1000 == 0 && Heap_Test() != HEAP_OK)
+      bad++;
+  }
+  percentiles("malloc", MallocNs, NumMalloc);
+  percentiles("realloc", ReallocNs, NumRealloc);
+  percentiles("free", FreeNs, NumFree);
+  stats = Heap_Stats();
+  largest = largestFree();
+  printf("realloc in place=%d of %d\n", inPlace, NumRealloc);
+  printf("failed=%d util_at_fail=%.1f%% frag_at_fail=%.1f%%\n", failures,
+         failures ? 100*utilAtFail/failures : 0.0, failures ? 100*fragAtFail/failures : 0.0);
+  printf("end: live=%lld free=%ld largest=%ld frag=%.1f%% blocks=%ld/%ld\n", (long long)live,
+         (long)stats.wordsAvailable*4, (long)largest,
+         stats.wordsAvailable ? 100.0 - 100.0*largest/(stats.wordsAvailable*4) : 0.0,
+         (long)stats.blocksUsed, (long)stats.blocksUnused);
+  if(Heap_Test() != HEAP_OK)
+    bad++;
+  bad += refused();
+  if(bad)
+    printf("heap damaged: %d errors\n", bad);
+  return bad != 0;
+}
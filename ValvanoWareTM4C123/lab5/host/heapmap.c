@@ -0,0 +1,136 @@
+// heapmap.c
+// Runs on the host PC, not the TM4C123
+// Draws a heap dump (the "heap dump" interpreter command) as a map of
+// the heap, one character per slice of memory, with the free block
+// size histogram, the fragmentation index and the bytes held by each
+// process and thread under it.
+// Build: cc -o heapmap heapmap.c
+// Use:   heapmap capture.bin
+// The capture can hold other UART text, everything before "HEAP" is skipped.
+// A heap with more blocks than the firmware's HEAP_MAP_MAX is sent cut
+// short; the map then ends early and a line says how many were left out.
+// In the map '.' is free space, a letter is a used block and the legend
+// says whose; lower case means the block sits in a thread cache.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// must match heap.h
+#define ENTRY_FREE     1u
+#define ENTRY_CACHED   2u
+#define ENTRY_SIZE(e)  ((e) & 0xFFF8)
+#define TAG_NONE       0xFFFF
+
+#define MAP_CHARS  512   // characters for the whole heap
+#define MAP_WIDTH  64
+#define OWNERS     26
+
+static uint32_t get(FILE *in, int *ok){
+  uint32_t n = 0;
+  int i, c;
+  for(i = 0; i < 4; i++){
+    if((c = getc(in)) == EOF){
+      *ok = 0;
+      return 0;
+    }
+    n |= (uint32_t)c << (8*i);
+  }
+  return n;
+}
+
+// skip to just past the "HEAP" marker
+static int find_marker(FILE *in){
+  const char *marker = "HEAP";
+  int matched = 0, c;
+  while(matched < 4 && (c = getc(in)) != EOF){
+    if(c == marker[matched])
+      matched++;
+    else
+      matched = (c == marker[0]);
+  }
+  return matched == 4;
+}
+
+int main(int argc, char **argv){
+  FILE *in = stdin;
+  uint32_t heapBytes, header, total, count, i, k, e, size, at = 0, slice, freeBytes = 0, largest = 0;
+  uint32_t *entries;
+  uint32_t tag[OWNERS], blocks[OWNERS] = {0}, bytes[OWNERS] = {0}, hist[16] = {0};
+  char map[MAP_CHARS];
+  int owners = 0, o, ok = 1;
+  if(argc > 1 && (in = fopen(argv[1], "rb")) == NULL){
+    perror(argv[1]);
+    return 1;
+  }
+  if(!find_marker(in)){
+    fprintf(stderr, "no heap dump found\n");
+    return 1;
+  }
+  heapBytes = get(in, &ok);
+  header = get(in, &ok);
+  total = get(in, &ok);
+  count = get(in, &ok);
+  if(!ok || heapBytes == 0){
+    fprintf(stderr, "truncated header\n");
+    return 1;
+  }
+  entries = malloc(count*sizeof(uint32_t) + 1);
+  for(i = 0; i < count && ok; i++)
+    entries[i] = get(in, &ok);
+  if(!ok){
+    fprintf(stderr, "dump cut short after %u of %u blocks\n", i - 1, count);
+    count = i - 1;
+  }
+  slice = (heapBytes + MAP_CHARS - 1)/MAP_CHARS;
+  for(k = 0; k < MAP_CHARS; k++)
+    map[k] = ' ';                   // past the last block shown
+  for(i = 0; i < count; i++){
+    char c = '.';
+    e = entries[i];
+    size = ENTRY_SIZE(e);
+    if(e & ENTRY_FREE){
+      freeBytes += size;
+      if(size > largest)
+        largest = size;
+      for(k = 0; size >> (k + 4); k++)
+        ;
+      hist[k < 15 ? k : 15]++;
+    } else {
+      for(o = 0; o < owners && tag[o] != e >> 16; o++)
+        ;
+      if(o == owners && owners < OWNERS)
+        tag[owners++] = e >> 16;
+      if(o == OWNERS)
+        o = OWNERS - 1;
+      blocks[o]++;
+      bytes[o] += size;
+      c = (e & ENTRY_CACHED ? 'a' : 'A') + o;
+    }
+    for(k = at/slice; k <= (at + header + size - 1)/slice && k < MAP_CHARS; k++){
+      if(map[k] == ' ' || map[k] == '.')
+        map[k] = c;                   // a used block wins a shared slice
+    }
+    at += header + size;
+  }
+  printf("%u bytes, %u blocks, %u bytes per character\n", heapBytes, total, slice);
+  if(count < total)
+    printf("only the first %u blocks were sent, the map and totals stop there\n", count);
+  for(k = 0; k < MAP_CHARS && k*slice < heapBytes; k += MAP_WIDTH)
+    printf("%5u %.*s\n", k*slice, MAP_WIDTH, &map[k]);
+  printf("free %u, largest free %u, fragmentation %.1f%%\n", freeBytes, largest,
+    freeBytes ? 100.0 - 100.0*largest/freeBytes : 0.0);
+  printf("free blocks, from bytes:count");
+  for(k = 0; k < 16; k++){
+    if(hist[k])
+      printf(" %u:%u", 8u << k, hist[k]);
+  }
+  printf("\n   pid  id blocks  bytes\n");
+  for(o = 0; o < owners; o++){
+    if(tag[o] == TAG_NONE)
+      printf("%c    -   - %6u %6u\n", 'A' + o, blocks[o], bytes[o]);
+    else
+      printf("%c %4u %3u %6u %6u\n", 'A' + o, tag[o] >> 8, tag[o] & 0xFF, blocks[o], bytes[o]);
+  }
+  return 0;
+}
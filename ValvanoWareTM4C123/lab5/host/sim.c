@@ -0,0 +1,412 @@
+// sim.c
+// Runs on Linux, not the TM4C123
+// Host side of the lab5 kernel simulation, see sim.h.
+//
+// Peripherals: each emulated timer remembers the host time t0 at which
+// its counter held v0 and works out TAV from the clock whenever any
+// register is touched. Kernel writes are spotted on the next access by
+// comparing the shadows with what the emulation last left there. A POSIX
+// timer is kept armed for the earliest timeout, and at most SIM_POLL
+// counts away so a late write is never missed for long.
+//
+// Interrupts: PRIMASK is a flag, not a signal mask. The SIGALRM handler
+// runs the emulated handlers itself if interrupts are enabled, otherwise
+// it leaves Deferred set for EnableInterrupts or EndCriticalAsm to pick
+// up. Handlers do not nest. TIMER4A goes first, then TIMER3A, then the
+// SysTick or PendSV context switch, which calls Scheduler and swaps to
+// RunPt's ucontext. A thread switched out inside the signal handler
+// finishes it when it is switched back in.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+
+#include "sim.h"
+#include "../OS.h"
+
+#define SIM_REGS        64        // shadow registers, must be a power of 2
+#define SIM_STACK       (64*1024) // host stack per thread, in bytes
+#define SIM_POLL        80000     // longest time between syncs, 1 ms
+
+extern tcbType tcbs[];
+extern tcbType *RunPt;
+void Scheduler(void);
+void Timer3A_Handler(void);
+void Timer4A_Handler(void);
+
+typedef struct simReg {
+  uint32_t addr;
+  volatile uint32_t val;
+} simRegType;
+static simRegType Regs[SIM_REGS];
+
+// one general purpose timer, A half in 32-bit mode
+typedef struct simTimer {
+  volatile uint32_t *ctl, *tamr, *imr, *ris, *icr, *tailr, *tav, *en;
+  uint32_t enBit;           // its bit in the NVIC enable register
+  uint32_t lastTav;         // TAV as the emulation left it
+  uint32_t lastTailr;
+  int running;
+  uint64_t t0;              // host count when the counter held v0
+  uint32_t v0;
+} simTimerType;
+static simTimerType Timer3, Timer4;
+
+static volatile uint32_t *StCtrl, *StReload, *StCurrent, *IntCtrl, *CycCnt;
+static uint32_t LastStCurrent, LastCycCnt;
+static int StRunning;
+static uint64_t StT0, CycBase;
+static uint32_t StV0;
+
+static volatile int Primask = 0;       // 1 while interrupts are disabled
+static volatile int InHandler = 0;     // 1 while emulated handlers run
+static volatile int Busy = 0;          // 1 while the shadows are updated
+static volatile int Deferred = 0;      // a SIGALRM found one of the above set
+static volatile int PendSVPending = 0;
+static volatile int SysTickPending = 0;
+
+static timer_t Alarm;
+static uint64_t ArmedAt = 0;           // host count the alarm is set for, 0 if none
+static simStatsType Stats;
+
+static ucontext_t Ctx[MAXTHREADS+1];  // one more for the kernel's Park
+static char *Stacks[MAXTHREADS+1];
+static void (*Tasks[MAXTHREADS+1])(void);
+
+static void Dispatch(void);
+
+// host monotonic time in 12.5ns counts
+static uint64_t Now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec)*2/25;
+}
+
+static volatile uint32_t *Shadow(uint32_t addr){
+  uint32_t i = ((addr>>2)*2654435761u) & (SIM_REGS-1);
+  while(Regs[i].addr != addr){
+    if(Regs[i].addr == 0){
+      Regs[i].addr = addr;
+      break;
+    }
+    i = (i+1) & (SIM_REGS-1);
+  }
+  return &Regs[i].val;
+}
+
+static void TimerInit(simTimerType *t, uint32_t base, uint32_t en, uint32_t bit){
+  t->ctl = Shadow(base + 0x00C);
+  t->tamr = Shadow(base + 0x004);
+  t->imr = Shadow(base + 0x018);
+  t->ris = Shadow(base + 0x01C);
+  t->icr = Shadow(base + 0x024);
+  t->tailr = Shadow(base + 0x028);
+  t->tav = Shadow(base + 0x050);
+  t->en = Shadow(en);
+  t->enBit = bit;
+}
+
+// bring one timer up to host time now
+static void TimerSync(simTimerType *t, uint64_t now){
+  uint64_t elapsed;
+  if(*t->icr){
+    *t->ris &= ~*t->icr;
+    *t->icr = 0;
+  }
+  if(!t->running){
+    if(*t->tailr != t->lastTailr)
+      *t->tav = *t->tailr;        // a stopped timer loads a new interval
+    if(*t->ctl & 1){
+      t->running = 1;
+      t->v0 = *t->tav;
+      t->t0 = now;
+    }
+  } else {
+    if(*t->tav != t->lastTav){    // the kernel moved the counter
+      t->v0 = *t->tav;
+      t->t0 = now;
+    }
+    elapsed = now - t->t0;
+    if(elapsed <= t->v0){
+      *t->tav = t->v0 - (uint32_t)elapsed;
+    } else {
+      *t->ris |= TIMER_RIS_TATORIS;
+      if((*t->tamr & 3) == 1){    // one-shot stops at zero
+        *t->ctl &= ~1;
+        *t->tav = *t->tailr;
+      } else {
+        *t->tav = *t->tailr - (uint32_t)((elapsed - t->v0 - 1) % ((uint64_t)*t->tailr + 1));
+      }
+    }
+    t->v0 = *t->tav;
+    t->t0 = now;
+    if(!(*t->ctl & 1))
+      t->running = 0;
+  }
+  t->lastTav = *t->tav;
+  t->lastTailr = *t->tailr;
+}
+
+static int TimerPending(simTimerType *t){
+  return (*t->ris & *t->imr & 1) && (*t->en & t->enBit);
+}
+
+static void SysTickSync(uint64_t now){
+  uint64_t elapsed;
+  uint32_t reload = *StReload & 0x00FFFFFF;
+  if(!StRunning){
+    if(*StCtrl & 1){
+      StRunning = 1;
+      StV0 = reload;
+      StT0 = now;
+    }
+  } else if(!(*StCtrl & 1)){
+    StRunning = 0;
+  } else {
+    if(*StCurrent != LastStCurrent){  // any write clears it
+      StV0 = reload;
+      StT0 = now;
+    }
+    elapsed = now - StT0;
+    if(elapsed <= StV0){
+      *StCurrent = StV0 - (uint32_t)elapsed;
+    } else {
+      *StCtrl |= 0x00010000;          // COUNTFLAG
+      if(*StCtrl & 2)
+        SysTickPending = 1;
+      *StCurrent = reload - (uint32_t)((elapsed - StV0 - 1) % ((uint64_t)reload + 1));
+    }
+    StV0 = *StCurrent;
+    StT0 = now;
+  }
+  LastStCurrent = *StCurrent;
+}
+
+static void ArmAlarm(uint64_t at){
+  struct itimerspec its;
+  uint64_t ns = at*25/2 + 1;
+  memset(&its, 0, sizeof(its));
+  its.it_value.tv_sec = ns/1000000000u;
+  its.it_value.tv_nsec = ns%1000000000u;
+  ArmedAt = at;
+  timer_settime(Alarm, TIMER_ABSTIME, &its, 0);
+}
+
+// update every emulated peripheral and keep the alarm set for the next timeout
+static void Sync(void){
+  uint64_t now = Now();
+  uint64_t next = now + SIM_POLL;
+  if(*CycCnt != LastCycCnt)
+    CycBase = now - *CycCnt;          // the kernel wrote the cycle counter
+  *CycCnt = (uint32_t)(now - CycBase);
+  LastCycCnt = *CycCnt;
+  if(*IntCtrl & 0x10000000)
+    PendSVPending = 1;
+  if(*IntCtrl & 0x04000000)
+    SysTickPending = 1;
+  *IntCtrl = 0;
+  SysTickSync(now);
+  TimerSync(&Timer3, now);
+  TimerSync(&Timer4, now);
+  if(StRunning && (*StCtrl & 2) && StT0 + StV0 + 1 < next)
+    next = StT0 + StV0 + 1;
+  if(Timer3.running && (*Timer3.imr & 1) && Timer3.t0 + Timer3.v0 + 1 < next)
+    next = Timer3.t0 + Timer3.v0 + 1;
+  if(Timer4.running && (*Timer4.imr & 1) && Timer4.t0 + Timer4.v0 + 1 < next)
+    next = Timer4.t0 + Timer4.v0 + 1;
+  if(ArmedAt <= now || next < ArmedAt)
+    ArmAlarm(next);
+}
+
+// take anything that came up while we could not, from thread level
+static void Resume(void){
+  if(!Primask && !InHandler && !Busy &&
+     (Deferred || PendSVPending || SysTickPending))
+    Dispatch();
+}
+
+volatile uint32_t *Sim_Reg(uint32_t addr){
+  volatile uint32_t *reg;
+  int busy = Busy;
+  Busy = 1;
+  Sync();
+  reg = Shadow(addr);
+  Busy = busy;
+  Resume();
+  return reg;
+}
+
+static void Switch(void){
+  tcbType *old = RunPt;
+  Scheduler();
+  if(RunPt != old){
+    Stats.switches++;
+    swapcontext(&Ctx[old - tcbs], &Ctx[RunPt - tcbs]);
+  }
+}
+
+// run the emulated handlers until nothing is pending
+// a thread switched out here carries on with the loop when it is back
+static void Dispatch(void){
+  InHandler = 1;
+  for(;;){
+    Deferred = 0;
+    Busy = 1;
+    Sync();
+    Busy = 0;
+    if(TimerPending(&Timer4)){
+      Stats.isrs++;
+      Timer4A_Handler();
+    } else if(TimerPending(&Timer3)){
+      Stats.isrs++;
+      Timer3A_Handler();
+    } else if(PendSVPending || SysTickPending){
+      PendSVPending = 0;
+      SysTickPending = 0;
+      Switch();
+    } else if(!Deferred){
+      break;
+    }
+  }
+  InHandler = 0;
+}
+
+static void AlarmHandler(int sig){
+  int err = errno;
+  (void)sig;
+  Stats.alarms++;
+  ArmedAt = 0;
+  if(Primask || InHandler || Busy){
+    Stats.deferred++;
+    Deferred = 1;
+  } else {
+    Dispatch();
+  }
+  errno = err;
+}
+
+static void ThreadEntry(int slot){
+  InHandler = 0;                // whoever switched here was in Dispatch
+  Primask = 0;
+  Resume();
+  Tasks[slot]();
+  OS_Kill();
+}
+
+void Sim_InitContext(int slot, void(*task)(void)){
+  if(slot < 0 || slot > MAXTHREADS){
+    fprintf(stderr, "sim: TCB slot %d, raise MAXTHREADS in sim.h\n", slot);
+    exit(2);
+  }
+  if(Stacks[slot] == 0 && (Stacks[slot] = malloc(SIM_STACK)) == 0){
+    fprintf(stderr, "sim: out of memory for thread stacks\n");
+    exit(2);
+  }
+  Tasks[slot] = task;
+  getcontext(&Ctx[slot]);
+  Ctx[slot].uc_stack.ss_sp = Stacks[slot];
+  Ctx[slot].uc_stack.ss_size = SIM_STACK;
+  Ctx[slot].uc_link = 0;
+  sigemptyset(&Ctx[slot].uc_sigmask);
+  makecontext(&Ctx[slot], (void(*)(void))ThreadEntry, 1, slot);
+}
+
+void Sim_PendSV(void){
+  PendSVPending = 1;
+  Resume();
+}
+
+void Sim_Init(void){
+  struct sigaction sa;
+  struct sigevent sev;
+  StCtrl = Shadow(0xE000E010);
+  StReload = Shadow(0xE000E014);
+  StCurrent = Shadow(0xE000E018);
+  IntCtrl = Shadow(0xE000ED04);
+  CycCnt = Shadow(0xE0001004);
+  TimerInit(&Timer3, 0x40033000, 0xE000E104, 1u<<(35-32));
+  TimerInit(&Timer4, 0x40034000, 0xE000E108, 1u<<(70-64));
+  CycBase = Now();
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = AlarmHandler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGALRM, &sa, 0);
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_SIGNAL;
+  sev.sigev_signo = SIGALRM;
+  if(timer_create(CLOCK_MONOTONIC, &sev, &Alarm)){
+    perror("sim: timer_create");
+    exit(2);
+  }
+}
+
+void Sim_Stats(simStatsType *stats){
+  *stats = Stats;
+}
+
+/* osasm.s and startup.s */
+void DisableInterrupts(void){
+  Primask = 1;
+}
+
+void EnableInterrupts(void){
+  Primask = 0;
+  Resume();
+}
+
+long StartCriticalAsm(void){
+  long sr = Primask;
+  Primask = 1;
+  return sr;
+}
+
+void EndCriticalAsm(long sr){
+  Primask = sr;
+  Resume();
+}
+
+// no priorities here, so the scheduler lock masks everything
+long SchedLockAsm(void){
+  return StartCriticalAsm();
+}
+
+void SchedUnlockAsm(long basepri){
+  EndCriticalAsm(basepri);
+}
+
+void StartOS(void){
+  InHandler = 1;                // ThreadEntry turns interrupts on
+  Busy = 1;
+  Sync();
+  Busy = 0;
+  setcontext(&Ctx[RunPt - tcbs]);
+}
+
+void JumpAsm(void (*entry)(void), uint32_t *text, uint32_t *data){
+  (void)entry; (void)text; (void)data;
+  fprintf(stderr, "sim: processes can not be run on the host\n");
+  exit(2);
+}
+
+/* PLL.c and UART.c */
+void PLL_Init(uint32_t freq){
+  (void)freq;
+}
+
+void UART_Init(void){
+}
+
+void UART_OutChar(char data){
+  putchar(data);
+}
+
+void UART_OutString(char *pt){
+  fputs(pt, stdout);
+}
@@ -0,0 +1,119 @@
+// sim.h
+// Runs on Linux, not the TM4C123
+// Host simulation port of the lab5 kernel. os.c, heap.c, pool.c and
+// jitter.c are built unchanged apart from their #ifdef SIM include
+// blocks: every register they touch turns into a call to Sim_Reg, which
+// hands back a shadow word for that address. SysTick, TIMER3, TIMER4 and
+// the DWT cycle counter are emulated on CLOCK_MONOTONIC, one count per
+// 12.5 ns as on an 80 MHz part, and a POSIX timer raises their
+// interrupts. Threads are ucontexts, see sim.c for how interrupts and
+// PendSV are delivered.
+// Build: see simbench.c
+
+#ifndef SIM_H
+#define SIM_H
+#include <stdint.h>
+
+// kernel limits, raised so the thread count sweeps in bench.c can run;
+// each host thread runs on its own stack, the arena only holds the paint
+#define MAXTHREADS        260
+#define STACK_ARENA_WORDS (MAXTHREADS*64)
+
+// ARMCC intrinsics and keywords used by the kernel
+#define __align(n) __attribute__((aligned(n)))
+#define __clz(x) ((uint32_t)(x) ? __builtin_clz(x) : 32)
+
+// returns the shadow of the register at addr, after bringing the
+// emulated peripherals up to date
+volatile uint32_t *Sim_Reg(uint32_t addr);
+#define SIM_REG(addr) (*Sim_Reg(addr))
+
+// ask for a context switch, like setting PENDSVSET
+// it is taken at once if interrupts are enabled
+void Sim_PendSV(void);
+
+// ******** Sim_InitContext ************
+// give TCB slot a fresh host context that starts in task
+// called by SetInitialStack in place of building the ARM frame,
+// a task that returns is killed
+void Sim_InitContext(int slot, void(*task)(void));
+
+// ******** Sim_Init ************
+// set up the emulated peripherals, call before OS_Init
+void Sim_Init(void);
+
+// ******** Sim_Stats ************
+// interrupts and context switches delivered since Sim_Init
+typedef struct simStats {
+  unsigned long alarms;       // host timer signals taken
+  unsigned long deferred;     // signals that arrived with interrupts masked
+  unsigned long isrs;         // TIMER3A and TIMER4A handler calls
+  unsigned long switches;     // ucontext switches
+} simStatsType;
+void Sim_Stats(simStatsType *stats);
+
+// the registers the kernel uses, at their TM4C123 addresses
+#define SYSCTL_RCGCGPIO_R       SIM_REG(0x400FE608)
+#define SYSCTL_RCGCTIMER_R      SIM_REG(0x400FE604)
+
+#define GPIO_PORTB_DIR_R        SIM_REG(0x40005400)
+#define GPIO_PORTB_AFSEL_R      SIM_REG(0x40005420)
+#define GPIO_PORTB_DEN_R        SIM_REG(0x4000551C)
+#define GPIO_PORTB_AMSEL_R      SIM_REG(0x40005528)
+#define GPIO_PORTB_PCTL_R       SIM_REG(0x4000552C)
+#define GPIO_PORTF_DIR_R        SIM_REG(0x40025400)
+#define GPIO_PORTF_IS_R         SIM_REG(0x40025404)
+#define GPIO_PORTF_IBE_R        SIM_REG(0x40025408)
+#define GPIO_PORTF_IEV_R        SIM_REG(0x4002540C)
+#define GPIO_PORTF_IM_R         SIM_REG(0x40025410)
+#define GPIO_PORTF_MIS_R        SIM_REG(0x40025418)
+#define GPIO_PORTF_ICR_R        SIM_REG(0x4002541C)
+#define GPIO_PORTF_AFSEL_R      SIM_REG(0x40025420)
+#define GPIO_PORTF_PUR_R        SIM_REG(0x40025510)
+#define GPIO_PORTF_DEN_R        SIM_REG(0x4002551C)
+#define GPIO_PORTF_LOCK_R       SIM_REG(0x40025520)
+#define GPIO_PORTF_CR_R         SIM_REG(0x40025524)
+#define GPIO_PORTF_AMSEL_R      SIM_REG(0x40025528)
+#define GPIO_PORTF_PCTL_R       SIM_REG(0x4002552C)
+#define PF1                     SIM_REG(0x40025008)
+#define PF2                     SIM_REG(0x40025010)
+#define PF3                     SIM_REG(0x40025020)
+#define LEDS                    SIM_REG(0x40025038)
+
+#define TIMER3_CFG_R            SIM_REG(0x40033000)
+#define TIMER3_TAMR_R           SIM_REG(0x40033004)
+#define TIMER3_CTL_R            SIM_REG(0x4003300C)
+#define TIMER3_IMR_R            SIM_REG(0x40033018)
+#define TIMER3_RIS_R            SIM_REG(0x4003301C)
+#define TIMER3_ICR_R            SIM_REG(0x40033024)
+#define TIMER3_TAILR_R          SIM_REG(0x40033028)
+#define TIMER3_TAPR_R           SIM_REG(0x40033038)
+#define TIMER3_TAV_R            SIM_REG(0x40033050)
+#define TIMER4_CFG_R            SIM_REG(0x40034000)
+#define TIMER4_TAMR_R           SIM_REG(0x40034004)
+#define TIMER4_CTL_R            SIM_REG(0x4003400C)
+#define TIMER4_IMR_R            SIM_REG(0x40034018)
+#define TIMER4_RIS_R            SIM_REG(0x4003401C)
+#define TIMER4_ICR_R            SIM_REG(0x40034024)
+#define TIMER4_TAILR_R          SIM_REG(0x40034028)
+#define TIMER4_TAPR_R           SIM_REG(0x40034038)
+#define TIMER4_TAV_R            SIM_REG(0x40034050)
+#define TIMER_RIS_TATORIS       0x00000001
+#define TIMER_ICR_TATOCINT      0x00000001
+
+#define NVIC_ST_CTRL_R          SIM_REG(0xE000E010)
+#define NVIC_ST_RELOAD_R        SIM_REG(0xE000E014)
+#define NVIC_ST_CURRENT_R       SIM_REG(0xE000E018)
+#define NVIC_EN0_R              SIM_REG(0xE000E100)
+#define NVIC_EN1_R              SIM_REG(0xE000E104)
+#define NVIC_EN2_R              SIM_REG(0xE000E108)
+#define NVIC_PRI7_R             SIM_REG(0xE000E41C)
+#define NVIC_PRI8_R             SIM_REG(0xE000E420)
+#define NVIC_PRI17_R            SIM_REG(0xE000E444)
+#define NVIC_INT_CTRL_R         SIM_REG(0xE000ED04)
+#define NVIC_SYS_PRI3_R         SIM_REG(0xE000ED20)
+#define NVIC_DBG_INT_R          SIM_REG(0xE000EDFC)
+#define DWT_CTRL_R              SIM_REG(0xE0001000)
+#define DWT_CYCCNT_R            SIM_REG(0xE0001004)
+
+#endif
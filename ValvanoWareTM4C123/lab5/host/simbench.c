@@ -0,0 +1,169 @@
+// simbench.c
+// Runs on Linux, not the TM4C123
+// Runs the kernel benchmarks in bench.c on the host simulation of the
+// lab5 kernel: the real os.c, heap.c, pool.c and jitter.c on top of sim.c.
+// Build: cc -DSIM -O2 -o simbench host/simbench.c host/sim.c bench.c os.c heap.c pool.c jitter.c -lrt
+//        (from the lab5 directory)
+// Use:   simbench [iterations]
+// Prints the same BENCH lines as TestmainBench does over the UART, with
+// cycles meaning 12.5 ns of host time. Then it checks the kernel clocks
+// against host time across tickless idle periods of 1 to 40 ms and one
+// longer than TICKLESS_MAX_MS, with the DWT cycle counter wrapping part
+// way through, and times one sleep that starts while a TIMER4 timeout is
+// waiting for its handler. It prints
+//   SIM tickless_time64 n=<sleeps> avg=<cycles> min=<cycles> max=<cycles>
+//   SIM tickless_ms n=<sleeps> avg=<ms> min=<ms> max=<ms>
+//   SIM tickless_pending ms=<asked> slept=<ms>
+//   SIM tickless end avoided=<ticks> failed=<count>
+// where each figure is how far OS_Time64, or OS_MsTime, has moved from
+// host time since the start. Last it parks Idle and kills a thread while
+// nothing else is ready, and prints
+//   SIM park undead=<0 or 1> held=<dead threads still holding a stack>
+// both of which should be 0. Exits with the number of failed benchmarks
+// and checks, so a CI job can run it as is and keep the output to
+// compare against.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "sim.h"
+#include "../bench.h"
+#include "../heap.h"
+#include "../OS.h"
+
+static unsigned long N = 10000;
+static volatile int IdleOff, Undead;
+static Sema4Type IdleGate;
+
+extern tcbType tcbs[];
+
+#define TICKLESS_SLEEPS 60
+#define TIME64_SLACK    80        // 1 us on top of the read skew
+#define PENDING_SLEEP   50        // ms, much less than the TIMER4 period it starts in
+
+// host monotonic time in OS_Time units
+static uint64_t hostTime(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec)*2/25;
+}
+
+// sleep with nothing else to run, so TIMER4 is stretched to the deadline,
+// and after each wake up compare the kernel clocks with host time
+static int ticklessCheck(void){
+  uint64_t host0, time0, h1, h2, t;
+  unsigned long ms0, ms, avoided = OS_TicksAvoided();
+  long err, slack, min64 = 0, max64 = 0, minMs = 0, maxMs = 0;
+  int64_t sum64 = 0, sumMs = 0;
+  int i, failed = 0;
+  long sr;
+  //a second short of the cycle counter wrapping, so OS_Time64 has to
+  //carry into its high word part way through
+  DWT_CYCCNT_R = 0u - 1000u*TIME_1MS;
+  OS_Sleep(1);
+  host0 = hostTime();
+  time0 = OS_Time64();
+  ms0 = OS_MsTime();
+  for(i = 0; i <= TICKLESS_SLEEPS; i++){
+    OS_Sleep(i < TICKLESS_SLEEPS ? 1 + (i*7)%40 : 1500);
+    h1 = hostTime();
+    t = OS_Time64();
+    ms = OS_MsTime();
+    h2 = hostTime();
+    //the kernel read falls between h1 and h2
+    err = (long)((int64_t)(t - time0) - (int64_t)((h1 + h2)/2 - host0));
+    slack = (long)(h2 - h1)/2 + TIME64_SLACK;
+    if(err > slack || err < -slack)
+      failed++;
+    if(err < min64) min64 = err;
+    if(err > max64) max64 = err;
+    sum64 += err;
+    //OS_MsTime counts whole ms, it may trail by one
+    err = (long)(ms - ms0) - (long)((h2 - host0)/TIME_1MS);
+    if(err > 1 || err < -1)
+      failed++;
+    if(err < minMs) minMs = err;
+    if(err > maxMs) maxMs = err;
+    sumMs += err;
+  }
+  //go to sleep after TIMER4 has run out, before Timer4A_Handler takes
+  //that period off the sleep list, which happens once OS_Sleep turns
+  //interrupts back on
+  sr = StartCritical();
+  while(!(TIMER4_RIS_R & TIMER_RIS_TATORIS)){;}
+  h1 = hostTime();
+  OS_Sleep(PENDING_SLEEP);
+  EndCritical(sr);
+  err = (long)((hostTime() - h1)/TIME_1MS);
+  if(err < PENDING_SLEEP - 1 || err > PENDING_SLEEP + 1)
+    failed++;
+  avoided = OS_TicksAvoided() - avoided;
+  #if TICKLESS
+  if(avoided == 0)
+    failed++;
+  #endif
+  printf("SIM tickless_time64 n=%d avg=%ld min=%ld max=%ld\n", i,
+         (long)(sum64/i), min64, max64);
+  printf("SIM tickless_ms n=%d avg=%ld min=%ld max=%ld\n", i,
+         (long)(sumMs/i), minMs, maxMs);
+  printf("SIM tickless_pending ms=%d slept=%ld\n", PENDING_SLEEP, err);
+  printf("SIM tickless end avoided=%lu failed=%d\n", avoided, failed);
+  return failed != 0;
+}
+
+// must not run again after OS_Kill, even with nothing else to switch to
+static void Dier(void){
+  OS_Kill();
+  Undead = 1;
+  while(1){;}
+}
+
+// with Idle parked on IdleGate and the caller asleep, the Scheduler has
+// no thread to switch to when Dier dies
+static int parkCheck(void){
+  int k, held = 0;
+  OS_InitSemaphore(&IdleGate, -1);
+  IdleOff = 1;
+  OS_Sleep(2);                      // Idle blocks on IdleGate
+  OS_AddThread(Dier, 512, 30);
+  OS_Sleep(5);
+  for(k = 0; k < OS_MaxThreads(); k++)
+    held += !tcbs[k].active && tcbs[k].stack != 0;
+  IdleOff = 0;
+  OS_Signal(&IdleGate);
+  printf("SIM park undead=%d held=%d\n", Undead, held);
+  return Undead || held;
+}
+
+static void Controller(void){
+  simStatsType sim;
+  int failed = Bench_Run(N);
+  failed += ticklessCheck();
+  failed += parkCheck();
+  Sim_Stats(&sim);
+  fprintf(stderr, "sim: %lu alarms, %lu deferred, %lu handler calls, %lu switches\n",
+          sim.alarms, sim.deferred, sim.isrs, sim.switches);
+  fflush(stdout);
+  exit(failed);
+}
+
+static void Idle(void){
+  while(1){
+    if(IdleOff)
+      OS_Wait(&IdleGate);
+  }
+}
+
+int main(int argc, char **argv){
+  if(argc > 1)
+    N = strtoul(argv[1], 0, 0);
+  Sim_Init();
+  OS_Init();
+  Heap_Init();
+  OS_AddThread(Controller, 512, BENCH_PRI);
+  OS_AddThread(Idle, 512, 31);
+  OS_Launch(TIME_2MS);
+  return 0;
+}
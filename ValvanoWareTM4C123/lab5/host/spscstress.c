@@ -0,0 +1,149 @@
+// spscstress.c
+// Runs on Linux, not the TM4C123
+// Stress test for the lock-free AddSPSCFifo in FIFO.h: a producer and a
+// consumer thread stream sequence numbers through a small FIFO so it
+// wraps, fills and empties constantly, and the consumer checks every
+// element arrives once and in order.
+// Build: cc -O2 -pthread -o spscstress host/spscstress.c      (from lab5)
+// Use:   spscstress [elements]
+// Two FIFOs are run one after the other, one through Put/Get and one
+// through the zero copy Reserve/Commit and Peek/Release, taking and
+// giving back random sized parts of each span. On a multicore host the
+// two threads really run at once, so a missing barrier or an index
+// published before its data shows up as a sequence error; on a single
+// core they only meet at the yields, which still checks the index and
+// wrap arithmetic but not the ordering.
+// The exit status is 1 if any element was lost, repeated or reordered.
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+
+#include "../FIFO.h"
+
+#define SIZE 64                       // small, so the indexes wrap often
+
+AddSPSCFifo(One, SIZE, uint32_t, 1, 0)
+AddSPSCFifo(Span, SIZE, uint32_t, 1, 0)
+
+static uint32_t Elements = 20000000;
+static uint32_t Errors;
+static uint32_t FirstBad, Expected;   // the first bad element
+
+// xorshift, one state per thread
+static uint32_t rnd(uint32_t *s){
+  *s ^= *s << 13;
+  *s ^= *s >> 17;
+  *s ^= *s << 5;
+  return *s;
+}
+
+static void got(uint32_t value, uint32_t expected){
+  if(value != expected && Errors++ == 0){
+    FirstBad = value;
+    Expected = expected;
+  }
+}
+
+static void *OnePut(void *arg){
+  uint32_t seq = 0;
+  (void)arg;
+  while(seq < Elements){
+    if(OneFifo_Put(seq))
+      seq++;
+    else
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void *OneGet(void *arg){
+  uint32_t seq = 0, value;
+  (void)arg;
+  while(seq < Elements){
+    if(OneFifo_Get(&value))
+      got(value, seq++);
+    else
+      sched_yield();
+  }
+  return NULL;
+}
+
+static void *SpanPut(void *arg){
+  uint32_t seq = 0, s = 1, room, n, i;
+  uint32_t *span;
+  (void)arg;
+  while(seq < Elements){
+    room = SpanFifo_Reserve(&span);
+    if(room == 0){
+      sched_yield();
+      continue;
+    }
+    n = 1 + rnd(&s) % room;
+    if(n > Elements - seq)
+      n = Elements - seq;
+    for(i = 0; i < n; i++)
+      span[i] = seq++;
+    SpanFifo_Commit(n);
+  }
+  return NULL;
+}
+
+static void *SpanGet(void *arg){
+  uint32_t seq = 0, s = 2, count, n, i;
+  uint32_t *span;
+  (void)arg;
+  while(seq < Elements){
+    count = SpanFifo_Peek(&span);
+    if(count == 0){
+      sched_yield();
+      continue;
+    }
+    n = 1 + rnd(&s) % count;
+    for(i = 0; i < n; i++)
+      got(span[i], seq++);
+    SpanFifo_Release(n);
+  }
+  return NULL;
+}
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+// run one producer and consumer pair to the end, returns 1 if it failed
+static int run(const char *name, void *(*put)(void *), void *(*get)(void *)){
+  pthread_t producer, consumer;
+  double start = now(), secs;
+  Errors = 0;
+  pthread_create(&producer, NULL, put, NULL);
+  pthread_create(&consumer, NULL, get, NULL);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  secs = now() - start;
+  printf("%-8s n=%u errors=%u %.1f M/s\n", name, Elements, Errors,
+    Elements/secs/1e6);
+  if(Errors)
+    printf("  first bad element %u, expected %u\n", FirstBad, Expected);
+  return Errors != 0;
+}
+
+int main(int argc, char **argv){
+  int failed = 0;
+  if(argc > 1)
+    Elements = strtoul(argv[1], NULL, 0);
+  OneFifo_Init();
+  SpanFifo_Init();
+  failed += run("put/get", OnePut, OneGet);
+  failed += run("span", SpanPut, SpanGet);
+  if(OneFifo_Size() || SpanFifo_Size()){
+    printf("left over: %u %u\n", OneFifo_Size(), SpanFifo_Size());
+    failed++;
+  }
+  return failed != 0;
+}
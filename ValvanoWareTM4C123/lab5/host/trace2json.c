@@ -0,0 +1,142 @@
+// trace2json.c
+// Runs on the host PC, not the TM4C123
+// Turns a kernel trace dump (the "trace" interpreter command, OS_TraceDump)
+// into Chrome trace JSON, which chrome://tracing or ui.perfetto.dev draw
+// as a timeline: one row per thread, one per interrupt and one per
+// periodic task.
+// Build: cc -o trace2json trace2json.c
+// Use:   trace2json capture.bin > trace.json
+// The capture can hold other UART text, everything before "TRCE" is skipped.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// must match enum traceEvent in OS.h
+enum {
+  TRACE_SWITCH, TRACE_BLOCK, TRACE_UNBLOCK, TRACE_ISR_ENTER, TRACE_ISR_EXIT,
+  TRACE_PERIODIC_START, TRACE_PERIODIC_STOP
+};
+
+// Chrome trace process ids for the three kinds of row
+#define PID_THREADS  0
+#define PID_ISRS     1
+#define PID_PERIODIC 2
+
+static uint32_t get(FILE *in, int bytes, int *ok){
+  uint32_t n = 0;
+  int i, c;
+  for(i = 0; i < bytes; i++){
+    if((c = getc(in)) == EOF){
+      *ok = 0;
+      return 0;
+    }
+    n |= (uint32_t)c << (8*i);
+  }
+  return n;
+}
+
+// skip to just past the "TRCE" marker
+static int find_marker(FILE *in){
+  const char *marker = "TRCE";
+  int matched = 0, c;
+  while(matched < 4 && (c = getc(in)) != EOF){
+    if(c == marker[matched])
+      matched++;
+    else
+      matched = (c == marker[0]);
+  }
+  return matched == 4;
+}
+
+static const char *irq_name(unsigned irq){
+  switch(irq){
+    case 16: return "ADC0 SS2";
+    case 17: return "ADC0 SS3";
+    case 30: return "GPIO Port F";
+    case 35: return "TIMER3A periodic";
+    case 70: return "TIMER4A sleep";
+    default: return "IRQ";
+  }
+}
+
+static int first = 1;
+
+static void event(const char *ph, const char *name, unsigned pid, unsigned tid, double us){
+  printf("%s\n  {\"ph\":\"%s\",\"name\":\"%s\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f%s}",
+    first ? "" : ",", ph, name, pid, tid, us, ph[0] == 'i' ? ",\"s\":\"t\"" : "");
+  first = 0;
+}
+
+int main(int argc, char **argv){
+  FILE *in = stdin;
+  uint32_t count, hz, i, time, last = 0;
+  uint64_t cycles = 0;
+  unsigned id, ev, arg, running = 0;
+  int ok = 1, haveRunning = 0;
+  char name[32];
+  if(argc > 1 && (in = fopen(argv[1], "rb")) == NULL){
+    perror(argv[1]);
+    return 1;
+  }
+  if(!find_marker(in)){
+    fprintf(stderr, "no trace dump found\n");
+    return 1;
+  }
+  count = get(in, 4, &ok);
+  hz = get(in, 4, &ok);
+  if(!ok || hz == 0){
+    fprintf(stderr, "truncated header\n");
+    return 1;
+  }
+  printf("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for(i = 0; i < count; i++){
+    time = get(in, 4, &ok);
+    id = get(in, 2, &ok);
+    ev = get(in, 1, &ok);
+    arg = get(in, 1, &ok);
+    if(!ok){
+      fprintf(stderr, "dump cut short after %u of %u events\n", i, count);
+      break;
+    }
+    // the cycle counter wraps every 53 s at 80 MHz, unwrap it
+    cycles += i ? (uint32_t)(time - last) : 0;
+    last = time;
+    double us = cycles*1e6/hz;
+    switch(ev){
+      case TRACE_SWITCH:
+        if(haveRunning)
+          event("E", "", PID_THREADS, running, us);
+        snprintf(name, sizeof(name), "thread %u", id);
+        event("B", name, PID_THREADS, id, us);
+        running = id;
+        haveRunning = 1;
+        break;
+      case TRACE_BLOCK:
+        event("i", "block", PID_THREADS, id, us);
+        break;
+      case TRACE_UNBLOCK:
+        event("i", "unblock", PID_THREADS, id, us);
+        break;
+      case TRACE_ISR_ENTER:
+        event("B", irq_name(arg), PID_ISRS, arg, us);
+        break;
+      case TRACE_ISR_EXIT:
+        event("E", irq_name(arg), PID_ISRS, arg, us);
+        break;
+      case TRACE_PERIODIC_START:
+        snprintf(name, sizeof(name), "periodic %u", arg);
+        event("B", name, PID_PERIODIC, arg, us);
+        break;
+      case TRACE_PERIODIC_STOP:
+        snprintf(name, sizeof(name), "periodic %u", arg);
+        event("E", name, PID_PERIODIC, arg, us);
+        break;
+      default:
+        fprintf(stderr, "unknown event %u skipped\n", ev);
+        break;
+    }
+  }
+  printf("\n]}\n");
+  return 0;
+}
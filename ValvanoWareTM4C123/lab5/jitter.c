@@ -0,0 +1,120 @@
+// jitter.c
+// Runs on LM4F120/TM4C123
+// Jitter probes, see jitter.h
+// Time stamps come from the DWT cycle counter, started by OS_Init.
+
+#include <stdint.h>
+
+#include "jitter.h"
+#include "OS.h"
+
+#ifdef SIM
+#include "host/sim.h"
+#else
+#define DWT_CYCCNT_R (*((volatile uint32_t *)0xE0001004))
+#endif
+
+static JitterProbeType *Probes = 0;
+
+void Jitter_Add(JitterProbeType *p, const char *name, uint32_t period){
+  JitterProbeType **pt;
+  long sav;
+  p->name = name;
+  p->period = period;
+  Jitter_Reset(p);
+  sav = StartCritical();
+  for(pt = &Probes; *pt && *pt != p; pt = &(*pt)->next){;}
+  if(*pt == 0){
+    p->next = 0;
+    *pt = p;                      // reports list probes in the order added
+  }
+  EndCritical(sav);
+}
+
+void Jitter_Mark(JitterProbeType *p){
+  uint32_t now = DWT_CYCCNT_R;
+  int32_t d;
+  uint32_t a, k;
+  if(p->last != 0){
+    d = (int32_t)(now - p->last - p->period);
+    a = d < 0 ? -d : d;
+    if(a > p->max)
+      p->max = a;
+    p->sum += d;
+    p->sumSq += (uint64_t)a*a;
+    k = a ? 32 - __clz(a) : 0;
+    if(k >= JITTER_BUCKETS)
+      k = JITTER_BUCKETS-1;
+    p->histogram[k]++;
+    p->count++;
+  }
+  p->last = now ? now : 1;        // 0 means no mark yet
+}
+
+void Jitter_Reset(JitterProbeType *p){
+  int k;
+  long sav = StartCritical();
+  p->last = 0;
+  p->count = 0;
+  p->max = 0;
+  p->sum = 0;
+  p->sumSq = 0;
+  for(k = 0; k < JITTER_BUCKETS; k++)
+    p->histogram[k] = 0;
+  EndCritical(sav);
+}
+
+// upper bound of the bucket holding the permille-th deviation
+static uint32_t Percentile(uint32_t *histogram, uint32_t count, uint32_t permille){
+  uint32_t target = (uint32_t)(((uint64_t)count*permille + 999)/1000);
+  uint32_t seen = 0;
+  int k;
+  for(k = 0; k < JITTER_BUCKETS; k++){
+    seen += histogram[k];
+    if(seen >= target)
+      return k ? (1UL << k) - 1 : 0;
+  }
+  return 0xFFFFFFFF;
+}
+
+// integer square root, bit by bit
+static uint32_t Sqrt(uint64_t x){
+  uint64_t r = 0, bit = (uint64_t)1 << 62;
+  while(bit > x)
+    bit >>= 2;
+  while(bit){
+    if(x >= r + bit){
+      x -= r + bit;
+      r = (r >> 1) + bit;
+    } else {
+      r >>= 1;
+    }
+    bit >>= 2;
+  }
+  return (uint32_t)r;
+}
+
+void Jitter_Stats(JitterProbeType *p, jitterStatsType *stats){
+  JitterProbeType copy;
+  int64_t mean;
+  uint64_t meanSq;
+  long sav = StartCritical();
+  copy = *p;
+  EndCritical(sav);
+  stats->count = copy.count;
+  stats->max = copy.max;
+  if(copy.count == 0){
+    stats->mean = stats->stddev = stats->p50 = stats->p99 = 0;
+    return;
+  }
+  mean = copy.sum/(int64_t)copy.count;
+  meanSq = copy.sumSq/copy.count;
+  stats->mean = (int32_t)mean;
+  stats->stddev = Sqrt(meanSq > (uint64_t)(mean*mean) ? meanSq - mean*mean : 0);
+  stats->p50 = Percentile(copy.histogram, copy.count, 500);
+  stats->p99 = Percentile(copy.histogram, copy.count, 990);
+}
+
+JitterProbeType *Jitter_First(void){
+  return Probes;
+}
@@ -0,0 +1,71 @@
+// jitter.h
+// Runs on LM4F120/TM4C123
+// Jitter probes for periodic threads, timer handlers and ADC ISRs.
+// A probe is told the period it should see and is marked once per run;
+// it keeps the worst deviation, running mean and variance, and a log2
+// histogram good enough for p50 and p99. Every probe is on one list so
+// the interpreter "jitter" command can print them all.
+
+#ifndef __JITTER_H
+#define __JITTER_H  1
+
+#include <stdint.h>
+
+#define JITTER_BUCKETS 24
+
+typedef struct jitterProbe {
+  const char *name;
+  uint32_t period;     // expected time between marks, 12.5ns units
+  uint32_t last;       // cycle count at the previous mark
+  uint32_t count;      // intervals measured
+  uint32_t max;        // worst |interval - period|, 12.5ns units
+  int64_t sum;         // sum of (interval - period)
+  uint64_t sumSq;      // sum of (interval - period)^2
+  uint32_t histogram[JITTER_BUCKETS]; // [k] counts deviations of 2^(k-1) to 2^k-1
+  struct jitterProbe *next;
+} JitterProbeType;
+
+// summary of one probe, all in 12.5ns units
+typedef struct jitterStats {
+  uint32_t count;
+  uint32_t max;
+  int32_t mean;        // average interval - period, late is positive
+  uint32_t stddev;
+  uint32_t p50;        // upper bound of the histogram bucket holding the median
+  uint32_t p99;
+} jitterStatsType;
+
+// ******** Jitter_Add ************
+// Start a probe and put it on the list of probes
+// Inputs:  the probe, usually a static variable
+//          name for reports, must stay valid
+//          expected period in 12.5ns units
+// Outputs: none
+void Jitter_Add(JitterProbeType *p, const char *name, uint32_t period);
+
+// ******** Jitter_Mark ************
+// Record one run, call at the same point of every run
+// Inputs:  the probe
+// Outputs: none
+// Safe from interrupt handlers; a probe must only be marked from one place
+void Jitter_Mark(JitterProbeType *p);
+
+// ******** Jitter_Reset ************
+// Forget everything a probe has measured
+// Inputs:  the probe
+// Outputs: none
+void Jitter_Reset(JitterProbeType *p);
+
+// ******** Jitter_Stats ************
+// Summarize a probe
+// Inputs:  the probe, where to put the summary
+// Outputs: none
+void Jitter_Stats(JitterProbeType *p, jitterStatsType *stats);
+
+// ******** Jitter_First ************
+// Walk the list of probes: for(p = Jitter_First(); p; p = p->next)
+// Inputs:  none
+// Outputs: the first probe added, 0 if there is none
+JitterProbeType *Jitter_First(void);
+
+#endif
@@ -77,7 +77,7 @@ void LOADER_CLEAR(void* ptr, size_t size) { int i; int32_t *p;
 }
 #define LOADER_STREQ(s1, s2) (strcmp(s1, s2) == 0)
 
-#define LOADER_JUMP_TO(entry, text, data) OS_AddProcess(entry, text, data, 128, 1)
+#define LOADER_JUMP_TO(entry, text, data) OS_AddProcess(entry, text, data, 512, 1)
 
 #define DBG(...) 
 #define ERR(msg) UART_OutString("ELF: " msg "\n\r")
@@ -2,36 +2,53 @@
 // Dung Nguyen & Nico Cortes
 // Mar 25 2017
 
+#ifndef SIM
 #pragma import(__use_no_semihosting)
+#endif
 
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#ifdef SIM
+#include "host/sim.h"
+#else
 #include "../inc/tm4c123gh6pm.h"
+#endif
 
-#include "FIFO.h"
 #include "heap.h"
+#include "jitter.h"
 #include "LED.h"
-#include "os.h"
+#include "OS.h"
 #include "PLL.h"
+#include "pool.h"
 #include "UART.h"
 #include "ff.h"
 #include "loader.h"
 
+#ifndef SIM
 #define NVIC_ST_CTRL_R          (*((volatile uint32_t *)0xE000E010))
-#define NVIC_ST_CTRL_CLK_SRC    0x00000004  // Clock Source
-#define NVIC_ST_CTRL_INTEN      0x00000002  // Interrupt enable
-#define NVIC_ST_CTRL_ENABLE     0x00000001  // Counter mode
 #define NVIC_ST_RELOAD_R        (*((volatile uint32_t *)0xE000E014))
 #define NVIC_ST_CURRENT_R       (*((volatile uint32_t *)0xE000E018))
 #define NVIC_INT_CTRL_R         (*((volatile uint32_t *)0xE000ED04))
-#define NVIC_INT_CTRL_PENDSTSET 0x04000000  // Set pending SysTick interrupt
+#define DWT_CTRL_R              (*((volatile uint32_t *)0xE0001000))
+#define DWT_CYCCNT_R            (*((volatile uint32_t *)0xE0001004))
 #define NVIC_SYS_PRI3_R         (*((volatile uint32_t *)0xE000ED20))  // Sys. Handlers 12 to 15 Priority
+#endif
+#define NVIC_ST_CTRL_CLK_SRC    0x00000004  // Clock Source
+#define NVIC_ST_CTRL_INTEN      0x00000002  // Interrupt enable
+#define NVIC_ST_CTRL_ENABLE     0x00000001  // Counter mode
+#define NVIC_INT_CTRL_PENDSTSET 0x04000000  // Set pending SysTick interrupt
+#define NVIC_INT_CTRL_VECTACT   0x000001FF  // Active exception, 0 in a thread
 
 #define TRIGGER_SYSTICK()       (NVIC_INT_CTRL_R |= 0x04000000)
-#define TRIGGER_PENDSV()        (NVIC_INT_CTRL_R |= 0x10000000)
+#ifdef SIM
+#define TRIGGER_PENDSV()        (SwitchesRequested++, Sim_PendSV())
+#else
+#define TRIGGER_PENDSV()        (SwitchesRequested++, NVIC_INT_CTRL_R |= 0x10000000)
+#endif
 
 // function definitions in osasm.s
 void DisableInterrupts(void); // Disable interrupts
@@ -39,101 +56,203 @@ void EnableInterrupts(void);  // Enable interrupts
 long StartCriticalAsm(void);
 void EndCriticalAsm(long sr);
 void StartOS(void);
+long SchedLockAsm(void);
+void SchedUnlockAsm(long basepri);
 void JumpAsm(void (*entry)(void), uint32_t *text, uint32_t *data);
 
-#define MAXPROCS 20        // maximum number of threads
-pcbType pcbs[MAXPROCS];
+#define MAXPROCS 20        // maximum number of processes
+static uint32_t PcbStorage[POOL_WORDS(sizeof(pcbType), MAXPROCS)];
+static PoolType *PcbPool;  // process control blocks, taken as processes start
 pcbType *ProcPt;
 int numProcs = 0;
 int currentPid = 0;
 
+#ifndef MAXTHREADS
 #define MAXTHREADS  20        // maximum number of threads
-#define STACKSIZE   100      // number of 32-bit words in stack
+#endif
+#define STACKSIZE   100      // number of 32-bit words in stack for OS_AddThreads
 #define SWPRI -8
 
-tcbType tcbs[MAXTHREADS];
+// the slot after the last thread is Park, where the CPU waits when no
+// thread is ready, so it never runs on the stack of a thread that has
+// died or blocked
+tcbType tcbs[MAXTHREADS+1];
+#define PARK (&tcbs[MAXTHREADS])
 tcbType *RunPt;
-int32_t Stacks[MAXTHREADS][STACKSIZE];
 int numThreads = 0;
 int currentId = 0;
 
+/* STACKS */
+// Thread stacks are carved out of StackArena in the size asked for by
+// OS_AddThread. The free space is an address ordered list of extents;
+// a killed thread's stack is merged back by the Scheduler as it switches
+// away from it. Every stack is painted with STACK_CANARY so
+// OS_StackInfo can find its high-water mark, and the Scheduler traps
+// when the lowest STACK_CANARY_WORDS of a stack have been overwritten.
+#ifndef STACK_ARENA_WORDS
+#define STACK_ARENA_WORDS  2000  // total words for all thread stacks
+#endif
+#define STACK_MIN_WORDS    64    // initial frame plus nested interrupt frames
+#define STACK_CANARY_WORDS 2
+#define STACK_CANARY       ((int32_t)0xDEADBEEF)
+
+typedef struct {
+  int32_t *base;
+  uint32_t words;
+} stackExtent;
+
+__align(8) static int32_t StackArena[STACK_ARENA_WORDS];
+static stackExtent StackFree[MAXTHREADS+1];
+static int NumStackFree = 0;
+
+static void StackInit(void);
+static int32_t *StackAlloc(uint32_t words);
+static void StackRelease(int32_t *base, uint32_t words);
+static void StackFault(tcbType *t);
+static void (*StackFaultHook)(unsigned long id) = 0;
+
 #if DEBUG
-/* JITTER */
-static long MaxJitter;
-unsigned static long time11 = 0;  // time at previous ADC sample
-unsigned long        time21 = 0;  // time at current ADC sample
-long MaxJitter1;             // largest time jitter between interrupts in usec
-#define JITTERSIZE 64
-unsigned long const JitterSize1=JITTERSIZE;
-unsigned long JitterHistogram1[JITTERSIZE]={0,};
-unsigned static long time12 = 0;  // time at previous ADC sample
-unsigned long        time22 = 0;  // time at current ADC sample
-long MaxJitter2;             // largest time jitter between interrupts in usec
-unsigned long const JitterSize2=JITTERSIZE;
-unsigned long JitterHistogram2[JITTERSIZE]={0,};
-Sema4Type jitterLock;
-
-static void Jitter_Init(void);
-
-/* TIMING */
-static int IntsEnabled = 0;
-static int MasterTime = 0;
-static int TmpTimeIntsDisabled;
-static int MaxTimeIntsDisabled = 0;
-static int TimeIntsDisabled = 0;
-static int PercentIntsDisabled = 0;
-static unsigned long GetMasterTime(void);
-
-/* THREAD INFO */
-#define TINFO_BUF_SIZE 100
-struct tinfo tInfoBuf[TINFO_BUF_SIZE];
-
-int tinfoBufI = 0;
-
-void addTInfo(enum tEvent e) {
-    if(tinfoBufI >= 100)
-        return;
-    tInfoBuf[tinfoBufI].tid = OS_Id();
-    tInfoBuf[tinfoBufI].e = e;
-    tInfoBuf[tinfoBufI].t = GetMasterTime();
-    tinfoBufI++;
-}
+/* CRITICAL SECTION PROFILE */
+// Each outermost critical section is timed with the DWT cycle counter and
+// charged to the return address of whoever called StartCritical or
+// OS_DisableInterrupts. Call sites live in a small open addressed table,
+// each with a log2 histogram of durations: bucket k counts sections of
+// 2^(k-1) to 2^k-1 cycles. Recording happens before interrupts come back
+// on, so the table needs no lock of its own. Percentages are only worked
+// out when someone asks for them.
+#ifdef __ARMCC_VERSION
+#define CALLER() ((unsigned long)__return_address())
+#else
+#define CALLER() ((unsigned long)__builtin_return_address(0))
+#endif
+#define CRITSITES 32              // must be a power of 2
+static critSiteType CritStats[CRITSITES];
+static unsigned long CritStart;   // DWT count when interrupts went off
+static unsigned long CritSite;    // who turned them off, 0 if they are on
+static unsigned long CritDropped; // sections from call sites that did not fit
+static unsigned long MaxTimeIntsDisabled = 0;
+static uint64_t TimeIntsDisabled = 0;
+static unsigned long CritSinceMs = 0;
+
+#endif
+
+/* TRACE */
+// Trace records go into a power of 2 ring indexed by a free running
+// counter, so a full ring simply overwrites the oldest records. The time
+// stamp is the DWT cycle counter, which OS_Init starts.
+#if TRACE
+#define TRACE_SIZE 512            // records, must be a power of 2
+typedef struct traceRecord {
+  uint32_t time;
+  uint16_t id;
+  uint8_t event;
+  uint8_t arg;
+} traceRecordType;
+static traceRecordType TraceBuf[TRACE_SIZE];
+static uint32_t TraceI = 0;
+static int TraceOn = 1;
 #endif
 
-//"bootstraps" the next pointer for context switch
-tcbType dummyTcb;
-tcbType *runHead = 0;
-tcbType *runTail = 0;
+/* SCHEDULER */
+// One circular ready list per priority. Bit (31-pri) of ReadyBits is set
+// while ReadyList[pri] is non-empty, so the highest ready priority is a
+// single CLZ and picking the next thread does not depend on MAXTHREADS.
+// Sleeping and blocked threads are not on any ready list.
+// SleepList is a delta list: each sleeper's sleep field holds the ms
+// remaining after the one before it, so a tick only touches the head.
+#define NUMPRIS 32          // priority 0 is the highest, 31 the lowest
+#define PRIBIT(pri) (0x80000000u >> (pri))
+tcbType *ReadyList[NUMPRIS];
+uint32_t ReadyBits = 0;
+tcbType *SleepList = 0;
+
+// PendSV requests from the kernel, scheduler passes and passes that
+// actually changed RunPt, see OS_SwitchStats
+unsigned long SwitchesRequested = 0;
+unsigned long SchedulerPasses = 0;
+unsigned long SwitchesTaken = 0;
+
+static void ReadyAdd(tcbType *t);
+static void ReadyRemove(tcbType *t);
+static int ThreadReady(tcbType *t);
+static void ParkInit(void);
+void SetInitialStack(int i, void(*task)(void), int32_t *data);
 
 volatile uint32_t CountTimeSlice = 0; // increments every systick
-volatile uint32_t sysTime = 0;
+// OS_Time64 is the DWT cycle counter, which runs at the bus clock and is
+// never written after OS_Init, stretched to 64 bits. TimeHigh counts its
+// wraps up to TimeLast, the count when Timer4A_Handler last looked, and
+// the handler runs at least every TICKLESS_MAX_MS, well inside the 53.7 s
+// wrap. TIMER4 itself is only a source of interrupts: tickless mode moves
+// its counter around and loses the few cycles that takes, so no clock is
+// read from it. Readers take no lock: they read TimeSeq, TimeHigh and
+// TimeLast, and go again if TimeSeq changed underneath them.
+static volatile uint64_t TimeHigh = 0;
+static volatile uint32_t TimeLast = 0;
+static volatile uint32_t TimeSeq = 0;
+static uint64_t MsZero = 0;       // OS_Time64 at the last OS_ClearMsTime
+volatile uint32_t TickPeriod = 1;  // ms in the current TIMER4 period
+volatile uint32_t TicksAvoided = 0;
+#define TICKLESS_MAX_MS 1000      // longest TIMER4 period in tickless mode
 
 /* FIFO */
-#define OS_FIFOSIZE    128         // size of the FIFOs (must be power of 2)
-#define OS_FIFOSUCCESS 1        // return value on success
-#define OS_FIFOFAIL    0         // return value on failure
-static Sema4Type fifoEmpty;
-AddIndexFifo(OS, OS_FIFOSIZE, unsigned long, OS_FIFOSUCCESS, OS_FIFOFAIL)
-
-/* MAILBOX */
-static Sema4Type mailPost;
-static Sema4Type mailRecv;
-static Sema4Type mailLock;
-static unsigned long Mail;
+// OS FIFOs carry fixed size elements between ISRs and threads. Each one is
+// a single heap block: the control structure followed by a power of 2 ring
+// of elements. putI and getI run freely and are masked on use, so the count
+// is putI-getI. Threads waiting for data queue on getters, threads waiting
+// for room on putters; both are semaphores used only for their wait lists.
+// Batch calls move as many elements as possible in two memcpy's under one
+// critical section.
+struct osFifo {
+  uint8_t *buf;
+  uint32_t mask;        // size-1
+  uint32_t elemSize;    // bytes per element
+  uint32_t putI;
+  uint32_t getI;
+  Sema4Type getters;
+  Sema4Type putters;
+};
+static OSFifoType *OSFifo;      // the FIFO behind OS_Fifo_Put/Get
+
+/* MESSAGE QUEUES */
+// A queue owns depth message slots of msgSize bytes in one heap block and
+// moves pointers to them through two OS FIFOs: freeSlots holds the slots
+// nobody is using, mail holds posted messages in order. A sender borrows
+// a slot, fills it in place and posts it; the receiver reads it in place
+// and gives it back. Neither FIFO can overflow since there are only depth
+// slots, so posting and freeing never block. The copying Send and Recv
+// calls are built on the same four steps.
+struct osQueue {
+  unsigned long msgSize;
+  OSFifoType *freeSlots;
+  OSFifoType *mail;
+};
+static OSQueueType *MailBox;    // the queue behind OS_MailBox_Send/Recv
 
+#if DEBUG
 static void PortB_Init(void);
+#endif
 
 static int add_thread_to_proc(void(*task)(void), unsigned long stackSize, unsigned long priority, int32_t *data);
 
 /* SEMAPHORES */
 void BlockThread(Sema4Type *sema);
 void UnblockThread(Sema4Type *sema);
+static void BlockThreadTimed(Sema4Type *sema, unsigned long ms);
+static tcbType *SemaDequeue(Sema4Type *sema);
+static void SemaRemove(Sema4Type *sema, tcbType *t);
+static void WakeThread(tcbType *t);
+static void SleepInsert(tcbType *t, unsigned long ms);
+static void SleepRemove(tcbType *t);
+
+/* MUTEXES */
+static void MutexHandOver(MutexType *m);
+#if TRACE
+static void TraceThread(unsigned long event, unsigned long id, unsigned long arg);
+#endif
 
 void InitAllPCBs(void) {
-	for(int i = 0; i < MAXPROCS; ++i) {
-		pcbs[i].num_threads = 0;
-		pcbs[i].pid = -1;
-	}
+  PcbPool = Pool_Create(sizeof(pcbType), MAXPROCS, PcbStorage);
 }
 
 void InitAllTCBs(void){
@@ -141,15 +260,418 @@ void InitAllTCBs(void){
     tcbs[k].sp = 0;
     tcbs[k].next = 0;
     tcbs[k].prev = 0;
+    tcbs[k].sNext = 0;
     tcbs[k].id = 666666;
     tcbs[k].sleep = 0;
+    tcbs[k].asleep = 0;
     tcbs[k].active = 0;
+    tcbs[k].stack = 0;
+    tcbs[k].stackWords = 0;
+    memset(&tcbs[k].heapCache, 0, sizeof(heap_cache_t));
+  }
+  for(int k=0; k<NUMPRIS; k++)
+    ReadyList[k] = 0;
+  ReadyBits = 0;
+  SleepList = 0;
+  StackInit();
+}
+
+// ******** Park ************
+// what the CPU runs while no thread is ready, until an interrupt wakes one
+static void Park(void) {
+  while(1){;}
+}
+
+// Park gets its own stack, outside the arena, and is never on a ready
+// list; below every priority, anything that wakes up preempts it
+static void ParkInit(void) {
+  static int32_t parkStack[STACK_MIN_WORDS];
+  tcbType *p = PARK;
+  p->stack = parkStack;
+  p->stackWords = STACK_MIN_WORDS;
+  SetInitialStack(MAXTHREADS, Park, 0);
+  p->id = 666666;
+  p->active = 1;
+  p->blocked = 1;
+  p->pri = NUMPRIS;
+  p->basePri = NUMPRIS;
+}
+
+static void StackInit(void) {
+  StackFree[0].base = StackArena;
+  StackFree[0].words = STACK_ARENA_WORDS;
+  NumStackFree = 1;
+}
+
+// ******** StackAlloc ************
+// first fit allocation from the stack arena
+// input:  number of words, must be even
+// output: lowest word of the stack, 0 if the arena is full
+// must be called with interrupts disabled
+static int32_t *StackAlloc(uint32_t words) {
+  for(int i = 0; i < NumStackFree; i++){
+    if(StackFree[i].words >= words){
+      int32_t *base = StackFree[i].base;
+      StackFree[i].base += words;
+      StackFree[i].words -= words;
+      if(StackFree[i].words == 0){
+        for(int j = i; j < NumStackFree-1; j++)
+          StackFree[j] = StackFree[j+1];
+        NumStackFree--;
+      }
+      return base;
+    }
+  }
+  return 0;
+}
+
+// ******** StackRelease ************
+// return a stack to the arena, merging it with free neighbors
+// must be called with interrupts disabled
+static void StackRelease(int32_t *base, uint32_t words) {
+  int i = 0;
+  while(i < NumStackFree && StackFree[i].base < base)
+    i++;
+  if(i > 0 && StackFree[i-1].base + StackFree[i-1].words == base){
+    StackFree[i-1].words += words;
+    if(i < NumStackFree && base + words == StackFree[i].base){
+      StackFree[i-1].words += StackFree[i].words;
+      for(int j = i; j < NumStackFree-1; j++)
+        StackFree[j] = StackFree[j+1];
+      NumStackFree--;
+    }
+  } else if(i < NumStackFree && base + words == StackFree[i].base){
+    StackFree[i].base = base;
+    StackFree[i].words += words;
+  } else {
+    for(int j = NumStackFree; j > i; j--)
+      StackFree[j] = StackFree[j-1];
+    StackFree[i].base = base;
+    StackFree[i].words = words;
+    NumStackFree++;
+  }
+}
+
+#if TICKLESS
+// ******** SetTickPeriod ************
+// stretch or shrink the running TIMER4 period to ms milliseconds,
+// keeping the cycles already counted so OS_Time does not jump
+// must be called with interrupts disabled
+static void SetTickPeriod(uint32_t ms) {
+  uint32_t elapsed = TIMER4_TAILR_R - TIMER4_TAV_R;
+  if(TIMER4_RIS_R & TIMER_RIS_TATORIS)
+    return;                     // the period is over, Timer4A_Handler will set the next
+  TIMER4_TAILR_R = ms*TIME_1MS - 1;
+  TIMER4_TAV_R = TIMER4_TAILR_R - elapsed;
+  TickPeriod = ms;
+}
+
+// ms already elapsed since the start of the TIMER4 period the sleep list
+// counts from. If that period has run out and Timer4A_Handler has not
+// run yet, the counter has reloaded and the whole period is gone too;
+// the flag is read on both sides so a timeout in between is not missed
+static uint32_t TickElapsedMs(void) {
+  uint32_t over, cycles;
+  do {
+    over = TIMER4_RIS_R & TIMER_RIS_TATORIS;
+    cycles = TIMER4_TAILR_R - TIMER4_TAV_R;
+  } while(over != (TIMER4_RIS_R & TIMER_RIS_TATORIS));
+  return cycles/TIME_1MS + (over ? TickPeriod : 0);
+}
+#endif
+
+// ******** ReadyAdd ************
+// append a thread to the tail of its priority's ready list
+// must be called with interrupts disabled
+static void ReadyAdd(tcbType *t) {
+  tcbType *head = ReadyList[t->pri];
+  if(head) {
+    t->next = head;
+    t->prev = head->prev;
+    head->prev->next = t;
+    head->prev = t;
+    #if TICKLESS
+    NVIC_ST_CTRL_R |= NVIC_ST_CTRL_INTEN;
+    #endif
+  } else {
+    t->next = t;
+    t->prev = t;
+    ReadyList[t->pri] = t;
+    ReadyBits |= PRIBIT(t->pri);
+  }
+}
+
+// ******** ReadyRemove ************
+// unlink a thread from its priority's ready list
+// must be called with interrupts disabled
+static void ReadyRemove(tcbType *t) {
+  if(t->next == t) {
+    ReadyList[t->pri] = 0;
+    ReadyBits &= ~PRIBIT(t->pri);
+  } else {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    if(ReadyList[t->pri] == t)
+      ReadyList[t->pri] = t->next;
+  }
+}
+
+static int ThreadReady(tcbType *t) {
+  return t->active && !t->blocked && !t->asleep;
+}
+
+// ******** StackFault ************
+// a thread overflowed its stack, nothing it owns can be trusted
+static void StackFault(tcbType *t) {
+  DisableInterrupts();
+  if(StackFaultHook)
+    StackFaultHook(t->id);
+  LEDS = RED;
+  while(1){;}
+}
+
+void OS_SetStackFaultHook(void(*hook)(unsigned long id)) {
+  StackFaultHook = hook;
+}
+
+// ******** HeapLock ************
+// lock the heap against thread switches. SchedLockAsm holds off PendSV
+// and SysTick but leaves the other interrupts on, so an ISR could break
+// into a thread halfway through the free lists; ISRs are turned away
+static long HeapLock(void) {
+  if(NVIC_INT_CTRL_R & NVIC_INT_CTRL_VECTACT)
+    return HEAP_LOCK_REFUSED;
+  return SchedLockAsm();
+}
+
+// ******** HeapCache ************
+// heap cache of the running thread, none before OS_AddThread; none in an
+// ISR either, so it goes on to HeapLock and is refused there
+static heap_cache_t *HeapCache(void) {
+  if(RunPt == 0 || (NVIC_INT_CTRL_R & NVIC_INT_CTRL_VECTACT))
+    return 0;
+  return &RunPt->heapCache;
+}
+
+// ******** HeapTag ************
+// heap owner tag of the running thread, its process and id
+static uint16_t HeapTag(void) {
+  if(RunPt == 0)
+    return HEAP_TAG_NONE;
+  return HEAP_TAG(RunPt->pcb ? RunPt->pcb->pid : 0, RunPt->id);
+}
+
+int OS_MaxThreads(void) {
+  return MAXTHREADS;
+}
+
+int OS_StackInfo(int slot, stackInfoType *info) {
+  int32_t *stack; uint32_t words, k;
+  long sav = StartCritical();
+  if(slot < 0 || slot >= MAXTHREADS || !tcbs[slot].active) {
+    EndCritical(sav);
+    return 0;
+  }
+  stack = tcbs[slot].stack;
+  words = tcbs[slot].stackWords;
+  info->id = tcbs[slot].id;
+  info->pri = tcbs[slot].pri;
+  EndCritical(sav);
+  //the stack grows down, count the painted words left at the bottom
+  for(k = 0; k < words && stack[k] == STACK_CANARY; k++){;}
+  info->words = words;
+  info->peak = words - k;
+  info->overflow = k < STACK_CANARY_WORDS;
+  return 1;
+}
+
+/* CPU ACCOUNTING */
+// Every Scheduler pass charges the outgoing thread with the DWT cycles
+// since the previous pass, less the time spent in accounted ISRs in the
+// meantime. IsrCycles only grows when the outermost handler returns, so
+// nested handlers are not subtracted twice. Per-source totals include any
+// handler that preempted them.
+#define MAXISRS 8
+typedef struct isrStat {
+  uint32_t irq;
+  uint32_t count;
+  uint64_t cycles;
+} isrStatType;
+static isrStatType IsrStats[MAXISRS];
+static int NumIsrs = 0;
+static uint32_t IsrNest = 0;        // handlers currently running
+static uint32_t IsrOuterStart;      // when the outermost one started
+static uint64_t IsrCycles = 0;      // all accounted ISR time
+static uint64_t IsrMark = 0;        // IsrCycles at the last charge
+static uint32_t LastCharge;         // DWT count at the last charge
+static uint32_t WindowStart;        // DWT count at OS_CpuReset
+static uint64_t WindowHigh = 0;     // whole 2^32 cycle wraps in the window
+
+// charge RunPt up to now, must be called with interrupts disabled
+static void CpuCharge(uint32_t now){
+  uint64_t isr = IsrCycles - IsrMark;
+  uint64_t ran = (uint32_t)(now - LastCharge);
+  if(ran > isr)
+    RunPt->cycles += ran - isr;
+  if(now - WindowStart < LastCharge - WindowStart)
+    WindowHigh += 0x100000000ULL;     // the cycle counter passed the window start
+  LastCharge = now;
+  IsrMark = IsrCycles;
+}
+
+unsigned long OS_IsrStart(unsigned long irq){
+  uint32_t now = DWT_CYCCNT_R;
+  int32_t status = StartCritical();
+  if(IsrNest++ == 0)
+    IsrOuterStart = now;
+  EndCritical(status);
+  OS_Trace(TRACE_ISR_ENTER, irq);
+  return now;
+}
+
+void OS_IsrEnd(unsigned long irq, unsigned long start){
+  uint32_t now = DWT_CYCCNT_R;
+  int n;
+  int32_t status;
+  OS_Trace(TRACE_ISR_EXIT, irq);
+  status = StartCritical();
+  for(n = 0; n < NumIsrs && IsrStats[n].irq != irq; n++){;}
+  if(n == NumIsrs && NumIsrs < MAXISRS){
+    IsrStats[n].irq = irq;
+    IsrStats[n].count = 0;
+    IsrStats[n].cycles = 0;
+    NumIsrs++;
+  }
+  if(n < NumIsrs){
+    IsrStats[n].count++;
+    IsrStats[n].cycles += (uint32_t)(now - start);
+  }
+  if(--IsrNest == 0)
+    IsrCycles += (uint32_t)(now - IsrOuterStart);
+  EndCritical(status);
+}
+
+int OS_CpuInfo(int slot, cpuInfoType *info){
+  long sav = StartCritical();
+  if(slot < 0 || slot >= MAXTHREADS || !tcbs[slot].active) {
+    EndCritical(sav);
+    return 0;
+  }
+  if(&tcbs[slot] == RunPt)
+    CpuCharge(DWT_CYCCNT_R);          // bring the running thread up to date
+  info->id = tcbs[slot].id;
+  info->pri = tcbs[slot].pri;
+  info->cycles = tcbs[slot].cycles;
+  info->switches = tcbs[slot].switches;
+  info->idle = tcbs[slot].idle;
+  EndCritical(sav);
+  return 1;
+}
+
+void OS_SetIdle(void){
+  RunPt->idle = 1;
+}
+
+int OS_IsrInfo(int n, isrInfoType *info){
+  long sav = StartCritical();
+  if(n < 0 || n >= NumIsrs) {
+    EndCritical(sav);
+    return 0;
+  }
+  info->irq = IsrStats[n].irq;
+  info->cycles = IsrStats[n].cycles;
+  info->count = IsrStats[n].count;
+  EndCritical(sav);
+  return 1;
+}
+
+uint64_t OS_CpuWindow(void){
+  uint64_t window;
+  long sav = StartCritical();
+  CpuCharge(DWT_CYCCNT_R);
+  window = WindowHigh + (uint32_t)(LastCharge - WindowStart);
+  EndCritical(sav);
+  return window;
+}
+
+void OS_CpuReset(void){
+  int k;
+  long sav = StartCritical();
+  for(k = 0; k < MAXTHREADS; k++){
+    tcbs[k].cycles = 0;
+    tcbs[k].switches = 0;
+  }
+  for(k = 0; k < NumIsrs; k++){
+    IsrStats[k].count = 0;
+    IsrStats[k].cycles = 0;
   }
+  LastCharge = WindowStart = DWT_CYCCNT_R;
+  WindowHigh = 0;
+  IsrMark = IsrCycles;
+  EndCritical(sav);
+}
+
+// ******** Scheduler ************
+// pick the next thread to run, called from PendSV_Handler and
+// SysTick_Handler with interrupts disabled after the old context is saved
+// threads of equal priority are run round robin
+// if nothing is ready the current thread keeps running
+void Scheduler(void) {
+  tcbType *next;
+  int32_t pri;
+  //overflow check on the thread being switched out. It comes late: the
+  //exception frame, R4-R11, the {R0,LR} from osasm.s and our own frame
+  //are already on that stack, so an overflow is found some 20 words
+  //after it happened and may have run further into whatever lies below.
+  //StackFault stops everything, so the damage goes no further than that
+  if(RunPt->stack && (RunPt->sp < RunPt->stack + STACK_CANARY_WORDS ||
+     RunPt->stack[STACK_CANARY_WORDS-1] != STACK_CANARY))
+    StackFault(RunPt);
+  CpuCharge(DWT_CYCCNT_R);
+  //give back the killed thread's stack. We are still running on it,
+  //osasm.s pushed {R0,LR} there before calling us, but interrupts are
+  //off and nothing can take the space before the SP switch to RunPt,
+  //which is PARK if no thread is ready.
+  //The PCB of a process whose last thread this was goes the same way
+  if(!RunPt->active && RunPt->stack){
+    StackRelease(RunPt->stack, RunPt->stackWords);
+    RunPt->stack = 0;
+    if(RunPt->pcb && RunPt->pcb->num_threads == 0)
+      Pool_Free(PcbPool, RunPt->pcb);
+    RunPt->pcb = 0;
+  }
+  if(ReadyBits == 0){
+    //not even RunPt can go on, it has died, blocked or gone to sleep
+    RunPt = PARK;
+    ProcPt = 0;
+    return;
+  }
+  pri = __clz(ReadyBits);
+  if(ThreadReady(RunPt) && RunPt->pri == pri)
+    next = RunPt->next;
+  else
+    next = ReadyList[pri];
+  ReadyList[pri] = next;
+  SchedulerPasses++;
+  if(next != RunPt){
+    SwitchesTaken++;
+    RunPt = next;
+    RunPt->switches++;
+    OS_Trace(TRACE_SWITCH, 0);
+  }
+  ProcPt = next->pcb;
+  #if TICKLESS
+  //no time slicing while the thread is alone at the top priority
+  if(next->next == next)
+    NVIC_ST_CTRL_R &= ~NVIC_ST_CTRL_INTEN;
+  else
+    NVIC_ST_CTRL_R |= NVIC_ST_CTRL_INTEN;
+  #endif
 }
 
 void OS_InitSysTimer(void){
   SYSCTL_RCGCTIMER_R |= 0x10;   // 0) activate TIMER4
-  volatile int delay = SYSCTL_RCGCTIMER_R;
+  (void)SYSCTL_RCGCTIMER_R;     // allow time for clock to start
   TIMER4_CTL_R = 0x00000000;    // 1) disable TIMER4A during setup
   TIMER4_CFG_R = 0x00000000;    // 2) configure for 32-bit mode
   TIMER4_TAMR_R = 0x00000002;   // 3) configure for periodic mode, default down-count settings
@@ -165,20 +687,22 @@ void OS_InitSysTimer(void){
   //TIMER4_CTL_R = 0x00000001;    // 10) enable TIMER3A
 }
 
+#if DEBUG
 static void PortB_Init(void) {
   SYSCTL_RCGCGPIO_R |= 0x02;       // activate port B
-  volatile int delay = SYSCTL_RCGCGPIO_R;
+  (void)SYSCTL_RCGCGPIO_R;         // allow time for clock to start
   GPIO_PORTB_DIR_R |= 0x0F;    // make PB3-0 output heartbeats
   GPIO_PORTB_AFSEL_R &= ~0x0F;   // disable alt funct on PB3-0
   GPIO_PORTB_DEN_R |= 0x0F;     // enable digital I/O on PB3-0
   GPIO_PORTB_PCTL_R = GPIO_PORTB_PCTL_R & ~0x0000FFFF;
   GPIO_PORTB_AMSEL_R &= ~0x0F;;      // disable analog functionality on PB
 }
+#endif
 
 static void PortF_Init(void) {
   //Initialize PORTF for LEDs and Switches
   SYSCTL_RCGCGPIO_R |= 0x00000020;  // 1) activate clock for Port F
-  volatile int delay = SYSCTL_RCGCGPIO_R;        // allow time for clock to start
+  (void)SYSCTL_RCGCGPIO_R;          // allow time for clock to start
   GPIO_PORTF_LOCK_R = 0x4C4F434B;   // 2) unlock GPIO Port F
   GPIO_PORTF_CR_R = 0x1F;           // allow changes to PF4-0
   // only PF0 needs to be unlocked, other bits can't be locked
@@ -216,34 +740,47 @@ void OS_Init(void){
   PLL_Init(Bus80MHz);         // set processor clock to 50 MHz
   InitAllTCBs();
 	InitAllPCBs();
+  ParkInit();
+  Heap_SetThreadHooks(HeapCache, HeapLock, SchedUnlockAsm);
+  Heap_SetTagHook(HeapTag);
+  NVIC_DBG_INT_R |= 0x01000000; // TRCENA, turn on the DWT
+  DWT_CYCCNT_R = 0;
+  DWT_CTRL_R |= 0x00000001;     // start the cycle counter
+  OS_CpuReset();
 	//OS_AddProcess(&idle_proc, dummy_text, dummy_data, 128, 0x7FFFFFFF);
   OS_InitSysTimer();
   UART_Init();
   PortF_Init();
   #if DEBUG
-  Jitter_Init();
   PortB_Init();
   #endif
 }
 
-void SetInitialStack(int i){
-  Stacks[i][0] = 0xDEADBEEF;
-  tcbs[i].sp = &Stacks[i][STACKSIZE-16]; // thread stack pointer
-  Stacks[i][STACKSIZE-1] = 0x01000000;   // thumb bit
-  Stacks[i][STACKSIZE-3] = 0x14141414;   // R14
-  Stacks[i][STACKSIZE-4] = 0x12121212;   // R12
-  Stacks[i][STACKSIZE-5] = 0x03030303;   // R3
-  Stacks[i][STACKSIZE-6] = 0x02020202;   // R2
-  Stacks[i][STACKSIZE-7] = 0x01010101;   // R1
-  Stacks[i][STACKSIZE-8] = 0x00000000;   // R0
-  Stacks[i][STACKSIZE-9] = 0x11111111;   // R11
-  Stacks[i][STACKSIZE-10] = 0x10101010;  // R10
-  Stacks[i][STACKSIZE-11] = 0x09090909;  // R9
-  Stacks[i][STACKSIZE-12] = 0x08080808;  // R8
-  Stacks[i][STACKSIZE-13] = 0x07070707;  // R7
-  Stacks[i][STACKSIZE-14] = 0x06060606;  // R6
-  Stacks[i][STACKSIZE-15] = 0x05050505;  // R5
-  Stacks[i][STACKSIZE-16] = 0x04040404;  // 
+void SetInitialStack(int i, void(*task)(void), int32_t *data){
+  int32_t *stack = tcbs[i].stack;
+  int32_t size = tcbs[i].stackWords;
+  for(int k = 0; k < size-16; k++)
+    stack[k] = STACK_CANARY;   // canary and paint for high-water mark
+  tcbs[i].sp = &stack[size-16]; // thread stack pointer
+  stack[size-1] = 0x01000000;   // thumb bit
+  stack[size-2] = (int32_t)(uintptr_t)(task); // PC
+  stack[size-3] = 0x14141414;   // R14
+  stack[size-4] = 0x12121212;   // R12
+  stack[size-5] = 0x03030303;   // R3
+  stack[size-6] = 0x02020202;   // R2
+  stack[size-7] = 0x01010101;   // R1
+  stack[size-8] = 0x00000000;   // R0
+  stack[size-9] = 0x11111111;   // R11
+  stack[size-10] = 0x10101010;  // R10
+  stack[size-11] = (int32_t)(uintptr_t)(data); // R9, process data base
+  stack[size-12] = 0x08080808;  // R8
+  stack[size-13] = 0x07070707;  // R7
+  stack[size-14] = 0x06060606;  // R6
+  stack[size-15] = 0x05050505;  // R5
+  stack[size-16] = 0x04040404;  // R4
+  #ifdef SIM
+  Sim_InitContext(i, task);     // the host runs it on its own stack
+  #endif
 }
 
 //******** OS_AddThread ***************
@@ -254,129 +791,99 @@ int OS_AddThreads(void(*task0)(void),
                  void(*task1)(void),
                  void(*task2)(void)){ int32_t status;
   status = StartCritical();
-  tcbs[0].next = &tcbs[1]; // 0 points to 1
-  tcbs[1].next = &tcbs[2]; // 1 points to 2
-  tcbs[2].next = &tcbs[0]; // 2 points to 0
-  SetInitialStack(0); Stacks[0][STACKSIZE-2] = (int32_t)(task0); // PC
-  SetInitialStack(1); Stacks[1][STACKSIZE-2] = (int32_t)(task1); // PC
-  SetInitialStack(2); Stacks[2][STACKSIZE-2] = (int32_t)(task2); // PC
+  for(int k=0; k<3; k++){
+    tcbs[k].stack = StackAlloc(STACKSIZE);
+    tcbs[k].stackWords = STACKSIZE;
+    if(tcbs[k].stack == 0){
+      while(k--){
+        StackRelease(tcbs[k].stack, STACKSIZE);
+        tcbs[k].stack = 0;
+      }
+      EndCritical(status);
+      return 0;           // the stack arena is full
+    }
+  }
+  SetInitialStack(0, task0, 0);
+  SetInitialStack(1, task1, 0);
+  SetInitialStack(2, task2, 0);
+  for(int k=0; k<3; k++){
+    tcbs[k].active = 1;
+    tcbs[k].sleep = 0;
+    tcbs[k].asleep = 0;
+    tcbs[k].id = k;
+    tcbs[k].pri = 0;
+    tcbs[k].basePri = 0;
+    tcbs[k].blocked = 0;
+    tcbs[k].bNext = NULL;
+    tcbs[k].waitMutex = 0;
+    tcbs[k].mutexes = 0;
+    tcbs[k].waitSema = 0;
+    tcbs[k].timedOut = 0;
+    tcbs[k].cycles = 0;
+    tcbs[k].switches = 0;
+    tcbs[k].idle = 0;
+    ReadyAdd(&tcbs[k]);     // 0 -> 1 -> 2 -> 0
+  }
   RunPt = &tcbs[0];       // thread 0 will run first
   numThreads = 3;
+  currentId = 3;
   EndCritical(status);
   return 1;               // successful
 }
 
 int OS_AddThread(void(*task)(void), unsigned long stackSize, unsigned long priority){
-  int32_t status;
-  status = StartCritical();
-  if(numThreads>0 && numThreads<MAXTHREADS){
-    //find open tcb spot
-    int spot;
-    for(int k=0; k<MAXTHREADS; k++){
-      if(!(tcbs[k].active)){
-        spot = k;
-        break;
-      }
-    }
-    
-    SetInitialStack(spot);
-    Stacks[spot][STACKSIZE-2] = (int32_t)(task);
-		Stacks[spot][STACKSIZE-11] = (int32_t) RunPt->pcb->data;
-    //fix linked list
-    tcbs[spot].next = runHead;
-    tcbs[spot].prev = runTail;
-    runTail->next = &tcbs[spot];
-    runHead->prev = &tcbs[spot];
-    //set runTail to current thread
-    runTail = &tcbs[spot];
-    //other init
-    tcbs[spot].active = 1;
-    tcbs[spot].sleep = 0;
-    tcbs[spot].id = currentId;
-    tcbs[spot].pri = priority;
-    tcbs[spot].blocked = 0;
-    tcbs[spot].bNext = NULL;
-		tcbs[spot].pcb = ProcPt;
-		++ProcPt->num_threads;
-  } else if(numThreads == 0) {
-    SetInitialStack(0);
-    Stacks[0][STACKSIZE-2] = (int32_t)(task);
-		Stacks[0][STACKSIZE-11] = (int32_t) RunPt->pcb->data;
-    tcbs[0].next = &tcbs[0];
-    tcbs[0].prev = &tcbs[0];
-    runHead = &tcbs[0];
-    runTail = &tcbs[0];
-    tcbs[0].active = 1;
-    tcbs[0].sleep = 0;
-    tcbs[0].id = 0;
-    tcbs[0].pri = priority;
-    tcbs[0].blocked = 0;
-    tcbs[0].bNext = NULL;
-		tcbs[0].pcb = ProcPt;
-    RunPt = &tcbs[0]; //init runpt
-		++ProcPt->num_threads;
-  } else {
-    return 0;
-  }
-  numThreads++;
-  currentId++;
-  EndCritical(status);
-  return 1;               // successful
+  return add_thread_to_proc(task, stackSize, priority, ProcPt ? (int32_t*) ProcPt->data : 0);
 }
 
 static int add_thread_to_proc(void(*task)(void), unsigned long stackSize, unsigned long priority, int32_t *data) {
 	int32_t status;
   status = StartCritical();
-	int spot;
-  if(numThreads>0 && numThreads<MAXTHREADS){
-    //find open tcb spot
-    for(int k=0; k<MAXTHREADS; k++){
-      if(!(tcbs[k].active)){
-        spot = k;
-        break;
-      }
+	int spot = -1;
+  uint32_t words = ((stackSize + 7)/8)*2; // whole double words
+  if(words < STACK_MIN_WORDS)
+    words = STACK_MIN_WORDS;
+  if(numThreads >= MAXTHREADS || priority >= NUMPRIS) {
+    EndCritical(status);
+    return 0;
+  }
+  //find open tcb spot, a killed thread's tcb is free once its stack is
+  for(int k=0; k<MAXTHREADS; k++){
+    if(!(tcbs[k].active) && !(tcbs[k].stack)){
+      spot = k;
+      break;
     }
-    
-    SetInitialStack(spot);
-    Stacks[spot][STACKSIZE-2] = (int32_t)(task);
-		Stacks[spot][STACKSIZE-11] = (int32_t) data;
-    //fix linked list
-    tcbs[spot].next = runHead;
-    tcbs[spot].prev = runTail;
-    runTail->next = &tcbs[spot];
-    runHead->prev = &tcbs[spot];
-    //set runTail to current thread
-    runTail = &tcbs[spot];
-    //other init
-    tcbs[spot].active = 1;
-    tcbs[spot].sleep = 0;
-    tcbs[spot].id = currentId;
-    tcbs[spot].pri = priority;
-    tcbs[spot].blocked = 0;
-    tcbs[spot].bNext = NULL;
-		tcbs[spot].pcb = ProcPt;
-		++ProcPt->num_threads;
-  } else if(numThreads == 0) {
-		spot = 0;
-    SetInitialStack(0);
-    Stacks[0][STACKSIZE-2] = (int32_t)(task);
-		Stacks[0][STACKSIZE-11] = (int32_t) data; 	
-    tcbs[0].next = &tcbs[0];
-    tcbs[0].prev = &tcbs[0];
-    runHead = &tcbs[0];
-    runTail = &tcbs[0];
-    tcbs[0].active = 1;
-    tcbs[0].sleep = 0;
-    tcbs[0].id = 0;
-    tcbs[0].pri = priority;
-    tcbs[0].blocked = 0;
-    tcbs[0].bNext = NULL;
-		tcbs[0].pcb = ProcPt;
-    RunPt = &tcbs[0]; //init runpt
-		++ProcPt->num_threads;
-  } else {
+  }
+  if(spot < 0 || (tcbs[spot].stack = StackAlloc(words)) == 0) {
+    EndCritical(status);
     return 0;
   }
+  tcbs[spot].stackWords = words;
+
+  SetInitialStack(spot, task, data);
+  tcbs[spot].active = 1;
+  tcbs[spot].sleep = 0;
+  tcbs[spot].asleep = 0;
+  tcbs[spot].id = currentId;
+  tcbs[spot].pri = priority;
+  tcbs[spot].basePri = priority;
+  tcbs[spot].blocked = 0;
+  tcbs[spot].bNext = NULL;
+  tcbs[spot].waitMutex = 0;
+  tcbs[spot].mutexes = 0;
+  tcbs[spot].waitSema = 0;
+  tcbs[spot].timedOut = 0;
+  tcbs[spot].cycles = 0;
+  tcbs[spot].switches = 0;
+  tcbs[spot].idle = 0;
+  tcbs[spot].sNext = NULL;
+	tcbs[spot].pcb = ProcPt;
+	if(ProcPt)
+		++ProcPt->num_threads;
+  ReadyAdd(&tcbs[spot]);
+  if(RunPt == 0)
+    RunPt = &tcbs[spot]; //init runpt
+  else if(tcbs[spot].pri < RunPt->pri)
+    TRIGGER_PENDSV();
   numThreads++;
   currentId++;
   EndCritical(status);
@@ -392,6 +899,10 @@ void OS_Launch(uint32_t theTimeSlice){
   NVIC_ST_RELOAD_R = theTimeSlice - 1; // reload value
   NVIC_ST_CTRL_R = 0x00000007; // enable, core clock and interrupt arm
   TIMER4_CTL_R = 0x00000001;    // 10) enable TIMER4A
+  #if DEBUG
+  OS_CritReset();              // interrupts have been off since OS_Init
+  CritSite = 0;
+  #endif
   StartOS();                   // start on the first task
 }
 
@@ -401,34 +912,38 @@ void OS_Suspend(void){
   //2 trigger systick
   //NVIC_INT_CTRL_R |= 0x04000000;
   //2 trigger pendsv
-  NVIC_INT_CTRL_R |= 0x10000000;
+  TRIGGER_PENDSV();
 }
 
 // ******** OS_Kill ************
 // kill the currently running thread, release its TCB and stack
+// the stack and TCB are reclaimed by the Scheduler after the switch
 // input:  none
 // output: none
 void OS_Kill(void){
   OS_DisableInterrupts();
-  //Remove thread from linked list
-  RunPt->prev->next = RunPt->next;
-  RunPt->next->prev = RunPt->prev;
+  //Remove thread from its ready list
+  if(ThreadReady(RunPt))
+    ReadyRemove(RunPt);
   //Set tcb to be available to use
   RunPt->active = 0;
-  //Fix head and tail
-  if(RunPt == runHead)
-    runHead = RunPt->next;
-  if(RunPt == runTail)
-    runTail = RunPt->prev;
   
   numThreads--;
-	if(--ProcPt->num_threads == 0) {
+  //mutexes still held are unlocked for good, as if by OS_MutexUnlock
+  while(RunPt->mutexes) {
+    MutexType *m = RunPt->mutexes;
+    RunPt->mutexes = m->held;
+    MutexHandOver(m);
+  }
+	if(ProcPt && --ProcPt->num_threads == 0) {
 		ProcPt->pid = -1;
 		Heap_Free(ProcPt->data);
 	  Heap_Free(ProcPt->text);
+		//the PCB is still ProcPt until the switch, Scheduler frees it
 	}
+  Heap_CacheFlush(&RunPt->heapCache);
   //2 trigger pendsv, context switch
-  NVIC_INT_CTRL_R |= 0x10000000;
+  TRIGGER_PENDSV();
  
   OS_EnableInterrupts();
 }
@@ -441,36 +956,267 @@ void OS_Kill(void){
 // OS_Sleep(0) implements cooperative multitasking
 void OS_Sleep(unsigned long sleepTime){
   OS_DisableInterrupts();
-  //check if sleeptime > 0 and not running single thread
-  if(sleepTime > 0 && RunPt->next != RunPt){
-    tcbType *thisTcb = RunPt;
-    thisTcb->sleep = sleepTime;
+  //move thread from its ready list into the sleep delta list
+  if(sleepTime > 0 && ThreadReady(RunPt)){
+    ReadyRemove(RunPt);
+    SleepInsert(RunPt, sleepTime);
   }
   
   TRIGGER_PENDSV();
   OS_EnableInterrupts();
 }
 
+// ******** SleepInsert ************
+// put a thread on the sleep delta list, it wakes up in ms milliseconds
+// must be called with interrupts disabled
+static void SleepInsert(tcbType *t, unsigned long ms){
+  tcbType **pt = &SleepList;
+  int32_t delta = ms;
+  #if TICKLESS
+  //deltas are counted from the start of the current TIMER4 period
+  delta += TickElapsedMs();
+  #endif
+  //skip sleepers that wake up no later than this one
+  while(*pt && (*pt)->sleep <= delta){
+    delta -= (*pt)->sleep;
+    pt = &(*pt)->sNext;
+  }
+  if(*pt)
+    (*pt)->sleep -= delta;
+  t->sleep = delta;
+  t->asleep = 1;
+  t->sNext = *pt;
+  *pt = t;
+  #if TICKLESS
+  if(SleepList == t && (uint32_t)delta < TickPeriod)
+    SetTickPeriod(delta);
+  #endif
+}
+
+// ******** SleepRemove ************
+// take a thread off the sleep list before its time is up, the thread
+// behind it inherits its delta; a stale TIMER4 deadline is harmless
+// must be called with interrupts disabled
+static void SleepRemove(tcbType *t){
+  tcbType **pt = &SleepList;
+  while(*pt && *pt != t)
+    pt = &(*pt)->sNext;
+  if(*pt){
+    if(t->sNext)
+      t->sNext->sleep += t->sleep;
+    *pt = t->sNext;
+  }
+  t->sNext = 0;
+  t->sleep = 0;
+  t->asleep = 0;
+}
+
+// ******** WakeSleepers ************
+// move every thread at the head of the sleep list whose time is up
+// back onto its ready list, each tick costs O(1) plus one per wake up
+// a thread that is also blocked was in a timed wait, it leaves the
+// semaphore with timedOut set
+// must be called with interrupts disabled
+static void WakeSleepers(void) {
+  while(SleepList && SleepList->sleep <= 0){
+    tcbType *t = SleepList;
+    SleepList = t->sNext;
+    t->sNext = 0;
+    t->sleep = 0;
+    t->asleep = 0;
+    if(t->blocked){
+      //a timed wait ran out
+      SemaRemove(t->waitSema, t);
+      t->blocked = 0;
+      t->waitSema = 0;
+      t->timedOut = 1;
+      #if TRACE
+      TraceThread(TRACE_UNBLOCK, t->id, 0);
+      #endif
+    }
+    ReadyAdd(t);
+    if(t->pri < RunPt->pri)
+      TRIGGER_PENDSV();
+  }
+}
+
 void Timer4A_Handler(void){
-  TIMER4_ICR_R = TIMER_ICR_TATOCINT; //acknowledge interrupt
+  unsigned long isrStart = OS_IsrStart(70);
   int32_t status; status = StartCritical();
-  sysTime++;
-  #if DEBUG
-  MasterTime++;
+  TIMER4_ICR_R = TIMER_ICR_TATOCINT; //acknowledge interrupt
+  if(isrStart < TimeLast)
+    TimeHigh += 0x100000000ULL;   // the cycle counter wrapped
+  TimeLast = isrStart;
+  TimeSeq++;
+  //at least one charge a second keeps run times from wrapping
+  //when a thread runs alone with time slicing off
+  if(IsrNest == 1)
+    CpuCharge(isrStart);
+  #if TICKLESS
+  TicksAvoided += TickPeriod - 1;
+  #endif
+  if(SleepList){
+    SleepList->sleep -= TickPeriod;
+    WakeSleepers();
+  }
+  #if TICKLESS
+  //next interrupt at the earliest sleep deadline
+  uint32_t next = SleepList ? SleepList->sleep : TICKLESS_MAX_MS;
+  if(next > TICKLESS_MAX_MS)
+    next = TICKLESS_MAX_MS;
+  if(next < 1)
+    next = 1;
+  if(next != TickPeriod)
+    SetTickPeriod(next);
   #endif
-  tcbType *t;
-  for(t = RunPt; t->next != RunPt; t = t->next)
-      if(t->sleep > 0)
-          t->sleep--;
-  if(t->sleep > 0)
-      t->sleep--;
   EndCritical(status);
+  OS_IsrEnd(70, isrStart);
 }
 
 unsigned long OS_Id(void){
   return RunPt->id;
 }
 
+/* PERIODIC */
+// All background periodic tasks share TIMER3, which runs in one-shot mode.
+// The tasks sit in a release queue sorted by next release time, ties going
+// to the higher priority (lower number) task. Timer3A_Handler runs every
+// task that is due, pushes it one period forward, and reprograms TIMER3 for
+// whatever is at the head of the queue. Release times are kept in OS_Time
+// units and always compared as signed differences so they survive wrap.
+// TIMER3 runs at the NVIC priority of the most urgent task added so far.
+#define MAXPERIODIC 10
+#define PERIODIC_MIN_DELAY 80         // 1us, never arm TIMER3 closer than this
+
+typedef struct ptask {
+  void (*task)(void);
+  unsigned long period;               // 12.5ns units
+  unsigned long release;              // next release time, OS_Time units
+  unsigned long pri;
+  struct ptask *next;                 // release queue, earliest first
+  unsigned long runs;
+  unsigned long overruns;             // releases skipped because we fell a period behind
+  JitterProbeType probe;              // release to release jitter
+  unsigned long wcet;                 // declared worst case execution time, 12.5ns units
+  unsigned long maxExec;              // longest run measured so far, 12.5ns units
+} ptaskType;
+
+static ptaskType PeriodicTasks[MAXPERIODIC];
+static const char *const PeriodicNames[MAXPERIODIC] = {
+  "periodic 0", "periodic 1", "periodic 2", "periodic 3", "periodic 4",
+  "periodic 5", "periodic 6", "periodic 7", "periodic 8", "periodic 9"
+};
+static int NumPeriodic = 0;
+static ptaskType *ReleaseList = 0;
+static unsigned long PeriodicPri = 7;
+
+static void Timer3_Init(void){
+  SYSCTL_RCGCTIMER_R |= 0x08;   // 0) activate TIMER3
+  (void)SYSCTL_RCGCTIMER_R;     // allow time for clock to start
+  TIMER3_CTL_R = 0x00000000;    // 1) disable TIMER3A during setup
+  TIMER3_CFG_R = 0x00000000;    // 2) configure for 32-bit mode
+  TIMER3_TAMR_R = 0x00000001;   // 3) configure for one-shot mode, default down-count settings
+  TIMER3_TAPR_R = 0;            // 5) bus clock resolution
+  TIMER3_ICR_R = 0x00000001;    // 6) clear TIMER3A timeout flag
+  TIMER3_IMR_R = 0x00000001;    // 7) arm timeout interrupt
+	NVIC_PRI8_R = (NVIC_PRI8_R&0x00FFFFFF)|(PeriodicPri<<29); // 0x80000000/4 = 2^29
+// interrupts enabled in the main program after all devices initialized
+// vector number 51, interrupt number 35
+  NVIC_EN1_R |= 1<<(35-32);      // 9) enable IRQ 35 in NVIC
+}
+
+// Insert t into the release queue. Called with interrupts disabled or from
+// Timer3A_Handler.
+static void ReleaseInsert(ptaskType *t){
+  ptaskType **pp = &ReleaseList;
+  while(*pp && ((long)((*pp)->release - t->release) < 0 ||
+               ((*pp)->release == t->release && (*pp)->pri <= t->pri))){
+    pp = &(*pp)->next;
+  }
+  t->next = *pp;
+  *pp = t;
+}
+
+// Program TIMER3 to fire at the release time of the head of the queue.
+static void PeriodicArm(void){
+  long delay;
+  TIMER3_CTL_R = 0x00000000;
+  if(ReleaseList == 0) return;
+  delay = (long)(ReleaseList->release - OS_Time());
+  if(delay < PERIODIC_MIN_DELAY){
+    delay = PERIODIC_MIN_DELAY;
+  }
+  TIMER3_TAILR_R = delay-1;
+  TIMER3_TAV_R = delay-1;
+  TIMER3_CTL_R = 0x00000001;
+}
+
+// Run one task and record how long it ran and how far its start drifted
+// from one period after the previous start.
+static void PeriodicRun(ptaskType *t){
+  unsigned long start = OS_Time();
+  unsigned long deltaT;
+  Jitter_Mark(&t->probe);
+  OS_Trace(TRACE_PERIODIC_START, t - PeriodicTasks);
+  (*t->task)();                      // execute user task
+  OS_Trace(TRACE_PERIODIC_STOP, t - PeriodicTasks);
+  deltaT = OS_TimeDifference(start, OS_Time());
+  if(deltaT > t->maxExec)
+    t->maxExec = deltaT;
+  t->runs++;
+}
+
+/* ADMISSION */
+// Utilizations are fixed point fractions of the CPU, UTIL_ONE is 100%.
+// A task is charged the larger of its declared WCET and the longest run
+// measured by PeriodicRun, so an optimistic declaration gets corrected as
+// soon as the task has run for a while. RMBound[n] is the Liu and Layland
+// bound n(2^(1/n)-1) for n tasks.
+#define UTIL_ONE 65536
+#if ADMISSION == SCHED_RM
+static const unsigned long RMBound[MAXPERIODIC+1] = {
+  0, 65536, 54292, 51103, 49600, 48725, 48154, 47751, 47452, 47221, 47037
+};
+#endif
+
+static unsigned long TaskUtil(unsigned long wcet, unsigned long period){
+  return (unsigned long)(((unsigned long long)wcet*UTIL_ONE)/period);
+}
+
+static unsigned long PeriodicUtil(void){
+  unsigned long total = 0;
+  int n;
+  for(n = 0; n < NumPeriodic; n++){
+    ptaskType *t = &PeriodicTasks[n];
+    total += TaskUtil(t->maxExec > t->wcet ? t->maxExec : t->wcet, t->period);
+  }
+  return total;
+}
+
+// Would the periodic task set still be schedulable with one more task?
+// Called with interrupts disabled.
+static int Admit(unsigned long wcet, unsigned long period){
+#if ADMISSION == SCHED_RM
+  return PeriodicUtil() + TaskUtil(wcet, period) <= RMBound[NumPeriodic+1];
+#elif ADMISSION == SCHED_EDF
+  return PeriodicUtil() + TaskUtil(wcet, period) <= UTIL_ONE;
+#else
+  return 1;
+#endif
+}
+
+//******** OS_Utilization ***************
+// CPU share claimed by the periodic tasks
+// Inputs:  none
+// Outputs: utilization, UTIL_ONE (65536) is 100%
+unsigned long OS_Utilization(void){
+  unsigned long total;
+  int32_t status = StartCritical();
+  total = PeriodicUtil();
+  EndCritical(status);
+  return total;
+}
+
 //******** OS_AddPeriodicThread *************** 
 // add a background periodic task
 // typically this function receives the highest priority
@@ -488,131 +1234,98 @@ unsigned long OS_Id(void){
 // In lab 3, this command will be called 0 1 or 2 times
 // In lab 3, there will be up to four background threads, and this priority field 
 //           determines the relative priority of these four threads
-
-int PeriodicTaskPeriod1;
-int PeriodicTaskPeriod2;
-void(*PeriodicTask1)(void);
-void(*PeriodicTask2)(void);
-
-#if DEBUG
-void PeriodicTaskWrapper1() {
-  time21 = OS_Time();
-  (*PeriodicTask1)();                // execute user task
-  if(time11 != 0) {
-      unsigned long deltaT = OS_TimeDifference(time11, time21);
-      unsigned long jitter;
-
-      if(deltaT>PeriodicTaskPeriod1)
-        jitter = (deltaT-PeriodicTaskPeriod1+4)/8;  // in 0.1 usec
-      else
-        jitter = (PeriodicTaskPeriod1-deltaT+4)/8;  // in 0.1 usec
-      if(jitter > MaxJitter1)
-        MaxJitter1 = jitter; // in usec
-      if(MaxJitter1 > MaxJitter)
-          MaxJitter = MaxJitter1;
-      if(jitter >= JitterSize1)
-        jitter = JITTERSIZE-1;
-      JitterHistogram1[jitter]++;
-  }
-  time11 = time21;
-}
-#endif
-
-#if DEBUG
-void PeriodicTaskWrapper2() {
-  time22 = OS_Time();
-  (*PeriodicTask2)();                // execute user task
-  if(time12 != 0) {
-      unsigned long deltaT = OS_TimeDifference(time12, time22);
-      unsigned long jitter;
-
-      if(deltaT>PeriodicTaskPeriod2)
-        jitter = (deltaT-PeriodicTaskPeriod2+4)/8;  // in 0.1 usec
-      else
-        jitter = (PeriodicTaskPeriod2-deltaT+4)/8;  // in 0.1 usec
-      if(jitter > MaxJitter2)
-        MaxJitter2 = jitter; // in usec
-      if(MaxJitter2 > MaxJitter)
-        MaxJitter = MaxJitter2; // in usec
-      if(jitter >= JitterSize2)
-        jitter = JITTERSIZE-1;
-      JitterHistogram2[jitter]++;
-  }
-  time12 = time22;
-}
-#endif
-
-void Timer3_Init(unsigned long period, unsigned long priority){
-  SYSCTL_RCGCTIMER_R |= 0x08;   // 0) activate TIMER3
-  volatile int delay = SYSCTL_RCGCTIMER_R;
-  TIMER3_CTL_R = 0x00000000;    // 1) disable TIMER3A during setup
-  TIMER3_CFG_R = 0x00000000;    // 2) configure for 32-bit mode
-  TIMER3_TAMR_R = 0x00000002;   // 3) configure for periodic mode, default down-count settings
-  TIMER3_TAILR_R = period-1;    // 4) reload value
-  TIMER3_TAPR_R = 0;            // 5) bus clock resolution
-  TIMER3_ICR_R = 0x00000001;    // 6) clear TIMER3A timeout flag
-  TIMER3_IMR_R = 0x00000001;    // 7) arm timeout interrupt
-	NVIC_PRI8_R = (NVIC_PRI8_R&0x00FFFFFF)|(priority<<29); // 0x80000000/4 = 2^29
-// interrupts enabled in the main program after all devices initialized
-// vector number 51, interrupt number 35
-  NVIC_EN1_R |= 1<<(35-32);      // 9) enable IRQ 35 in NVIC
-}
-
-static void Timer5_Init(unsigned long period, unsigned long priority){
-  SYSCTL_RCGCTIMER_R |= 0x20;   // 0) activate TIMER5
-  volatile int delay = SYSCTL_RCGCTIMER_R;
-  TIMER5_CTL_R = 0x00000000;    // 1) disable TIMER4A during setup
-  TIMER5_CFG_R = 0x00000000;    // 2) configure for 32-bit mode
-  TIMER5_TAMR_R = 0x00000002;   // 3) configure for periodic mode, default down-count settings
-  TIMER5_TAILR_R = period-1;    // 4) reload value
-  TIMER5_TAPR_R = 0;            // 5) bus clock resolution
-  TIMER5_ICR_R = 0x00000001;    // 6) clear TIMER4 timeout flag
-  TIMER5_IMR_R = 0x00000001;    // 7) arm timeout interrupt
-	NVIC_PRI23_R = (NVIC_PRI23_R&0xFFFFFF00)|(priority<<5); //23 = 92/4, 5 = (92%4)*8+5
-// interrupts enabled in the main program after all devices initialized
-  NVIC_EN2_R |= 1<<(92%32);      // 9) enable IRQ 108/92 in NVIC; 2 = 92/32 = 2, 2*32 = 64; 70 = 86 - 16
+int OS_AddPeriodicThread(void(*task)(void),unsigned long period, unsigned long priority){
+  return OS_AddPeriodicThreadWCET(task, period, 0, priority);
 }
 
-int OS_AddPeriodicThread(void(*task)(void),unsigned long period, unsigned long priority){
-  if(PeriodicTask1 == 0){
-    PeriodicTask1 = task;          // user function
-    Timer3_Init(period, priority);
-    PeriodicTaskPeriod1 = period;
-    TIMER3_CTL_R = 0x00000001;    // 10) enable TIMER3A
+//******** OS_AddPeriodicThreadWCET ***************
+// add a background periodic task with a declared worst case execution time
+// the task is rejected if the periodic task set would fail the ADMISSION test
+// Inputs: pointer to a void/void background function
+//         period and wcet given in system time units (12.5ns)
+//         priority 0 is the highest, 7 is the lowest
+// Outputs: 1 if successful, 0 if this thread can not be added
+int OS_AddPeriodicThreadWCET(void(*task)(void),unsigned long period,
+  unsigned long wcet, unsigned long priority){
+  ptaskType *t;
+  int32_t status;
+  if(task == 0 || period < PERIODIC_MIN_DELAY || priority > 7 || wcet > period){
     return 0;
-  } else if(PeriodicTask2 == 0){
-    PeriodicTask2 = task;
-    Timer5_Init(period, priority);
-    PeriodicTaskPeriod2 = period;
-    TIMER5_CTL_R = 0x00000001;    // 10) enable TIMER3A
+  }
+  status = StartCritical();
+  if(NumPeriodic >= MAXPERIODIC || !Admit(wcet, period)){
+    EndCritical(status);
     return 0;
-  } else {
-    return 1;
   }
+  if(NumPeriodic == 0 || priority < PeriodicPri){
+    PeriodicPri = priority;
+    if(NumPeriodic == 0)
+      Timer3_Init();
+    else
+      NVIC_PRI8_R = (NVIC_PRI8_R&0x00FFFFFF)|(PeriodicPri<<29);
+  }
+  t = &PeriodicTasks[NumPeriodic++];
+  t->task = task;
+  t->period = period;
+  t->pri = priority;
+  t->runs = 0;
+  t->overruns = 0;
+  Jitter_Add(&t->probe, PeriodicNames[t - PeriodicTasks], period);
+  t->wcet = wcet;
+  t->maxExec = 0;
+  t->release = OS_Time() + period;
+  ReleaseInsert(t);
+  if(ReleaseList == t){
+    PeriodicArm();
+  }
+  EndCritical(status);
+  return 1;
 }
 
 void Timer3A_Handler(void){
+  ptaskType *t;
+  unsigned long now;
   TIMER3_ICR_R = TIMER_ICR_TATOCINT;// acknowledge TIMER3A timeout
-  #if DEBUG
-  addTInfo(pStart);
-  PeriodicTaskWrapper1();
-  addTInfo(pStop);
-  #else
-  (*PeriodicTask1)();                // execute user task
-  #endif
+  unsigned long isrStart = OS_IsrStart(35);
+  now = OS_Time();
+  while(ReleaseList && (long)(ReleaseList->release - now) <= 0){
+    t = ReleaseList;
+    ReleaseList = t->next;
+    PeriodicRun(t);
+    now = OS_Time();
+    t->release += t->period;
+    if((long)(t->release - now) < -(long)t->period){
+      t->overruns++;                 // don't try to catch up on a backlog
+      t->release = now + t->period;
+    }
+    ReleaseInsert(t);
+  }
+  PeriodicArm();
+  OS_IsrEnd(35, isrStart);
 }
-/*
-void Timer5A_Handler(void){
-  TIMER5_ICR_R = TIMER_ICR_TATOCINT;// acknowledge TIMER5A timeout
-  #if DEBUG
-  addTInfo(pStart);
-  PeriodicTaskWrapper2();
-  addTInfo(pStop);
-  #else
-  (*PeriodicTask2)();                // execute user task
-  #endif
+
+//******** OS_PeriodicInfo ***************
+// Copy out scheduling and jitter data for one periodic task
+// Inputs:  n index of the task, 0 is the first one added
+//          info where to put the data
+// Outputs: 1 if the task exists, 0 otherwise
+int OS_PeriodicInfo(int n, periodicInfoType *info){
+  ptaskType *t;
+  int32_t status;
+  if(n < 0 || n >= NumPeriodic) return 0;
+  t = &PeriodicTasks[n];
+  status = StartCritical();
+  info->task = t->task;
+  info->period = t->period;
+  info->pri = t->pri;
+  info->runs = t->runs;
+  info->overruns = t->overruns;
+  info->maxJitter = (t->probe.max+4)/8;  // in 0.1 usec
+  info->wcet = t->wcet;
+  info->maxExec = t->maxExec;
+  EndCritical(status);
+  return 1;
 }
-*/
 
 //******** OS_AddSW1Task *************** 
 // add a background task to run whenever the SW1 (PF4) button is pushed
@@ -679,12 +1392,11 @@ int OS_AddSW2Task(void(*task)(void), unsigned long priority){
 }
 
 void GPIOPortF_Handler(void){
+  unsigned long isrStart = OS_IsrStart(30);
   if(GPIO_PORTF_MIS_R & 0x10) {
     GPIO_PORTF_ICR_R = 0x10;
     if(SW1Task != NULL) {
-      SW1Task();
-      //2 trigger pendsv
-      NVIC_INT_CTRL_R |= 0x10000000;
+      SW1Task();   // its OS calls ask for a switch if one is needed
     }
   }
   //OS_AddThread(&SW1TaskWrapper, 128 , SW1TaskPri);
@@ -693,68 +1405,278 @@ void GPIOPortF_Handler(void){
     GPIO_PORTF_ICR_R = 0x01;
     if(SW2Task != NULL) {
       SW2Task();
-      //2 trigger pendsv
-      NVIC_INT_CTRL_R |= 0x10000000;
     }
   }
+  OS_IsrEnd(30, isrStart);
 }
 
 void OS_InitSemaphore(Sema4Type *semaPt, long value) {
   if(semaPt != NULL) {
     semaPt->Value = value;
     semaPt->next = NULL;
+    semaPt->tail = NULL;
   }
 }
 
+// ******** OS_FifoCreate ************
+// allocate a FIFO from the heap, size is rounded up to a power of 2
+OSFifoType *OS_FifoCreate(unsigned long size, unsigned long elemSize){
+  OSFifoType *f;
+  unsigned long n = 1;
+  int32_t status;
+  if(size == 0 || elemSize == 0) return 0;
+  while(n < size) n <<= 1;
+  status = StartCritical();
+  f = Heap_Malloc(sizeof(OSFifoType) + n*elemSize);
+  EndCritical(status);
+  if(f == 0) return 0;
+  f->buf = (uint8_t *)(f + 1);
+  f->mask = n - 1;
+  f->elemSize = elemSize;
+  f->putI = 0;
+  f->getI = 0;
+  OS_InitSemaphore(&f->getters, -1);
+  OS_InitSemaphore(&f->putters, -1);
+  return f;
+}
+
+// ******** OS_FifoDestroy ************
+// give a FIFO back to the heap, refused while threads wait on it
+int OS_FifoDestroy(OSFifoType *f){
+  int32_t status = StartCritical();
+  if(f->getters.next || f->putters.next){
+    EndCritical(status);
+    return 0;
+  }
+  Heap_Free(f);
+  EndCritical(status);
+  return 1;
+}
+
+// copy up to n elements into the ring, returns the number copied
+// must be called with interrupts disabled
+static unsigned long FifoIn(OSFifoType *f, const uint8_t *src, unsigned long n){
+  unsigned long room = f->mask + 1 - (f->putI - f->getI);
+  unsigned long at = f->putI & f->mask;
+  unsigned long first;
+  if(n > room) n = room;
+  first = f->mask + 1 - at;         // elements before the ring wraps
+  if(first > n) first = n;
+  memcpy(f->buf + at*f->elemSize, src, first*f->elemSize);
+  memcpy(f->buf, src + first*f->elemSize, (n - first)*f->elemSize);
+  f->putI += n;
+  return n;
+}
+
+// copy up to n elements out of the ring, returns the number copied
+// must be called with interrupts disabled
+static unsigned long FifoOut(OSFifoType *f, uint8_t *dst, unsigned long n){
+  unsigned long count = f->putI - f->getI;
+  unsigned long at = f->getI & f->mask;
+  unsigned long first;
+  if(n > count) n = count;
+  first = f->mask + 1 - at;
+  if(first > n) first = n;
+  memcpy(dst, f->buf + at*f->elemSize, first*f->elemSize);
+  memcpy(dst + first*f->elemSize, f->buf, (n - first)*f->elemSize);
+  f->getI += n;
+  return n;
+}
+
+// release the first thread on a wait list, if any
+static void FifoWake(Sema4Type *waiters){
+  tcbType *t = SemaDequeue(waiters);
+  if(t)
+    WakeThread(t);
+}
+
+// Block until at least one element moves or ms runs out. A woken thread
+// passes the baton on if there is still data (or room) left over, so one
+// big batch can satisfy several waiters.
+unsigned long OS_FifoPutBatch(OSFifoType *f, const void *src, unsigned long n, unsigned long ms){
+  unsigned long moved, start = 0;
+  int32_t status = StartCritical();
+  if(ms != 0 && ms != OS_WAIT_FOREVER)
+    start = OS_MsTime();
+  while((moved = FifoIn(f, src, n)) == 0 && n != 0 && ms != 0){
+    unsigned long left = ms;
+    if(ms != OS_WAIT_FOREVER){
+      unsigned long used = OS_MsTime() - start;
+      if(used >= ms) break;
+      left = ms - used;
+    }
+    BlockThreadTimed(&f->putters, left);
+    EndCritical(status);            // switch out until a getter makes room
+    status = StartCritical();
+    if(RunPt->timedOut) break;
+  }
+  if(moved)
+    FifoWake(&f->getters);
+  if(f->putI - f->getI <= f->mask)
+    FifoWake(&f->putters);
+  EndCritical(status);
+  return moved;
+}
+
+unsigned long OS_FifoGetBatch(OSFifoType *f, void *dst, unsigned long n, unsigned long ms){
+  unsigned long moved, start = 0;
+  int32_t status = StartCritical();
+  if(ms != 0 && ms != OS_WAIT_FOREVER)
+    start = OS_MsTime();
+  while((moved = FifoOut(f, dst, n)) == 0 && n != 0 && ms != 0){
+    unsigned long left = ms;
+    if(ms != OS_WAIT_FOREVER){
+      unsigned long used = OS_MsTime() - start;
+      if(used >= ms) break;
+      left = ms - used;
+    }
+    BlockThreadTimed(&f->getters, left);
+    EndCritical(status);            // switch out until a putter brings data
+    status = StartCritical();
+    if(RunPt->timedOut) break;
+  }
+  if(moved)
+    FifoWake(&f->putters);
+  if(f->putI != f->getI)
+    FifoWake(&f->getters);
+  EndCritical(status);
+  return moved;
+}
+
+int OS_FifoPut(OSFifoType *f, const void *elem, unsigned long ms){
+  return OS_FifoPutBatch(f, elem, 1, ms) == 1;
+}
+
+int OS_FifoGet(OSFifoType *f, void *elem, unsigned long ms){
+  return OS_FifoGetBatch(f, elem, 1, ms) == 1;
+}
+
+long OS_FifoSize(OSFifoType *f){
+  return f->putI - f->getI;
+}
+
 void OS_Fifo_Init(unsigned long size){
-  OS_InitSemaphore(&fifoEmpty, -1);
-  OSFifo_Init();
+  if(OSFifo && !OS_FifoDestroy(OSFifo))
+    return;                          // threads still wait on the old one
+  OSFifo = OS_FifoCreate(size, sizeof(unsigned long));
 }
 
 int OS_Fifo_Put(unsigned long data) {
-  int ret;
-  long sav = StartCritical();
-  ret = OSFifo_Put(data);
-  EndCritical(sav);
-  return ret;
+  return OS_FifoPut(OSFifo, &data, 0);
 }
 
 unsigned long OS_Fifo_Get(void) {
   unsigned long ret;
-  long sav = StartCritical();
-  OSFifo_Get(&ret);
-  EndCritical(sav);
+  OS_FifoGet(OSFifo, &ret, OS_WAIT_FOREVER);
   return ret;
 }
 
 long OS_Fifo_Size(void) {
-  return OSFifo_Size();
+  return OS_FifoSize(OSFifo);
+}
+
+// ******** OS_QueueCreate ************
+// allocate a queue of depth slots from the heap, all slots start free
+OSQueueType *OS_QueueCreate(unsigned long depth, unsigned long msgSize){
+  OSQueueType *q;
+  uint8_t *slot;
+  int32_t status;
+  unsigned long i;
+  if(depth == 0 || msgSize == 0) return 0;
+  msgSize = (msgSize + 3) & ~3;      // keep every slot word aligned
+  status = StartCritical();
+  q = Heap_Malloc(sizeof(OSQueueType) + depth*msgSize);
+  EndCritical(status);
+  if(q == 0) return 0;
+  q->msgSize = msgSize;
+  q->freeSlots = OS_FifoCreate(depth, sizeof(void *));
+  q->mail = OS_FifoCreate(depth, sizeof(void *));
+  if(q->freeSlots == 0 || q->mail == 0){
+    OS_QueueDestroy(q);
+    return 0;
+  }
+  slot = (uint8_t *)(q + 1);
+  for(i = 0; i < depth; i++, slot += msgSize)
+    OS_FifoPut(q->freeSlots, &slot, 0);
+  return q;
+}
+
+// ******** OS_QueueDestroy ************
+// give a queue and its slots back to the heap
+int OS_QueueDestroy(OSQueueType *q){
+  int32_t status = StartCritical();
+  if((q->freeSlots && (q->freeSlots->getters.next || q->freeSlots->putters.next)) ||
+     (q->mail && (q->mail->getters.next || q->mail->putters.next))){
+    EndCritical(status);
+    return 0;
+  }
+  if(q->freeSlots)
+    OS_FifoDestroy(q->freeSlots);
+  if(q->mail)
+    OS_FifoDestroy(q->mail);
+  Heap_Free(q);
+  EndCritical(status);
+  return 1;
+}
+
+void *OS_QueueAlloc(OSQueueType *q, unsigned long ms){
+  void *msg;
+  if(!OS_FifoGet(q->freeSlots, &msg, ms))
+    return 0;
+  return msg;
+}
+
+void OS_QueuePost(OSQueueType *q, void *msg){
+  OS_FifoPut(q->mail, &msg, 0);
+}
+
+void *OS_QueuePend(OSQueueType *q, unsigned long ms){
+  void *msg;
+  if(!OS_FifoGet(q->mail, &msg, ms))
+    return 0;
+  return msg;
+}
+
+void OS_QueueFree(OSQueueType *q, void *msg){
+  OS_FifoPut(q->freeSlots, &msg, 0);
+}
+
+int OS_QueueSend(OSQueueType *q, const void *msg, unsigned long ms){
+  void *slot = OS_QueueAlloc(q, ms);
+  if(slot == 0)
+    return 0;
+  memcpy(slot, msg, q->msgSize);
+  OS_QueuePost(q, slot);
+  return 1;
+}
+
+int OS_QueueRecv(OSQueueType *q, void *msg, unsigned long ms){
+  void *slot = OS_QueuePend(q, ms);
+  if(slot == 0)
+    return 0;
+  memcpy(msg, slot, q->msgSize);
+  OS_QueueFree(q, slot);
+  return 1;
+}
+
+long OS_QueueSize(OSQueueType *q){
+  return OS_FifoSize(q->mail);
 }
 
 void OS_MailBox_Init(void) {
-    OS_InitSemaphore(&mailPost, -1);
-    OS_InitSemaphore(&mailRecv, 0);
-    OS_InitSemaphore(&mailLock, 0);
+  if(MailBox)
+    OS_QueueDestroy(MailBox);
+  MailBox = OS_QueueCreate(1, sizeof(unsigned long));
 }
 
 void OS_MailBox_Send(unsigned long data) {
-    OS_bWait(&mailRecv);
-    OS_bWait(&mailLock);
-    Mail = data;
-    OS_bSignal(&mailLock);
-    OS_bSignal(&mailPost);
+  OS_QueueSend(MailBox, &data, OS_WAIT_FOREVER);
 }
 
 unsigned long OS_MailBox_Recv(void) {
-    unsigned long ret;
-
-    OS_bWait(&mailPost);
-    OS_bWait(&mailLock);
-    ret = Mail;
-    OS_bSignal(&mailLock);
-    OS_bSignal(&mailRecv);
-
-    return ret;
+  unsigned long ret;
+  OS_QueueRecv(MailBox, &ret, OS_WAIT_FOREVER);
+  return ret;
 }
 
 // ******** OS_Time ************
@@ -765,18 +1687,35 @@ unsigned long OS_MailBox_Recv(void) {
 // It is ok to change the resolution and precision of this function as long as 
 //   this function and OS_TimeDifference have the same resolution and precision 
 unsigned long OS_Time(void){
-  unsigned long value; int32_t status;
-  status = StartCritical();
-  value = TIMER4_TAILR_R - TIMER4_TAV_R + sysTime*TIME_1MS;
-  EndCritical(status);
-  return value;
+  return (unsigned long)OS_Time64();
 }
 
-#if DEBUG
-static unsigned long GetMasterTime(void) {
-    return TIMER4_TAILR_R - TIMER4_TAV_R + MasterTime*TIME_1MS;
+uint64_t OS_Time64(void){
+  uint32_t seq, last, now;
+  uint64_t high;
+  do {
+    seq = TimeSeq;
+    high = TimeHigh;
+    last = TimeLast;
+    now = DWT_CYCCNT_R;
+  } while(seq != TimeSeq);
+  if(now < last)
+    high += 0x100000000ULL;       // wrapped since Timer4A_Handler looked
+  return high + now;
 }
-#endif
+
+uint64_t OS_TimeToUs(uint64_t time){
+  return time/(TIME_1MS/1000);
+}
+
+uint64_t OS_TimeToNs(uint64_t time){
+  return time*25/2;           // 12.5 ns per count at 80 MHz
+}
+
+uint64_t OS_UsToTime(uint64_t us){
+  return us*(TIME_1MS/1000);
+}
+
 
 // ******** OS_TimeDifference ************
 // Calculates difference between two times
@@ -789,6 +1728,14 @@ unsigned long OS_TimeDifference(unsigned long start, unsigned long stop){
   return stop - start;
 }
 
+long OS_TimeDelta(unsigned long start, unsigned long stop){
+  return (long)(stop - start);
+}
+
+uint64_t OS_TimeDifference64(uint64_t start, uint64_t stop){
+  return stop - start;
+}
+
 // ******** OS_ClearMsTime ************
 // sets the system time to zero (from Lab 1)
 // Inputs:  none
@@ -796,10 +1743,75 @@ unsigned long OS_TimeDifference(unsigned long start, unsigned long stop){
 // You are free to change how this works
 void OS_ClearMsTime(void){
   int32_t status; status = StartCritical();
-  sysTime = 0;
+  MsZero = OS_Time64();
+  EndCritical(status);
+}
+
+unsigned long OS_TicksAvoided(void){
+  return TicksAvoided;
+}
+
+void OS_SwitchStats(switchStatsType *stats){
+  int32_t status; status = StartCritical();
+  stats->requested = SwitchesRequested;
+  stats->passes = SchedulerPasses;
+  stats->taken = SwitchesTaken;
   EndCritical(status);
 }
 
+#if TRACE
+static void TraceThread(unsigned long event, unsigned long id, unsigned long arg){
+  traceRecordType *r;
+  int32_t status = StartCritical();
+  if(TraceOn){
+    r = &TraceBuf[TraceI++ & (TRACE_SIZE-1)];
+    r->time = DWT_CYCCNT_R;
+    r->id = id;
+    r->event = event;
+    r->arg = arg;
+  }
+  EndCritical(status);
+}
+
+void OS_Trace(unsigned long event, unsigned long arg){
+  TraceThread(event, RunPt ? RunPt->id : 0, arg);
+}
+
+static void TraceOutWord(uint32_t n, int bytes){
+  while(bytes--){
+    UART_OutChar(n & 0xFF);
+    n >>= 8;
+  }
+}
+
+void OS_TraceDump(void){
+  uint32_t i, count;
+  traceRecordType *r;
+  TraceOn = 0;
+  count = TraceI < TRACE_SIZE ? TraceI : TRACE_SIZE;
+  UART_OutString("TRCE");
+  TraceOutWord(count, 4);
+  TraceOutWord(80000000, 4);
+  for(i = TraceI - count; i != TraceI; i++){
+    r = &TraceBuf[i & (TRACE_SIZE-1)];
+    TraceOutWord(r->time, 4);
+    TraceOutWord(r->id, 2);
+    TraceOutWord(r->event, 1);
+    TraceOutWord(r->arg, 1);
+  }
+  TraceOn = 1;
+}
+
+void OS_TraceClear(void){
+  int32_t status = StartCritical();
+  TraceI = 0;
+  EndCritical(status);
+}
+#else
+void OS_TraceDump(void){}
+void OS_TraceClear(void){}
+#endif
+
 #if DEBUG
 int OS_MaxTimeIntsDisabled(void) {
     return MaxTimeIntsDisabled;
@@ -810,7 +1822,71 @@ int OS_TimeIntsDisabled(void) {
 }
 
 int OS_PercentIntsDisabled(void) {
-    return PercentIntsDisabled;
+    uint64_t elapsed = (uint64_t)(OS_MsTime() - CritSinceMs)*TIME_1MS;
+    return elapsed ? (int)(TimeIntsDisabled*100/elapsed) : 0;
+}
+
+// charge a finished critical section to its call site
+// called with interrupts still disabled
+static void CritRecord(unsigned long site, unsigned long cycles){
+  unsigned long k, b;
+  critSiteType *c;
+  if(cycles > MaxTimeIntsDisabled)
+    MaxTimeIntsDisabled = cycles;
+  TimeIntsDisabled += cycles;
+  for(k = 0; k < CRITSITES; k++){
+    c = &CritStats[((site >> 1) + k) & (CRITSITES-1)];
+    if(c->site == site || c->site == 0)
+      break;
+  }
+  if(k == CRITSITES){
+    CritDropped++;
+    return;
+  }
+  c->site = site;
+  c->count++;
+  c->total += cycles;
+  if(cycles > c->max)
+    c->max = cycles;
+  b = cycles ? 32 - __clz(cycles) : 0;
+  if(b >= CRIT_BUCKETS)
+    b = CRIT_BUCKETS-1;
+  c->histogram[b]++;
+}
+
+int OS_CritSite(int rank, critSiteType *info){
+  critSiteType *c;
+  int k, n, better;
+  long sav = StartCriticalAsm();
+  // the rank-th worst is the site with exactly rank sites ahead of it,
+  // ordered by max and then by address so there are no ties
+  for(k = 0; k < CRITSITES; k++){
+    c = &CritStats[k];
+    if(c->site == 0)
+      continue;
+    for(better = 0, n = 0; n < CRITSITES; n++){
+      critSiteType *o = &CritStats[n];
+      if(o->site && (o->max > c->max || (o->max == c->max && o->site < c->site)))
+        better++;
+    }
+    if(better == rank){
+      *info = *c;
+      EndCriticalAsm(sav);
+      return 1;
+    }
+  }
+  EndCriticalAsm(sav);
+  return 0;
+}
+
+void OS_CritReset(void){
+  long sav = StartCriticalAsm();
+  memset(CritStats, 0, sizeof(CritStats));
+  CritDropped = 0;
+  MaxTimeIntsDisabled = 0;
+  TimeIntsDisabled = 0;
+  CritSinceMs = OS_MsTime();
+  EndCriticalAsm(sav);
 }
 #endif
 
@@ -821,7 +1897,11 @@ int OS_PercentIntsDisabled(void) {
 // You are free to select the time resolution for this function
 // It is ok to make the resolution to match the first call to OS_AddPeriodicThread
 unsigned long OS_MsTime(void){
-  return sysTime;
+  uint64_t zero; int32_t status;
+  status = StartCritical();       // MsZero is two words
+  zero = MsZero;
+  EndCritical(status);
+  return (unsigned long)((OS_Time64() - zero)/TIME_1MS);
 }
 
 void OS_bWait(Sema4Type *sema) {
@@ -847,156 +1927,337 @@ void OS_Wait(Sema4Type *sema) {
   EndCritical(crit);
 }
 
-void BlockThread(Sema4Type *sema) {
-  //OS_DisableInterrupts();
+// ******** SemaEnqueue ************
+// add a thread to a semaphore's wait list, highest priority first,
+// FIFO among equal priorities
+// appending at the tail is O(1), only a waiter that outranks the
+// current tail walks the list to find its place
+static void SemaEnqueue(Sema4Type *sema, tcbType *t) {
+  t->bNext = 0;
+  if(sema->tail == 0) {
+    sema->next = t;
+    sema->tail = t;
+  } else if(sema->tail->pri <= t->pri) {
+    sema->tail->bNext = t;
+    sema->tail = t;
+  } else {
+    tcbType **pt = &sema->next;
+    while((*pt)->pri <= t->pri)
+      pt = &(*pt)->bNext;
+    t->bNext = *pt;
+    *pt = t;
+  }
+}
+
+// ******** SemaDequeue ************
+// remove the highest priority waiter, 0 if there is none
+static tcbType *SemaDequeue(Sema4Type *sema) {
   tcbType *t = sema->next;
   if(t) {
-    while(t->bNext)
-      t = t->bNext;
-    t->bNext = RunPt;
-  } else {
-    sema->next = RunPt;
+    sema->next = t->bNext;
+    if(sema->next == 0)
+      sema->tail = 0;
+    t->bNext = 0;
+  }
+  return t;
+}
+
+// ******** SemaRemove ************
+// take one waiter off a semaphore's wait list, wherever it is
+static void SemaRemove(Sema4Type *sema, tcbType *t) {
+  tcbType **pt = &sema->next;
+  tcbType *prev = 0;
+  while(*pt && *pt != t) {
+    prev = *pt;
+    pt = &(*pt)->bNext;
   }
+  if(*pt) {
+    *pt = t->bNext;
+    if(sema->tail == t)
+      sema->tail = prev;
+  }
+  t->bNext = 0;
+}
+
+void BlockThread(Sema4Type *sema) {
+  if(ThreadReady(RunPt))
+    ReadyRemove(RunPt);
   RunPt->blocked = 1;
-  RunPt->bNext = 0;
+  RunPt->waitSema = sema;
+  RunPt->timedOut = 0;
+  SemaEnqueue(sema, RunPt);
+  OS_Trace(TRACE_BLOCK, 0);
   TRIGGER_PENDSV();
-  //OS_EnableInterrupts();
+}
+
+// ******** BlockThreadTimed ************
+// block on a semaphore for at most ms milliseconds, the thread is on the
+// wait list and the sleep list at once and whichever fires first wins;
+// after the switch RunPt->timedOut tells which one it was
+// must be called with interrupts disabled
+static void BlockThreadTimed(Sema4Type *sema, unsigned long ms) {
+  BlockThread(sema);
+  if(ms != OS_WAIT_FOREVER)
+    SleepInsert(RunPt, ms);
+}
+
+// ******** WakeThread ************
+// put a thread released from a semaphore back on its ready list
+// only switch if it outranks the running thread, an equal priority
+// thread gets its turn at the next time slice
+static void WakeThread(tcbType *t) {
+  t->blocked = 0;
+  t->waitSema = 0;
+  if(t->asleep)
+    SleepRemove(t);       // signalled before a timed wait ran out
+  #if TRACE
+  TraceThread(TRACE_UNBLOCK, t->id, 0);
+  #endif
+  ReadyAdd(t);
+  if(t->pri < RunPt->pri)
+    TRIGGER_PENDSV();
 }
 
 void OS_bSignal(Sema4Type *semaPt) {
   long crit = StartCritical();
-  tcbType *t = semaPt->next;
+  tcbType *t = SemaDequeue(semaPt);
   if(t != NULL) {
-    semaPt->next = semaPt->next->bNext;
-    t->bNext = 0;
-    t->blocked = 0;
+    WakeThread(t);
     semaPt->Value = -1;
   } else {
     semaPt->Value = 0;
   }
-  TRIGGER_PENDSV();
   EndCritical(crit);
 }
 
 void OS_Signal(Sema4Type *semaPt) {
   long crit = StartCritical();
-  tcbType *t = semaPt->next;
+  tcbType *t = SemaDequeue(semaPt);
   if(t != NULL) {
-    semaPt->next = semaPt->next->bNext;
-    t->bNext = 0;
-    t->blocked = 0;
+    WakeThread(t);
   } else {
     semaPt->Value++;
   }
-  TRIGGER_PENDSV();
   EndCritical(crit);
 }
 
-void UnblockThread(Sema4Type *semaPt) {
-  tcbType *t = semaPt->next;
-  if(t != NULL) {
-    semaPt->next = semaPt->next->bNext;
+/* MUTEXES */
+void OS_InitMutex(MutexType *mutexPt) {
+  mutexPt->owner = 0;
+  mutexPt->count = 0;
+  mutexPt->next = 0;
+  mutexPt->held = 0;
+}
+
+// insert a thread into a mutex's wait list, highest priority first,
+// FIFO among equal priorities
+static void MutexEnqueue(MutexType *m, tcbType *t) {
+  tcbType **pt = &m->next;
+  while(*pt && (*pt)->pri <= t->pri)
+    pt = &(*pt)->bNext;
+  t->bNext = *pt;
+  *pt = t;
+}
+
+static void MutexDequeue(MutexType *m, tcbType *t) {
+  tcbType **pt = &m->next;
+  while(*pt && *pt != t)
+    pt = &(*pt)->bNext;
+  if(*pt)
+    *pt = t->bNext;
+  t->bNext = 0;
+}
+
+// change the running priority of a thread, keeping ready lists and
+// mutex and semaphore wait lists in order
+// must be called with interrupts disabled
+static void SetPriority(tcbType *t, int32_t pri) {
+  if(t->pri == pri)
+    return;
+  if(ThreadReady(t)) {
+    ReadyRemove(t);
+    t->pri = pri;
+    ReadyAdd(t);
+  } else if(t->waitMutex) {
+    MutexDequeue(t->waitMutex, t);
+    t->pri = pri;
+    MutexEnqueue(t->waitMutex, t);
+  } else if(t->waitSema) {
+    //a mutex owner blocked on a semaphore
+    SemaRemove(t->waitSema, t);
+    t->pri = pri;
+    SemaEnqueue(t->waitSema, t);
+  } else {
+    t->pri = pri;
+  }
+}
+
+// highest priority a thread is entitled to: its own, or that of the
+// best waiter on any mutex it still owns
+static int32_t InheritedPriority(tcbType *t) {
+  int32_t pri = t->basePri;
+  for(MutexType *m = t->mutexes; m; m = m->held)
+    if(m->next && m->next->pri < pri)
+      pri = m->next->pri;
+  return pri;
+}
+
+static void MutexTake(MutexType *m, tcbType *t) {
+  m->owner = t;
+  m->count = 1;
+  m->held = t->mutexes;
+  t->mutexes = m;
+}
+
+// free a mutex its owner has taken off its own list, and hand it to
+// the highest priority waiter if there is one
+// must be called with interrupts disabled
+static void MutexHandOver(MutexType *m) {
+  tcbType *t = m->next;
+  m->held = 0;
+  m->owner = 0;
+  if(t) {
+    m->next = t->bNext;
     t->bNext = 0;
+    t->waitMutex = 0;
     t->blocked = 0;
-  } else {
-    semaPt->Value++;
+    MutexTake(m, t);
+    ReadyAdd(t);
   }
 }
 
-#if DEBUG
-void Jitter_Init(void) {
-  OS_InitSemaphore(&jitterLock, 0);
+int OS_MutexLock(MutexType *mutexPt) {
+  long crit = StartCritical();
+  if(mutexPt->owner == 0) {
+    MutexTake(mutexPt, RunPt);
+    EndCritical(crit);
+    return MUTEX_OK;
+  }
+  if(mutexPt->owner == RunPt) {
+    mutexPt->count++;
+    EndCritical(crit);
+    return MUTEX_RECURSIVE;
+  }
+  if(ThreadReady(RunPt))
+    ReadyRemove(RunPt);
+  RunPt->blocked = 1;
+  RunPt->waitMutex = mutexPt;
+  MutexEnqueue(mutexPt, RunPt);
+  //pass our priority down the chain of owners
+  for(tcbType *o = mutexPt->owner; o && o->pri > RunPt->pri;
+      o = o->waitMutex ? o->waitMutex->owner : 0)
+    SetPriority(o, RunPt->pri);
+  TRIGGER_PENDSV();
+  EndCritical(crit);
+  //OS_MutexUnlock has made this thread the owner
+  return MUTEX_OK;
 }
 
-void Jitter(void) {
-  OS_bWait(&jitterLock);
-  UART_OutStringCRLF("Periodic thread 1 jitter data:");
-  UART_OutString("Max jitter: "); UART_OutUDec(MaxJitter1); UART_OutString(" x 0.1 us"); UART_OutCRLF();
-  UART_OutStringCRLF("Jitter distribution: ");
-  for(int i = 0; i < JITTERSIZE; ++i) {
-    UART_OutString("i="); UART_OutUDec(i); UART_OutString(": ");
-    for(int j = 0; j < JitterHistogram1[i] >> 2; ++j)
-      UART_OutChar('=');
-      UART_OutChar(' '); UART_OutUDec(JitterHistogram1[i]); UART_OutCRLF();
+int OS_MutexUnlock(MutexType *mutexPt) {
+  long crit = StartCritical();
+  if(mutexPt->owner != RunPt) {
+    EndCritical(crit);
+    return MUTEX_NOT_OWNER;
+  }
+  if(--mutexPt->count > 0) {
+    EndCritical(crit);
+    return MUTEX_OK;
   }
+  //drop from the list of mutexes we own
+  for(MutexType **mp = &RunPt->mutexes; *mp; mp = &(*mp)->held)
+    if(*mp == mutexPt) {
+      *mp = mutexPt->held;
+      break;
+    }
+  MutexHandOver(mutexPt);
+  SetPriority(RunPt, InheritedPriority(RunPt));
+  if(ReadyBits && __clz(ReadyBits) < RunPt->pri)
+    TRIGGER_PENDSV();
+  EndCritical(crit);
+  return MUTEX_OK;
+}
 
-  UART_OutStringCRLF("Periodic thread 2 jitter data:");
-  UART_OutString("Max jitter: "); UART_OutUDec(MaxJitter2); UART_OutString(" x 0.1 us"); UART_OutCRLF();
-  UART_OutStringCRLF("Jitter distribution: ");
-  for(int i = 0; i < JITTERSIZE; ++i) {
-    UART_OutString("i="); UART_OutUDec(i); UART_OutString(": ");
-    for(int j = 0; j < JitterHistogram2[i] >> 2; ++j)
-      UART_OutChar('=');
-    UART_OutChar(' '); UART_OutUDec(JitterHistogram2[i]); UART_OutCRLF();
+void UnblockThread(Sema4Type *semaPt) {
+  tcbType *t = SemaDequeue(semaPt);
+  if(t != NULL) {
+    WakeThread(t);
+  } else {
+    semaPt->Value++;
   }
-  OS_bSignal(&jitterLock);
 }
-#endif
 
 void OS_DisableInterrupts(void) {
   #if DEBUG
-  if(IntsEnabled) {
-    TmpTimeIntsDisabled = GetMasterTime();
-    IntsEnabled = 0;
+  if(StartCriticalAsm() == 0) {
+    CritStart = DWT_CYCCNT_R;
+    CritSite = CALLER();
   }
-  #endif
+  #else
   DisableInterrupts();
+  #endif
 }
 
 void OS_EnableInterrupts(void) {
   #if DEBUG
-  unsigned long tmp = GetMasterTime();
-  unsigned long t = OS_TimeDifference(TmpTimeIntsDisabled, tmp);
-  TimeIntsDisabled += t;
-  if(t > MaxTimeIntsDisabled)
-    MaxTimeIntsDisabled = t;
-  PercentIntsDisabled = (TimeIntsDisabled * 100) / GetMasterTime();
-  IntsEnabled = 1;
+  if(CritSite) {
+    CritRecord(CritSite, DWT_CYCCNT_R - CritStart);
+    CritSite = 0;
+  }
   #endif
   EnableInterrupts();
 }
 
 int OS_AddProcess(void(*entry)(void), uint32_t *text, uint32_t *data, uint32_t stackSize, uint32_t priority){  
 	long sav = StartCritical();
-	pcbType *nxt, *prev;
-	for(int i = 0; i < MAXPROCS; ++i)
-		if(pcbs[i].pid == -1) {
-			nxt = &pcbs[i];
-			break;
-		}
+	pcbType *nxt, *prev = 0;
+	int added;
+	nxt = Pool_Alloc(PcbPool);
+	if(nxt == 0) {
+		EndCritical(sav);
+		return -1;               // no PCB free
+	}
   nxt->pid = ++numProcs; 
+	nxt->num_threads = 0;
 	nxt->data = data;
 	nxt->text = text;
-//	prev = ProcPt;	
+	prev = ProcPt;
   ProcPt = nxt;
-	add_thread_to_proc(entry, stackSize, priority, (int32_t*) data);
+	added = add_thread_to_proc(entry, stackSize, priority, (int32_t*) data);
 		
-	if(prev != NULL)
-		ProcPt = prev;
+	ProcPt = prev;
+	if(!added)
+		Pool_Free(PcbPool, nxt);
+	else {
+		// the loader allocated these, they belong to the process now
+		Heap_SetTag(text, HEAP_TAG(nxt->pid, currentId - 1));
+		Heap_SetTag(data, HEAP_TAG(nxt->pid, currentId - 1));
+		if(prev == NULL)
+			ProcPt = nxt;
+	}
 	EndCritical(sav);
   //JumpAsm(entry, text, data);
-  return 0;
+  return added ? 0 : -1;
 }
 
 long StartCritical(void) {
   #if DEBUG
-  if(IntsEnabled) {
-    TmpTimeIntsDisabled = GetMasterTime();
-    IntsEnabled = 0;
+  long sav = StartCriticalAsm();
+  if(sav == 0) {
+    CritStart = DWT_CYCCNT_R;
+    CritSite = CALLER();
   }
-  #endif
+  return sav;
+  #else
   return StartCriticalAsm();
+  #endif
 }
 
 void EndCritical(long sav) {
   #if DEBUG
-  unsigned long tmp = GetMasterTime();
-  unsigned long t = OS_TimeDifference(TmpTimeIntsDisabled, tmp);
-  TimeIntsDisabled += t;
-  if(t > MaxTimeIntsDisabled)
-     MaxTimeIntsDisabled = t;
-  PercentIntsDisabled = (TimeIntsDisabled * 100) / GetMasterTime();
-  IntsEnabled = !sav;
+  if(sav == 0 && CritSite) {
+    CritRecord(CritSite, DWT_CYCCNT_R - CritStart);
+    CritSite = 0;
+  }
   #endif
   EndCriticalAsm(sav);
 }
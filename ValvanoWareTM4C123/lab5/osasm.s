@@ -16,12 +16,15 @@
 		EXPORT  PendSV_Handler
 		EXPORT  SVC_Handler
 		EXPORT  JumpAsm
+		EXPORT  SchedLockAsm
+		EXPORT  SchedUnlockAsm
 		
 		IMPORT OS_Id
 		IMPORT OS_Kill
 		IMPORT OS_Sleep
 		IMPORT OS_Time
 		IMPORT OS_AddThread
+		IMPORT Scheduler
 		
 		    ALIGN
 PF1    EQU     0x40025008
@@ -50,33 +53,11 @@ SysTick_Handler                ; 1) Saves R0-R3,R12,LR,PC,PSR
     LDR     R0, =RunPt         ; 4) R0=pointer to RunPt, old thread
     LDR     R1, [R0]           ;    R1 = RunPt
     STR     SP, [R1]           ; 5) Save SP into TCB
-	
-	LDR     R3, [R1,#4]        ; R3 is an iterator, R3 = RunPt->next
-	MOV     R5, R3             ; R5 nextThread
-	MOV     R4, #0x7FFFFFFF    ; R4 priority
-
-SysTick_Priority
-	LDR     R2, [R1,#16]       ; R3->sleep
-    CMP     R2, #0
-	BNE     SysTick_Next
-	LDR     R2, [R1,#28]       ; R3->blocked
-	CMP     R2, #0
-	BNE     SysTick_Next
-	LDR     R2, [R1,#24]       ; R3->pri
-	CMP     R2, R4             ; R2 < R4 ?
-	BGE     SysTick_Next
-SysTick_Update
-    MOV     R5, R3
-	MOV     R4, R2
-SysTick_Next
-    LDR     R3, [R3,#4]        ; increment
-	CMP     R3, R1
-	BNE     SysTick_Priority   ; R3 != RunPt
-	STR     R5, [R0]           ; update RunPt
-	LDR     SP, [R5]
-    LDR     R0, =ProcPt        ; R0 -> ProcPt
-	LDR     R1, [R5,#36]       ; Get current RunPt's pcb
-	STR     R5, [R0]	       ; Update ProcPt
+	PUSH    {R0,LR}
+	BL      Scheduler          ; 6) RunPt = next ready thread, updates ProcPt
+	POP     {R0,LR}
+	LDR     R1, [R0]           ;    R1 = RunPt, new thread
+	LDR     SP, [R1]           ; 7) new thread SP; SP = RunPt->sp;
 ;SysTick_Next_Thread
 ;    LDR     R1, [R1,#4]        ; 6) R1 = RunPt->next
 ;    LDR     R2, [R1,#16]       ; RunPt->next->sleep
@@ -112,34 +93,11 @@ PendSV_Handler                ; 1) Saves R0-R3,R12,LR,PC,PSR
     LDR     R0, =RunPt         ; 4) R0=pointer to RunPt, old thread
     LDR     R1, [R0]           ;    R1 = RunPt
     STR     SP, [R1]           ; 5) Save SP into TCB
-
-	LDR     R3, [R1,#4]        ; R3 is an iterator, R3 = RunPt->next
-	MOV     R1, R3
-	MOV     R5, R3             ; R5 nextThread
-	MOV     R4, #0x7FFFFFFF    ; R4 priority
-
-PendSV_Priority
-	LDR     R2, [R1,#16]       ; R3->sleep
-    CMP     R2, #0
-	BNE     PendSV_Next
-	LDR     R2, [R1,#28]       ; R3->blocked
-	CMP     R2, #0
-	BNE     PendSV_Next
-	LDR     R2, [R1,#24]       ; R3->pri
-	CMP     R2, R4             ; R2 < R4 ?
-	BGE     PendSV_Next
-PendSV_Update
-    MOV     R5, R3
-	MOV     R4, R2
-PendSV_Next
-    LDR     R3, [R3,#4]        ; increment
-	CMP     R3, R1
-	BNE     PendSV_Priority   ; R3 != RunPt
-	STR     R5, [R0]           ; update RunPt
-	LDR     SP, [R5]
-	LDR     R0, =ProcPt        ; R0 -> ProcPt
-	LDR     R1, [R5,#36]       ; Get current RunPt's pcb
-	STR     R5, [R0]	       ; Update ProcPt
+	PUSH    {R0,LR}
+	BL      Scheduler          ; 6) RunPt = next ready thread, updates ProcPt
+	POP     {R0,LR}
+	LDR     R1, [R0]           ;    R1 = RunPt, new thread
+	LDR     SP, [R1]           ; 7) new thread SP; SP = RunPt->sp;
 ;PendSV_Next_Thread
 ;    LDR     R1, [R1,#4]        ; 6) R1 = RunPt->next
 ;    LDR     R2, [R1,#16]       ; RunPt->next->sleep
@@ -178,6 +136,25 @@ JumpAsm
 	MOV 	R9, R2
 	BX		R0
 
+;*********** SchedLockAsm ************************
+; hold off PendSV (priority 6) and SysTick (priority 7), so no thread
+; switch happens, while every other interrupt stays enabled
+; inputs:  none
+; outputs: previous BASEPRI
+SchedLockAsm
+    MRS     R0, BASEPRI
+    MOV     R1, #0xC0          ; mask priority 6 and below
+    MSR     BASEPRI_MAX, R1    ; only raises the mask, nesting is fine
+    BX      LR
+
+;*********** SchedUnlockAsm ************************
+; restore BASEPRI from SchedLockAsm, a pending switch is taken now
+; inputs:  previous BASEPRI
+; outputs: none
+SchedUnlockAsm
+    MSR     BASEPRI, R0
+    BX      LR
+
 ;OS_Id 0
 ;OS_Kill 1
 ;OS_Sleep 2
@@ -0,0 +1,237 @@
+// pool.c
+// Runs on LM4F120/TM4C123, and on Linux under host/sim.c
+// Fixed block memory pools, see pool.h
+// Free blocks form a singly linked list through their first word, so
+// Pool_Alloc pops the head and Pool_Free pushes onto it. A lock free pool
+// does the same between LDREX and STREX. Any exception entry or return
+// clears the exclusive monitor, so if an ISR touched the list in between
+// the STREX fails and the step is simply tried again; with one core that
+// also rules out the ABA problem of a plain compare and swap. The host
+// has no exclusive monitor and masks interrupts instead.
+
+#include <stdint.h>
+
+#include "heap.h"
+#include "pool.h"
+
+#ifndef __ARMCC_VERSION
+long StartCriticalAsm(void);
+void EndCriticalAsm(long sr);
+#endif
+
+// atomicAdd
+// add to a counter of a lock free pool, returns the new value
+static uint32_t atomicAdd(volatile uint32_t* counter, int32_t n){
+  uint32_t value;
+#ifdef __ARMCC_VERSION
+  do{
+    value = __ldrex(counter) + n;
+  }while(__strex(value, counter));
+#else
+  long sr = StartCriticalAsm();
+  value = *counter += n;
+  EndCriticalAsm(sr);
+#endif
+  return value;
+}
+
+// atomicMax
+// raise a counter of a lock free pool to at least value
+static void atomicMax(volatile uint32_t* counter, uint32_t value){
+#ifdef __ARMCC_VERSION
+  do{
+    if(__ldrex(counter) >= value){
+      __clrex();
+      return;
+    }
+  }while(__strex(value, counter));
+#else
+  long sr = StartCriticalAsm();
+  if(*counter < value){
+    *counter = value;
+  }
+  EndCriticalAsm(sr);
+#endif
+}
+
+// pop
+// take the first free block off a lock free pool, NULL if there is none
+static void** pop(PoolType* pool){
+  void** block;
+#ifdef __ARMCC_VERSION
+  do{
+    block = (void**)__ldrex((volatile uint32_t*)&pool->freeList);
+    if(block == 0){
+      __clrex();
+      return 0;
+    }
+  }while(__strex((uint32_t)*block, (volatile uint32_t*)&pool->freeList));
+#else
+  long sr = StartCriticalAsm();
+  block = pool->freeList;
+  if(block){
+    pool->freeList = *block;
+  }
+  EndCriticalAsm(sr);
+#endif
+  return block;
+}
+
+// push
+// put a block at the front of the free list of a lock free pool
+static void push(PoolType* pool, void** block){
+#ifdef __ARMCC_VERSION
+  do{
+    *block = (void*)__ldrex((volatile uint32_t*)&pool->freeList);
+  }while(__strex((uint32_t)block, (volatile uint32_t*)&pool->freeList));
+#else
+  long sr = StartCriticalAsm();
+  *block = pool->freeList;
+  pool->freeList = block;
+  EndCriticalAsm(sr);
+#endif
+}
+
+// create
+// lay out a pool at the start of storage, taking storage from the heap
+// if there is none, and link every block onto the free list
+static PoolType* create(uint32_t blockSize, uint32_t count, void* storage, uint32_t flags){
+  PoolType* pool;
+  uint8_t* block;
+  uint32_t i;
+  blockSize = POOL_BLOCK_BYTES(blockSize);
+  if(storage == 0){
+    storage = Heap_Malloc(POOL_WORDS(blockSize, count)*4);
+    if(storage == 0){
+      return 0;
+    }
+    flags |= POOL_FROM_HEAP;
+  }
+  pool = storage;
+  pool->blocks = (uint8_t*)storage + (sizeof(PoolType) + 3)/4*4;
+  pool->blockSize = blockSize;
+  pool->count = count;
+  pool->flags = flags;
+  pool->used = 0;
+  pool->peak = 0;
+  pool->failures = 0;
+  pool->freeList = 0;
+  block = pool->blocks + count*blockSize;
+  for(i = 0; i < count; i++){   // lowest address first on the list
+    block -= blockSize;
+    *(void**)block = pool->freeList;
+    pool->freeList = block;
+  }
+  return pool;
+}
+
+//******** Pool_Create ***************
+// Make a pool of fixed size blocks
+// input:
+//   blockSize: bytes in each block, rounded up to a whole word
+//   count: number of blocks
+//   storage: POOL_WORDS(blockSize, count) words, word aligned, or NULL
+//     to take them from the heap
+// output: the pool, or NULL if the heap had no room
+// notes: the pool does no locking of its own; callers that share it
+//  must keep each other out, e.g. with a critical section
+PoolType* Pool_Create(uint32_t blockSize, uint32_t count, void* storage){
+  return create(blockSize, count, storage, 0);
+}
+
+//******** Pool_CreateLockFree ***************
+// Make a pool of fixed size blocks that threads and ISRs can share
+// input: as for Pool_Create
+// output: the pool, or NULL if the heap had no room
+// notes: Pool_Alloc and Pool_Free retry with LDREX/STREX instead of
+//  disabling interrupts, so an ISR can use the pool at any time
+PoolType* Pool_CreateLockFree(uint32_t blockSize, uint32_t count, void* storage){
+  return create(blockSize, count, storage, POOL_LOCKFREE);
+}
+
+//******** Pool_Alloc ***************
+// Take a block from a pool, data not initialized
+// input: the pool
+// output: pointer to the block, or NULL if every block is in use
+void* Pool_Alloc(PoolType* pool){
+  void** block;
+  if(pool->flags & POOL_LOCKFREE){
+    block = pop(pool);
+    if(block == 0){
+      atomicAdd(&pool->failures, 1);
+      return 0;
+    }
+    atomicMax(&pool->peak, atomicAdd(&pool->used, 1));
+    return block;
+  }
+  block = pool->freeList;
+  if(block == 0){
+    pool->failures++;
+    return 0;
+  }
+  pool->freeList = *block;
+  if(++pool->used > pool->peak){
+    pool->peak = pool->used;
+  }
+  return block;
+}
+
+//******** Pool_Free ***************
+// Give a block back to its pool
+// input: the pool, pointer to the block
+// output: POOL_OK, or POOL_ERROR_POINTER if the pointer is not the
+//   start of one of the pool's blocks
+// notes: a block freed twice is not caught
+int32_t Pool_Free(PoolType* pool, void* block){
+  uint32_t offset = (uint32_t)((uint8_t*)block - pool->blocks);
+  if((uint8_t*)block < pool->blocks || offset >= pool->count*pool->blockSize ||
+     offset % pool->blockSize){
+    return POOL_ERROR_POINTER;
+  }
+  if(pool->flags & POOL_LOCKFREE){
+    push(pool, block);
+    atomicAdd(&pool->used, -1);
+    return POOL_OK;
+  }
+  *(void**)block = pool->freeList;
+  pool->freeList = block;
+  pool->used--;
+  return POOL_OK;
+}
+
+//******** Pool_Destroy ***************
+// Give a pool's storage back to the heap, if it came from there
+// input: the pool
+// output: 1 if done, 0 if blocks are still in use
+int32_t Pool_Destroy(PoolType* pool){
+  if(pool->used){
+    return 0;
+  }
+  if(pool->flags & POOL_FROM_HEAP){
+    Heap_Free(pool);
+  }
+  return 1;
+}
+
+//******** Pool_Stats ***************
+// Return the usage of a pool
+// input: the pool
+// output: a pool_stats_t describing it
+pool_stats_t Pool_Stats(PoolType* pool){
+  pool_stats_t stats;
+  stats.blockSize = pool->blockSize;
+  stats.count = pool->count;
+  stats.used = pool->used;
+  stats.peak = pool->peak;
+  stats.failures = pool->failures;
+  return stats;
+}
+
+//******** Pool_ResetStats ***************
+// Start the peak and failure counts again from now
+// input: the pool
+// output: none
+void Pool_ResetStats(PoolType* pool){
+  pool->peak = pool->used;
+  pool->failures = 0;
+}
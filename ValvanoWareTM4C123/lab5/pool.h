@@ -0,0 +1,105 @@
+// pool.h
+// Runs on LM4F120/TM4C123, and on Linux under host/sim.c
+// Fixed block memory pools. Each pool hands out blocks of one size from
+// its own storage in constant time, like the single pool of
+// HeapFixedBlock_4C123, and keeps its own usage counts. Pools suit
+// kernel objects and message buffers whose size is known up front.
+
+#ifndef __POOL_H
+#define __POOL_H  1
+
+#include <stdint.h>
+
+#define POOL_OK 0
+#define POOL_ERROR_POINTER 1  // not a block of this pool
+
+#define POOL_LOCKFREE 1       // flag, safe from threads and ISRs at once
+#define POOL_FROM_HEAP 2      // flag, storage came from Heap_Malloc
+
+// one pool, kept at the start of its storage; the fields are private
+typedef struct pool {
+  void* volatile freeList;    // first free block, its first word links the next
+  uint8_t* blocks;            // first block
+  uint32_t blockSize;         // bytes, a multiple of 4
+  uint32_t count;
+  uint32_t flags;
+  volatile uint32_t used;
+  volatile uint32_t peak;
+  volatile uint32_t failures;
+} PoolType;
+
+// statistics on one pool, filled in by Pool_Stats
+typedef struct pool_stats {
+  uint32_t blockSize;         // bytes per block, after rounding
+  uint32_t count;             // blocks in the pool
+  uint32_t used;              // blocks handed out now
+  uint32_t peak;              // most blocks ever handed out at once
+  uint32_t failures;          // Pool_Alloc calls that found the pool empty
+} pool_stats_t;
+
+// words of storage a pool of count blocks of size bytes needs, e.g.
+//   static uint32_t MsgStorage[POOL_WORDS(sizeof(msgType), 16)];
+#define POOL_BLOCK_BYTES(size) ((size) < 4 ? 4 : ((size) + 3) & ~3)
+#define POOL_WORDS(size, count) \
+  ((sizeof(PoolType) + 3)/4 + (count)*POOL_BLOCK_BYTES(size)/4)
+
+//******** Pool_Create ***************
+// Make a pool of fixed size blocks
+// input:
+//   blockSize: bytes in each block, rounded up to a whole word
+//   count: number of blocks
+//   storage: POOL_WORDS(blockSize, count) words, word aligned, or NULL
+//     to take them from the heap
+// output: the pool, or NULL if the heap had no room
+// notes: the pool does no locking of its own; callers that share it
+//  must keep each other out, e.g. with a critical section
+PoolType* Pool_Create(uint32_t blockSize, uint32_t count, void* storage);
+
+
+//******** Pool_CreateLockFree ***************
+// Make a pool of fixed size blocks that threads and ISRs can share
+// input: as for Pool_Create
+// output: the pool, or NULL if the heap had no room
+// notes: Pool_Alloc and Pool_Free retry with LDREX/STREX instead of
+//  disabling interrupts, so an ISR can use the pool at any time
+PoolType* Pool_CreateLockFree(uint32_t blockSize, uint32_t count, void* storage);
+
+
+//******** Pool_Alloc ***************
+// Take a block from a pool, data not initialized
+// input: the pool
+// output: pointer to the block, or NULL if every block is in use
+void* Pool_Alloc(PoolType* pool);
+
+
+//******** Pool_Free ***************
+// Give a block back to its pool
+// input: the pool, pointer to the block
+// output: POOL_OK, or POOL_ERROR_POINTER if the pointer is not the
+//   start of one of the pool's blocks
+// notes: a block freed twice is not caught
+int32_t Pool_Free(PoolType* pool, void* block);
+
+
+//******** Pool_Destroy ***************
+// Give a pool's storage back to the heap, if it came from there
+// input: the pool
+// output: 1 if done, 0 if blocks are still in use
+int32_t Pool_Destroy(PoolType* pool);
+
+
+//******** Pool_Stats ***************
+// Return the usage of a pool
+// input: the pool
+// output: a pool_stats_t describing it
+pool_stats_t Pool_Stats(PoolType* pool);
+
+
+//******** Pool_ResetStats ***************
+// Start the peak and failure counts again from now
+// input: the pool
+// output: none
+void Pool_ResetStats(PoolType* pool);
+
+
+#endif
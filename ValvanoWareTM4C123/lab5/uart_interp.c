@@ -41,6 +41,8 @@
 #include "proc_cmdLine.h"
 #include "UART.h"
 #include "cmdLine.h"
+#include "heap.h"
+#include "jitter.h"
 
 static const char UP_ARROW[4] = {27,91,65, '\0'};
 
@@ -56,11 +58,23 @@ static char *cur_cmd_line_ptr = cmd_line_buff[0];
 static int cur_cmd_line_indx = 0;
 static int cmd_line_buff_tail = 0;
 
+#define HEAP_MAP_MAX 128    // blocks the heap command can show
+#define HEAP_OWNERS  16     // owners it adds up, the rest are lumped in
+static uint32_t heap_map[HEAP_MAP_MAX];
+
 static void read_cmd_line(void);
 static void put_cmd_line(char *cmd_line);
 static void show_prev_cmd_line(int *cmd_line_len);
 static void show_next_cmd_line(int *cmd_line_len);
 static void show_cmd_line(int *cmd_line_len, int prev);
+static void stack_cmd(void);
+static void trace_cmd(void);
+static void top_cmd(void);
+static void jitter_cmd(void);
+static void heap_cmd(void);
+#if DEBUG
+static void crit_cmd(void);
+#endif
 
 void Interpreter(void) {		
   while(true) {
@@ -75,6 +89,20 @@ void Interpreter(void) {
       lcd_runComm(argc, argv);
 		else if(strcmp(argv[0], "proc") == 0)
 			proc_runComm(argc, argv);
+    else if(strcmp(argv[0], "stack") == 0)
+      stack_cmd();
+    else if(strcmp(argv[0], "trace") == 0)
+      trace_cmd();
+    else if(strcmp(argv[0], "top") == 0)
+      top_cmd();
+    else if(strcmp(argv[0], "jitter") == 0)
+      jitter_cmd();
+    else if(strcmp(argv[0], "heap") == 0)
+      heap_cmd();
+#if DEBUG
+    else if(strcmp(argv[0], "crit") == 0)
+      crit_cmd();
+#endif
     else if(strcmp(argv[0], "") != 0)
       printf("Command not found. Enter \"quit\" to quit.");
   }
@@ -139,3 +167,168 @@ static void show_cmd_line(int *cmd_line_len, int prev) {
 	cur_cmd_line_ptr = (char*) &cmd_line_buff[cur_cmd_line_indx];
 	UART_OutString(cur_cmd_line_ptr);	
 }
+
+// stack: peak stack usage of every live thread
+static void stack_cmd(void) {
+  stackInfoType info;
+  printf("  id pri  size  peak    %%\r\n");
+  for(int i = 0; i < OS_MaxThreads(); ++i) {
+    if(!OS_StackInfo(i, &info))
+      continue;
+    printf("%4lu %3ld %5lu %5lu %3lu%%%s\r\n", (unsigned long) info.id,
+      (long) info.pri, (unsigned long) info.words*4, (unsigned long) info.peak*4,
+      (unsigned long) (info.peak*100/info.words), info.overflow ? " OVERFLOW" : "");
+  }
+}
+
+// trace: binary dump of the kernel trace ring, "trace clear" empties it
+static void trace_cmd(void) {
+  if(argc > 1 && strcmp(argv[1], "clear") == 0)
+    OS_TraceClear();
+  else
+    OS_TraceDump();
+}
+
+// top: CPU share of every live thread and interrupt source since the
+// last top, in tenths of a percent; idle is the time of the thread that
+// called OS_SetIdle, 0 if none did
+static void top_cmd(void) {
+  cpuInfoType info;
+  isrInfoType isr;
+  uint64_t window = OS_CpuWindow(), idle = 0;
+  unsigned long pm, switches = 0;
+  if(window == 0)
+    return;
+  printf("  id pri   cpu%% switches\r\n");
+  for(int i = 0; i < OS_MaxThreads(); ++i) {
+    if(!OS_CpuInfo(i, &info))
+      continue;
+    pm = (unsigned long) (info.cycles*1000/window);
+    printf("%4lu %3ld %4lu.%lu %8lu\r\n", (unsigned long) info.id, (long) info.pri,
+      pm/10, pm%10, (unsigned long) info.switches);
+    switches += info.switches;
+    if(info.idle)
+      idle += info.cycles;
+  }
+  for(int n = 0; OS_IsrInfo(n, &isr); ++n) {
+    pm = (unsigned long) (isr.cycles*1000/window);
+    printf(" irq %3lu %4lu.%lu %8lu runs\r\n", (unsigned long) isr.irq,
+      pm/10, pm%10, (unsigned long) isr.count);
+  }
+  pm = (unsigned long) (idle*1000/window);
+  printf("idle %lu.%lu%%, %lu switches in %lu ms\r\n", pm/10, pm%10, switches,
+    (unsigned long) (window/TIME_1MS));
+  OS_CpuReset();
+}
+
+// jitter: every jitter probe, times in 0.1 us; "jitter clear" resets them
+static void jitter_cmd(void) {
+  jitterStatsType js;
+  int clear = argc > 1 && strcmp(argv[1], "clear") == 0;
+  if(!clear)
+    printf("name         period    count    max   p50   p99  mean   std\r\n");
+  for(JitterProbeType *p = Jitter_First(); p; p = p->next) {
+    if(clear) {
+      Jitter_Reset(p);
+      continue;
+    }
+    Jitter_Stats(p, &js);
+    printf("%-12s %6lu %8lu %6lu %5lu %5lu %5ld %5lu\r\n", p->name,
+      (unsigned long) (p->period+4)/8, (unsigned long) js.count,
+      (unsigned long) (js.max+4)/8, (unsigned long) (js.p50+4)/8,
+      (unsigned long) (js.p99+4)/8, (long) js.mean/8, (unsigned long) (js.stddev+4)/8);
+  }
+}
+
+static void out_word(uint32_t n) {
+  for(int i = 0; i < 4; ++i, n >>= 8)
+    UART_OutChar(n & 0xFF);
+}
+
+// heap: use, free block sizes and bytes held per owner; "heap dump"
+// sends the block map in binary instead: "HEAP", heap bytes, header
+// bytes per block, blocks in the heap, blocks sent, then one Heap_Map
+// entry per block sent, all 4 bytes little endian. Only the first
+// HEAP_MAP_MAX blocks fit in heap_map. host/heapmap.c draws it
+static void heap_cmd(void) {
+  heap_frag_t f;
+  uint16_t tag[HEAP_OWNERS];
+  long blocks[HEAP_OWNERS], bytes[HEAP_OWNERS];
+  int owners = 0, o;
+  int32_t n, shown;
+  if(Heap_Analyze(&f) != HEAP_OK || (n = Heap_Map(heap_map, HEAP_MAP_MAX)) < 0) {
+    printf("heap corrupted\r\n");
+    return;
+  }
+  shown = n < HEAP_MAP_MAX ? n : HEAP_MAP_MAX;
+  if(argc > 1 && strcmp(argv[1], "dump") == 0) {
+    UART_OutString("HEAP");
+    out_word(HEAP_SIZE_BYTES);
+    out_word(f.headerBytes);
+    out_word(n);
+    out_word(shown);
+    for(int i = 0; i < shown; ++i)
+      out_word(heap_map[i]);
+    return;
+  }
+  printf("used %ld in %ld blocks (%ld cached), free %ld in %ld blocks\r\n",
+    (long) f.usedBytes, (long) f.usedBlocks, (long) f.cachedBytes,
+    (long) f.freeBytes, (long) f.freeBlocks);
+  printf("largest free %ld, fragmentation %ld.%ld%%\r\n", (long) f.largestFree,
+    (long) f.fragmentation/10, (long) f.fragmentation%10);
+  printf("free blocks, from bytes:count");
+  for(int k = 0; k < HEAP_HIST_BUCKETS; ++k) {
+    if(f.histogram[k])
+      printf(" %d:%ld", 8 << k, (long) f.histogram[k]);
+  }
+  printf("\r\n pid  id blocks  bytes\r\n");
+  for(int i = 0; i < shown; ++i) {
+    uint32_t e = heap_map[i];
+    if(e & HEAP_ENTRY_FREE)
+      continue;
+    for(o = 0; o < owners && tag[o] != e >> 16; ++o)
+      ;
+    if(o == owners) {
+      if(owners == HEAP_OWNERS)
+        o = HEAP_OWNERS - 1;     // out of room, count it with the last
+      else {
+        tag[owners++] = e >> 16;
+        blocks[o] = bytes[o] = 0;
+      }
+    }
+    blocks[o]++;
+    bytes[o] += HEAP_ENTRY_SIZE(e);
+  }
+  for(o = 0; o < owners; ++o) {
+    if(tag[o] == HEAP_TAG_NONE)
+      printf("   -   - %6ld %6ld\r\n", blocks[o], bytes[o]);
+    else
+      printf("%4u %3u %6ld %6ld\r\n", tag[o] >> 8, tag[o] & 0xFF, blocks[o], bytes[o]);
+  }
+  if(n > shown)
+    printf("first %ld of %ld blocks shown\r\n", (long) shown, (long) n);
+}
+
+#if DEBUG
+// crit: the ten critical section call sites that held interrupts off
+// longest, with counts per power of 2 cycle bucket; "crit clear" resets
+static void crit_cmd(void) {
+  critSiteType c;
+  if(argc > 1 && strcmp(argv[1], "clear") == 0) {
+    OS_CritReset();
+    return;
+  }
+  printf("off %d%%, longest %d cycles\r\n", OS_PercentIntsDisabled(),
+    OS_MaxTimeIntsDisabled());
+  printf("      site    count   max  avg  histogram (<2^k cycles: count)\r\n");
+  for(int rank = 0; rank < 10 && OS_CritSite(rank, &c); ++rank) {
+    printf("0x%08lx %8lu %5lu %4lu ", c.site, c.count, c.max,
+      (unsigned long) (c.total/c.count));
+    for(int k = 0; k < CRIT_BUCKETS; ++k) {
+      if(c.histogram[k])
+        printf(" %d:%lu", k, c.histogram[k]);
+    }
+    printf("\r\n");
+  }
+}
+#endif